@@ -1,51 +1,38 @@
 #include "av.h"
 #include "draw.h"
 #include "playback/playback.h"
+#include "playback/utils.h"
+#include "trace.h"
+#include "bench.h"
 #include <SDL2/SDL_assert.h>
 #include <SDL2/SDL_atomic.h>
 #include <SDL2/SDL_audio.h>
 #include <SDL2/SDL_mutex.h>
 #include <SDL2/SDL_thread.h>
 #include <libavcodec/avcodec.h>
+#include <getopt.h>
+#include <errno.h>
 
 bool quit = false;
 
-#define DBG_TIMER(NAME) \
-    static struct timespec dbg_timer_start ## NAME, dbg_timer_end ## NAME; \
-
-#define DBG_TIMER_START(NAME) \
-    clock_gettime(CLOCK_MONOTONIC, &dbg_timer_start ## NAME); \
-
-#define DBG_TIMER_END(NAME) \
-    clock_gettime(CLOCK_MONOTONIC, &(dbg_timer_end ## NAME)); \
-    printf( \
-        "%s timer: %lf\n", \
-        #NAME, \
-        (double) dbg_timer_start ## NAME.tv_sec - \
-        dbg_timer_end ## NAME.tv_sec + \
-        (dbg_timer_end ## NAME.tv_nsec - dbg_timer_start ## NAME.tv_nsec) / \
-        1000000000.0 \
-    ); \
-
-
 #define SDL_AUDIO_FMT AUDIO_S16SYS
 #define SDL_AUDIO_SAMPLES 1024
 
-#define TIMELINE_HEIGHT 38
+#define THUMBNAIL_HEIGHT 48
+#define THUMBNAIL_SPACING 0.5 /* seconds */
+#define TIMELINE_HEIGHT (20 + THUMBNAIL_HEIGHT + WAVEFORM_HEIGHT)
 #define PROGRESS_HEIGHT 20
 
-double t2sec(struct timespec spec) {
-    return spec.tv_sec + spec.tv_nsec / 1000000000.0;
-}
-
 enum EventType {
     EVENT_NONE,
     EVENT_PAUSE,
+    EVENT_PLAY, /* in direction */
     EVENT_SEEK_REL,
     EVENT_SEEK,
     EVENT_NEXT_FRAME,
     EVENT_PREV_FRAME,
     EVENT_RESIZE,
+    EVENT_TOGGLE_TRACE,
     EVENT_QUIT
 };
 
@@ -54,6 +41,7 @@ struct Event {
     union {
         double seconds;
         double position;
+        int direction; /* 1 forward, -1 backward */
         struct {
             int w, h;
         };
@@ -151,6 +139,25 @@ static void handle_sdl_event(
                 case SDLK_SPACE:
                     queue_event( eventq, (struct Event){ .type = EVENT_PAUSE });
                     break;
+                /* shuttle keys, as in most editors */
+                case SDLK_j:
+                    queue_event( eventq, (struct Event){ EVENT_PLAY, .direction = -1 });
+                    break;
+                case SDLK_k:
+                    queue_event( eventq, (struct Event){ .type = EVENT_PAUSE });
+                    break;
+                case SDLK_l:
+                    queue_event( eventq, (struct Event){ EVENT_PLAY, .direction = 1 });
+                    break;
+                case SDLK_LEFT:
+                    queue_event( eventq, (struct Event){ .type = EVENT_PREV_FRAME });
+                    break;
+                case SDLK_RIGHT:
+                    queue_event( eventq, (struct Event){ .type = EVENT_NEXT_FRAME });
+                    break;
+                case SDLK_t:
+                    queue_event( eventq, (struct Event){ .type = EVENT_TOGGLE_TRACE });
+                    break;
                 case SDLK_ESCAPE:
                     queue_event( eventq, (struct Event){ .type = EVENT_QUIT });
                     break;
@@ -209,6 +216,15 @@ static void handle_input(
     }
 }
 
+/* t is CLOCK_MONOTONIC time in seconds */
+static void sleep_until(double t) {
+    struct timespec deadline = {
+        .tv_sec = t,
+        .tv_nsec = (t - (time_t) t) * 1000000000.0
+    };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR);
+}
+
 static TTF_Font * default_font(int size) {
     return TTF_OpenFont("fonts/RobotoMono-Regular.ttf", size);
 }
@@ -231,13 +247,226 @@ int init_sdl(SDL_Renderer ** renderer, SDL_Window ** window) {
 }
 
 
-int main(int argc, char * argv[]) {
+static void print_usage(const char * argv0) {
+    fprintf(stderr,
+        "usage: %s [options] file\n"
+        "  --decode-threads N   video decoder threads (default: one per core)\n"
+        "  --gop-decoders N     decode N closed gops in parallel (default: off)\n"
+        "  --intra-decoders N   parallel decoders for intra-only codecs\n"
+        "                       (default: one per core)\n"
+        "  --cache-frames N     decoded frames kept either side of the current one,\n"
+        "                       for stepping and playing backwards (default: 32)\n"
+        "  --frame-cache SIZE   memory for decoded frames kept around for scrubbing,\n"
+        "                       e.g. 512M or 2G (default: 512M)\n"
+        "  --io MODE            how the file is read: mmap, readahead (a thread\n"
+        "                       reading big blocks ahead, for network or spinning\n"
+        "                       disks), ffmpeg, or auto (default: readahead on\n"
+        "                       network filesystems, mmap otherwise)\n"
+        "  --readahead SIZE     how far ahead to read, e.g. 64M (default: 64M)\n"
+        "  --stats              print cache and clock statistics on exit\n"
+        "  --trace FILE         record a chrome trace (chrome://tracing, perfetto)\n"
+        "                       and write it to FILE on exit. t toggles tracing\n"
+        "                       while playing\n"
+        "  --bench              decode and convert the whole file as fast as\n"
+        "                       possible without a window, and print throughput,\n"
+        "                       per-stage times and memory use as json\n",
+        argv0
+    );
+}
 
-    if (argc < 2) {
+/* a byte count with an optional K, M or G suffix, or 0 if it's invalid */
+static size_t parse_size(const char * str) {
+    char * end;
+    double size = strtod(str, &end);
+    switch (*end) {
+        case 'k': case 'K': size *= 1 << 10; end++; break;
+        case 'm': case 'M': size *= 1 << 20; end++; break;
+        case 'g': case 'G': size *= 1 << 30; end++; break;
+    }
+    if ((end == str) || *end || (size < 1)) return 0;
+    return size;
+}
+
+struct Options {
+    struct PlaybackOptions playback;
+    bool print_stats;
+    bool bench;
+    const char * trace_path; /* NULL if not tracing */
+};
+
+/* returns the index of the filename argument, or -1 */
+static int parse_options(int argc, char * argv[], struct Options * opts) {
+    enum {
+        OPT_DECODE_THREADS = 256, OPT_GOP_DECODERS, OPT_INTRA_DECODERS,
+        OPT_CACHE_FRAMES, OPT_FRAME_CACHE, OPT_IO, OPT_READAHEAD,
+        OPT_STATS, OPT_TRACE, OPT_BENCH
+    };
+    const struct option long_options[] = {
+        { "decode-threads", required_argument, NULL, OPT_DECODE_THREADS },
+        { "gop-decoders", required_argument, NULL, OPT_GOP_DECODERS },
+        { "intra-decoders", required_argument, NULL, OPT_INTRA_DECODERS },
+        { "cache-frames", required_argument, NULL, OPT_CACHE_FRAMES },
+        { "frame-cache", required_argument, NULL, OPT_FRAME_CACHE },
+        { "io", required_argument, NULL, OPT_IO },
+        { "readahead", required_argument, NULL, OPT_READAHEAD },
+        { "stats", no_argument, NULL, OPT_STATS },
+        { "trace", required_argument, NULL, OPT_TRACE },
+        { "bench", no_argument, NULL, OPT_BENCH },
+        { 0 }
+    };
+
+    *opts = (struct Options) { .trace_path = NULL };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (opt) {
+            case OPT_DECODE_THREADS:
+                opts->playback.decode_threads = atoi(optarg);
+                if (opts->playback.decode_threads < 0) {
+                    fprintf(stderr, "--decode-threads must be 0 or more\n");
+                    return -1;
+                }
+                break;
+            case OPT_GOP_DECODERS:
+                opts->playback.gop_decoders = atoi(optarg);
+                if (opts->playback.gop_decoders < 0) {
+                    fprintf(stderr, "--gop-decoders must be 0 or more\n");
+                    return -1;
+                }
+                break;
+            case OPT_INTRA_DECODERS:
+                opts->playback.intra_decoders = atoi(optarg);
+                if (opts->playback.intra_decoders < 0) {
+                    fprintf(stderr, "--intra-decoders must be 0 or more\n");
+                    return -1;
+                }
+                break;
+            case OPT_CACHE_FRAMES:
+                opts->playback.cache_frames = atoi(optarg);
+                if (opts->playback.cache_frames < 0) {
+                    fprintf(stderr, "--cache-frames must be 0 or more\n");
+                    return -1;
+                }
+                break;
+            case OPT_FRAME_CACHE:
+                opts->playback.frame_cache_bytes = parse_size(optarg);
+                if (opts->playback.frame_cache_bytes == 0) {
+                    fprintf(stderr, "--frame-cache takes a size like 512M or 2G\n");
+                    return -1;
+                }
+                break;
+            case OPT_IO:
+                for (enum FileIoMode mode = FILE_IO_AUTO; mode <= FILE_IO_FFMPEG; mode++)
+                    if (!strcmp(optarg, file_io_mode_name(mode)))
+                        opts->playback.io_mode = mode;
+                if (strcmp(optarg, file_io_mode_name(opts->playback.io_mode))) {
+                    fprintf(stderr, "--io takes auto, mmap, readahead or ffmpeg\n");
+                    return -1;
+                }
+                break;
+            case OPT_READAHEAD:
+                opts->playback.readahead_bytes = parse_size(optarg);
+                if (opts->playback.readahead_bytes == 0) {
+                    fprintf(stderr, "--readahead takes a size like 16M or 256M\n");
+                    return -1;
+                }
+                break;
+            case OPT_STATS:
+                opts->print_stats = true;
+                break;
+            case OPT_TRACE:
+                opts->trace_path = optarg;
+                break;
+            case OPT_BENCH:
+                opts->bench = true;
+                break;
+            default:
+                return -1;
+        }
+    }
+
+    if (optind >= argc) {
         fprintf(stderr, "provide filename\n\n");
         return -1;
     }
-    char * filename = argv[1];
+    return optind;
+}
+
+struct OpenInfo {
+    char * filename;
+    const struct PlaybackOptions * opts;
+    struct PlaybackCtx * pb_ctx; /* NULL if it failed */
+    SDL_atomic_t done;
+};
+
+static int thread_open(void * data) {
+    struct OpenInfo * info = data;
+    trace_thread_name("opener");
+    info->pb_ctx = open_for_playback(info->filename, info->opts);
+    SDL_AtomicSet(&info->done, 1);
+    return 0;
+}
+
+/* probing a big file can take a while, so it's opened on another thread
+ * while the window is drawn and can be closed. returns NULL if opening
+ * failed or we quit first */
+static struct PlaybackCtx * open_in_background(
+    char * filename, const struct PlaybackOptions * opts,
+    SDL_Window * window, SDL_Renderer * renderer,
+    struct GlyphAtlas * glyphs, struct ColorScheme * colors
+) {
+    struct OpenInfo info = { .filename = filename, .opts = opts, .pb_ctx = NULL };
+    SDL_AtomicSet(&info.done, 0);
+    SDL_Thread * opener = SDL_CreateThread(thread_open, "Opener", &info);
+    if (opener == NULL) {
+        /* the window just won't respond until it's open */
+        fprintf(stderr, "couldn't open in the background: %s\n", SDL_GetError());
+        return open_for_playback(filename, opts);
+    }
+
+    while (!SDL_AtomicGet(&info.done)) {
+        int w, h;
+        SDL_GetWindowSize(window, &w, &h);
+        draw_background(renderer, colors);
+        draw_text(glyphs, "opening...", colors->fg[2], ALIGN_CENTER, w / 2, h / 2);
+        flush_text(renderer, glyphs);
+        SDL_RenderPresent(renderer);
+
+        SDL_Event event;
+        if (!SDL_WaitEventTimeout(&event, 16)) continue;
+        if ((event.type == SDL_QUIT) ||
+            ((event.type == SDL_KEYDOWN) && (event.key.keysym.sym == SDLK_ESCAPE)))
+            quit = true;
+    }
+    SDL_WaitThread(opener, NULL);
+
+    if (quit && info.pb_ctx) {
+        destroy_playback_ctx(info.pb_ctx);
+        return NULL;
+    }
+    return info.pb_ctx;
+}
+
+int main(int argc, char * argv[]) {
+
+    struct Options opts;
+    int file_arg = parse_options(argc, argv, &opts);
+    if (file_arg < 0) {
+        print_usage(argv[0]);
+        return -1;
+    }
+    const char * trace_path = opts.trace_path;
+
+    /* before anything starts so opening is traced too */
+    trace_thread_name("main");
+    if (trace_path) trace_set_enabled(true);
+    char * filename = argv[file_arg];
+
+    if (opts.bench) {
+        int ret = run_benchmark(filename, &opts.playback);
+        if (trace_path) trace_dump(trace_path);
+        return ret;
+    }
 
     SDL_Renderer * renderer;
     SDL_Window * window;
@@ -246,11 +475,20 @@ int main(int argc, char * argv[]) {
 
     TTF_Init();
     TTF_Font * font = default_font(13);
-
-    struct PlaybackCtx * pb_ctx = open_for_playback(filename);
+    struct GlyphAtlas * glyphs = create_glyph_atlas(renderer, font);
 
     struct ColorScheme colors = default_colors();
 
+    struct PlaybackCtx * pb_ctx =
+        open_in_background(filename, &opts.playback, window, renderer, glyphs, &colors);
+    if (pb_ctx == NULL) {
+        destroy_glyph_atlas(glyphs);
+        TTF_CloseFont(font);
+        SDL_DestroyRenderer(renderer);
+        SDL_DestroyWindow(window);
+        SDL_Quit();
+        return quit ? 0 : -1;
+    }
 
     struct Layout layout;
     {
@@ -266,29 +504,45 @@ int main(int argc, char * argv[]) {
 
     int64_t ts = pb_ctx->start_time;
     int64_t next_pts = ts;
-    int64_t pts, dur;
+    int direction = 1;
+    int64_t pts = ts, dur = 0;
     double min_frame_time = 1.0/144.0;
 
     bool paused = true;
 
     struct EventQueue eventq = create_event_queue();
     
-    SDL_Texture * video_tex = SDL_CreateTexture(
-        renderer, SDL_PIXELFORMAT_RGB24, SDL_TEXTUREACCESS_STREAMING,
-        pb_ctx->width, pb_ctx->height
-    );
+    SDL_Texture * video_tex = create_video_texture(pb_ctx, renderer);
+    if (video_tex == NULL) {
+        fprintf(stderr, "failed to create video texture: %s\n", SDL_GetError());
+        destroy_playback_ctx(pb_ctx);
+        destroy_glyph_atlas(glyphs);
+        TTF_CloseFont(font);
+        SDL_DestroyRenderer(renderer);
+        SDL_DestroyWindow(window);
+        SDL_Quit();
+        return -1;
+    }
 
-    advance_frame(pb_ctx);
+    /* decodes and shows the first frame even though we start paused.
+     * asked for before the thumbnails and waveform start reading the file */
+    seek(pb_ctx, ts);
+
+    /* fills in while we play */
+    struct ThumbnailStrip * thumbs =
+        create_thumbnail_strip(filename, THUMBNAIL_HEIGHT, THUMBNAIL_SPACING);
+    struct Waveform * wave = create_waveform(filename);
 
     while (!quit) {
 
-        struct timespec frame_start, frame_finish;
-        double elapsed;
-        clock_gettime(CLOCK_MONOTONIC, &frame_start);
+        double frame_start = mono_now();
         #define SECS(TIME_BASE) av_q2d(av_mul_q((AVRational) { (TIME_BASE), 1 }, pb_ctx->time_base))
         #define TIME_BASE(SECS) av_q2d(av_div_q( av_d2q(SECS, 0xffff), pb_ctx->time_base))
 
-        handle_input(&eventq, &layout);
+        {
+            TRACE_SCOPE("input");
+            handle_input(&eventq, &layout);
+        }
 
         struct Event event = poll_events(&eventq);
         switch (event.type) {
@@ -299,6 +553,26 @@ int main(int argc, char * argv[]) {
 
             case EVENT_PAUSE: 
                 paused = !paused; 
+                set_paused(pb_ctx, paused);
+                break;
+
+            case EVENT_PLAY:
+                paused = false;
+                direction = event.direction;
+                next_pts = pts + dur;
+                set_direction(pb_ctx, direction);
+                set_paused(pb_ctx, paused);
+                break;
+
+            case EVENT_TOGGLE_TRACE:
+                if (atomic_load(&trace_on)) {
+                    trace_set_enabled(false);
+                    const char * path = trace_path ? trace_path : "trace.json";
+                    if (trace_dump(path) == 0)
+                        fprintf(stderr, "wrote trace to %s\n", path);
+                } else {
+                    trace_set_enabled(true);
+                }
                 break;
 
             case EVENT_RESIZE:
@@ -308,9 +582,17 @@ int main(int argc, char * argv[]) {
                     TIMELINE_HEIGHT, PROGRESS_HEIGHT
                 );
                 break;
+            case EVENT_NEXT_FRAME:
+                paused = true;
+                set_paused(pb_ctx, paused);
+                advance_frame(pb_ctx);
+                break;
+
             case EVENT_PREV_FRAME:
-                ts = pts;
-                goto seek_to_ts;
+                paused = true;
+                set_paused(pb_ctx, paused);
+                step_back(pb_ctx);
+                break;
 
             case EVENT_SEEK:
                 ts = event.position * pb_ctx->duration;
@@ -326,41 +608,105 @@ int main(int argc, char * argv[]) {
                 break;
         }
 
-        if (ts >= next_pts) {
-            if (get_frame(pb_ctx, video_tex, &pts, &dur) || !paused) {
-                draw_background(renderer, &colors);
-                SDL_RenderCopy(renderer, video_tex, NULL, &layout.viewer_rect);
-            }
-            if (!paused) {
-                next_pts = pts + dur;
-                advance_frame(pb_ctx);
-            }
+        ts = get_playback_time(pb_ctx);
+        if (ts < pb_ctx->start_time) {
+            /* played backwards to the start */
+            ts = pb_ctx->start_time;
+            paused = true;
+            set_paused(pb_ctx, paused);
+            set_playback_time(pb_ctx, ts);
+        }
+
+        /* only uploads to video_tex if the frame changed,
+         * e.g. because a seek finished while paused */
+        bool new_frame = get_frame(pb_ctx, video_tex, &pts, &dur);
+
+        /* stepped or seeked, keep the timeline on the frame */
+        if (paused && new_frame) {
+            ts = pts;
+            next_pts = pts + dur;
+            set_playback_time(pb_ctx, ts);
         }
 
+        if (!paused && direction > 0 && ts >= next_pts) {
+            next_pts = pts + dur;
+            advance_to(pb_ctx, ts);
+        } else if (!paused && direction < 0 && ts < pts) {
+            /* ignored until the previous frame is decoded, so ask every time */
+            step_back(pb_ctx);
+        }
+
+        struct TraceSpan draw_span = trace_span_begin("draw");
+        thumbnails_update(thumbs, renderer);
+
+        draw_background(renderer, &colors);
+        SDL_RenderCopy(renderer, video_tex, NULL, &layout.viewer_rect);
+
         draw_progress(
             renderer, layout.progress_rect, 
             SECS(ts), SECS(pb_ctx->duration),
             &colors
         );
         draw_timeline(
-            renderer, font, layout.timeline_rect,
+            renderer, glyphs, layout.timeline_rect,
             SECS(pb_ctx->start_time), SECS(ts),
-            SECS(pb_ctx->duration), &colors
+            SECS(pb_ctx->duration), thumbs, wave, &colors
         );
-        SDL_RenderPresent(renderer);
-
-        do {
-            clock_gettime(CLOCK_MONOTONIC, &frame_finish);
-            elapsed = frame_finish.tv_sec - frame_start.tv_sec + (frame_finish.tv_nsec - frame_start.tv_nsec) / 1000000000.0;
-        } while (elapsed < min_frame_time);
+        trace_span_end(&draw_span);
+        {
+            TRACE_SCOPE("present");
+            SDL_RenderPresent(renderer);
+        }
 
+        /* sleep until it's time to redraw the ui, or earlier if the
+         * next frame is due before that */
+        double wake = frame_start + min_frame_time;
         if (!paused) {
-            ts += elapsed/av_q2d(pb_ctx->time_base);
+            double due = direction > 0 ?
+                SECS(next_pts) - SECS(ts) : SECS(ts) - SECS(pts);
+            if (due > 0) wake = MIN(wake, frame_start + due);
         }
+        sleep_until(wake);
+    }
+
+    if (opts.print_stats) {
+        struct PlaybackStats stats;
+        get_playback_stats(pb_ctx, &stats);
+        fprintf(stderr,
+            "seeks: %d from cache, %d decoded\n"
+            "frame cache: %d frames, %.1f MiB\n"
+            "a/v drift: %.1f ms (max %.1f ms), %d clock corrections\n"
+            "audio underruns: %d\n"
+            "decoding: %.1f ms/frame (jitter %.1f ms), %d frames and %d packets ahead\n"
+            "late frames: %d dropped, %d skipped, quality level %d\n"
+            "file reads (%s): %.1f MiB in %d reads, %d stalls (%.1f ms, max %.1f ms)\n"
+            "startup: opened in %.1f ms, first frame at %.1f ms\n",
+            stats.seek_hits, stats.seek_misses,
+            stats.cached_frames, stats.cached_bytes / (double)(1 << 20),
+            stats.av_drift * 1000, stats.max_av_drift * 1000, stats.clock_corrections,
+            stats.audio_underruns,
+            stats.decode_time * 1000, stats.decode_jitter * 1000,
+            stats.prefetch_frames, stats.prefetch_packets,
+            stats.dropped_frames, stats.skipped_frames, stats.decode_quality,
+            file_io_mode_name(stats.io_mode), stats.io.bytes / (double)(1 << 20),
+            stats.io.reads, stats.io.stalls,
+            stats.io.stall_time * 1000, stats.io.max_stall * 1000,
+            stats.open_time * 1000, stats.first_frame_time * 1000
+        );
     }
 
+    destroy_thumbnail_strip(thumbs);
+    destroy_waveform(wave);
     destroy_playback_ctx(pb_ctx);
 
+    /* after the threads have stopped so they aren't still writing */
+    if (trace_path && atomic_load(&trace_on)) {
+        trace_set_enabled(false);
+        trace_dump(trace_path);
+    }
+
+    destroy_glyph_atlas(glyphs);
+    TTF_CloseFont(font);
     SDL_DestroyRenderer(renderer);
     SDL_DestroyWindow(window);
     SDL_Quit();
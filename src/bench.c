@@ -0,0 +1,175 @@
+#include "bench.h"
+#include "trace.h"
+#include "playback/pool.h"
+#include "playback/utils.h"
+#include <sys/resource.h>
+
+#define BENCH_POLL_NS 50000 /* between looks for the next frame */
+#define BENCH_STALL_SECONDS 10.0 /* without a new frame, give up */
+
+static int compare_doubles(const void * a, const void * b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static void print_json_string(const char * str) {
+    putchar('"');
+    for (; *str; str++) {
+        unsigned char c = *str;
+        if ((c == '"') || (c == '\\')) printf("\\%c", c);
+        else if (c < 0x20) printf("\\u%04x", c);
+        else putchar(c);
+    }
+    putchar('"');
+}
+
+/* percentiles of how long the spans called name took, in ms */
+static void print_stage(const char * name, const char ** sep) {
+    size_t count = trace_durations(name, NULL, 0);
+    if (count == 0) return;
+
+    double * durations = malloc(count * sizeof(double));
+    count = trace_durations(name, durations, count);
+    qsort(durations, count, sizeof(double), compare_doubles);
+
+    printf("%s\n    ", *sep);
+    print_json_string(name);
+    printf(
+        ": { \"count\": %zu, \"p50_ms\": %.3f, \"p90_ms\": %.3f, "
+        "\"p99_ms\": %.3f, \"max_ms\": %.3f }",
+        count,
+        durations[(count - 1) / 2] * 1000,
+        durations[(count - 1) * 9 / 10] * 1000,
+        durations[(count - 1) * 99 / 100] * 1000,
+        durations[count - 1] * 1000
+    );
+    *sep = ",";
+    free(durations);
+}
+
+/* counts frames until the last one has been shown. returns how many,
+ * or -1 if the pipeline stopped producing them before the end */
+static int drain_frames(struct PlaybackCtx * pb_ctx) {
+    struct PlaybackStats stats;
+    double last_frame = mono_now();
+    int frames = 0;
+
+    /* shows the first frame, then each advance shows the next
+     * once it's been decoded and converted */
+    seek(pb_ctx, pb_ctx->start_time);
+
+    while (true) {
+        if (get_frame(pb_ctx, NULL, NULL, NULL)) {
+            frames++;
+            last_frame = mono_now();
+            advance_frame(pb_ctx);
+            continue;
+        }
+
+        get_playback_stats(pb_ctx, &stats);
+        if (stats.ended) {
+            /* it may have been shown since we last looked */
+            return frames + get_frame(pb_ctx, NULL, NULL, NULL);
+        }
+
+        if (mono_now() - last_frame > BENCH_STALL_SECONDS) {
+            fprintf(stderr, "no new frame for %.0f seconds, giving up\n", BENCH_STALL_SECONDS);
+            return -1;
+        }
+        nanosleep(&(struct timespec) { 0, BENCH_POLL_NS }, NULL);
+    }
+}
+
+int run_benchmark(char * filename, const struct PlaybackOptions * opts) {
+    /* nothing's shown or played, but the pipeline still wants
+     * a renderer to convert frames for */
+    SDL_setenv("SDL_VIDEODRIVER", "dummy", 1);
+    SDL_setenv("SDL_AUDIODRIVER", "dummy", 1);
+    if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO)) {
+        fprintf(stderr, "failed to initialize SDL: %s\n", SDL_GetError());
+        return -1;
+    }
+
+    struct PlaybackOptions bench_opts = opts ? *opts : (struct PlaybackOptions) {0};
+    bench_opts.no_audio = true;
+
+    trace_set_enabled(true);
+
+    int ret = -1;
+    SDL_Window * window = NULL;
+    SDL_Renderer * renderer = NULL;
+    struct PlaybackCtx * pb_ctx = open_for_playback(filename, &bench_opts);
+    if (pb_ctx == NULL) goto quit;
+
+    window = SDL_CreateWindow(
+        "av", 0, 0, pb_ctx->width, pb_ctx->height, SDL_WINDOW_HIDDEN
+    );
+    if (window) renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_SOFTWARE);
+    if (renderer == NULL) {
+        fprintf(stderr, "failed to create renderer: %s\n", SDL_GetError());
+        goto quit;
+    }
+    SDL_Texture * tex = create_video_texture(pb_ctx, renderer);
+    if (tex == NULL) goto quit;
+
+    long allocations = pool_allocations();
+    double start = mono_now();
+    int frames = drain_frames(pb_ctx);
+    double seconds = mono_now() - start;
+    allocations = pool_allocations() - allocations;
+    if (frames < 0) goto quit;
+
+    trace_set_enabled(false);
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    struct PlaybackStats stats;
+    get_playback_stats(pb_ctx, &stats);
+
+    printf("{\n  \"file\": ");
+    print_json_string(filename);
+    printf(",\n"
+        "  \"width\": %d,\n"
+        "  \"height\": %d,\n"
+        "  \"cpus\": %d,\n"
+        "  \"decode_threads\": %d,\n"
+        "  \"gop_decoders\": %d,\n"
+        "  \"frames\": %d,\n"
+        "  \"seconds\": %.3f,\n"
+        "  \"fps\": %.2f,\n"
+        "  \"open_ms\": %.3f,\n"
+        "  \"first_frame_ms\": %.3f,\n"
+        "  \"stages\": {",
+        pb_ctx->width, pb_ctx->height, SDL_GetCPUCount(),
+        bench_opts.decode_threads, bench_opts.gop_decoders,
+        frames, seconds, seconds > 0 ? frames / seconds : 0.0,
+        stats.open_time * 1000, stats.first_frame_time * 1000
+    );
+    const char * sep = "";
+    print_stage("demux", &sep);
+    print_stage("decode", &sep);
+    print_stage("decode gop", &sep);
+    print_stage("convert", &sep);
+    printf("\n  },\n"
+        "  \"peak_rss_bytes\": %ld,\n" /* ru_maxrss is in KiB on linux */
+        "  \"allocations\": %ld,\n"
+        "  \"allocations_per_frame\": %.3f,\n"
+        "  \"io\": { \"mode\": \"%s\", \"reads\": %d, \"stalls\": %d, "
+        "\"stall_ms\": %.3f, \"max_stall_ms\": %.3f }\n"
+        "}\n",
+        usage.ru_maxrss * 1024L,
+        allocations, frames ? (double) allocations / frames : 0.0,
+        file_io_mode_name(stats.io_mode), stats.io.reads, stats.io.stalls,
+        stats.io.stall_time * 1000, stats.io.max_stall * 1000
+    );
+    ret = 0;
+
+    quit:
+    trace_set_enabled(false);
+    if (pb_ctx) destroy_playback_ctx(pb_ctx);
+    if (renderer) SDL_DestroyRenderer(renderer);
+    if (window) SDL_DestroyWindow(window);
+    SDL_Quit();
+    return ret;
+}
@@ -0,0 +1,8 @@
+#pragma once
+#include "playback/playback.h"
+
+/* steps through filename from start to end as fast as the pipeline can
+ * demux, decode and convert it, without a window or sound, then prints
+ * what it measured to stdout as json. tracing is turned on for it, since
+ * the per-stage times come from the spans. returns 0 on success */
+int run_benchmark(char * filename, const struct PlaybackOptions * opts);
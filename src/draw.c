@@ -62,19 +62,56 @@ struct Layout get_layout(
 }
 
 
+#define FIRST_GLYPH ' '
+#define LAST_GLYPH '~'
+#define NGLYPHS (LAST_GLYPH - FIRST_GLYPH + 1)
+
+struct GlyphAtlas * create_glyph_atlas(SDL_Renderer * renderer, TTF_Font * font) {
+    if (font == NULL) return NULL;
+
+    /* the font is monospace, so rendering every printable character
+     * in one line puts glyph i at i * advance */
+    char glyphs[NGLYPHS + 1];
+    for (int i = 0; i < NGLYPHS; i++) glyphs[i] = FIRST_GLYPH + i;
+    glyphs[NGLYPHS] = '\0';
+
+    SDL_Surface * surf = TTF_RenderText_Blended(font, glyphs, (SDL_Color) { 0xff, 0xff, 0xff, 0xff });
+    if (surf == NULL) return NULL;
+    SDL_Texture * tex = SDL_CreateTextureFromSurface(renderer, surf);
+    int w = surf->w, h = surf->h;
+    SDL_FreeSurface(surf);
+    if (tex == NULL) return NULL;
+    SDL_SetTextureBlendMode(tex, SDL_BLENDMODE_BLEND);
+
+    struct GlyphAtlas * atlas = malloc(sizeof(struct GlyphAtlas));
+    *atlas = (struct GlyphAtlas) {
+        .tex = tex,
+        .tex_w = w,
+        .tex_h = h,
+        .glyph_w = w / NGLYPHS,
+        .glyph_h = h,
+        .verts = NULL,
+        .nverts = 0,
+        .allocated = 0
+    };
+    return atlas;
+}
+
+void destroy_glyph_atlas(struct GlyphAtlas * atlas) {
+    if (atlas == NULL) return;
+    SDL_DestroyTexture(atlas->tex);
+    free(atlas->verts);
+    free(atlas);
+}
+
 void draw_text(
-    SDL_Renderer * renderer, const char * message, 
-    TTF_Font * font, const SDL_Color color, 
-    enum TextAlignment alignment, int x, int y
+    struct GlyphAtlas * atlas, const char * message,
+    const SDL_Color color, enum TextAlignment alignment, int x, int y
 ) {
+    if (atlas == NULL) return;
 
-	SDL_Surface * surf = TTF_RenderText_Blended(font, message, color);
-	SDL_Texture * texture = SDL_CreateTextureFromSurface(renderer, surf);
-
-	SDL_FreeSurface(surf);
-   
-    int w, h;
-    SDL_QueryTexture(texture, NULL, NULL, &w, &h);
+    int len = strlen(message);
+    int w = len * atlas->glyph_w;
     switch (alignment) {
         case ALIGN_RIGHT:
             x -= w;
@@ -84,14 +121,39 @@ void draw_text(
             break;
         case ALIGN_LEFT:;
     };
-    SDL_Rect dstrect = {
-        .x = x,
-        .y = y,
-        .w = w,
-        .h = h
-    };
-    SDL_RenderCopy(renderer, texture, NULL, &dstrect);
 
+    /* two triangles per glyph. the buffer only grows, so after the
+     * first few frames queueing text allocates nothing */
+    if (atlas->nverts + len * 6 > atlas->allocated) {
+        while (atlas->nverts + len * 6 > atlas->allocated)
+            atlas->allocated = atlas->allocated ? atlas->allocated * 2 : 1024;
+        atlas->verts = realloc(atlas->verts, atlas->allocated * sizeof(SDL_Vertex));
+    }
+
+    for (int i = 0; i < len; i++) {
+        int glyph = message[i];
+        if ((glyph < FIRST_GLYPH) || (glyph > LAST_GLYPH)) glyph = '?';
+
+        float x0 = x + i * atlas->glyph_w, x1 = x0 + atlas->glyph_w;
+        float y0 = y, y1 = y + atlas->glyph_h;
+        float u0 = (float) ((glyph - FIRST_GLYPH) * atlas->glyph_w) / atlas->tex_w;
+        float u1 = u0 + (float) atlas->glyph_w / atlas->tex_w;
+
+        SDL_Vertex * v = atlas->verts + atlas->nverts;
+        v[0] = (SDL_Vertex) { { x0, y0 }, color, { u0, 0 } };
+        v[1] = (SDL_Vertex) { { x1, y0 }, color, { u1, 0 } };
+        v[2] = (SDL_Vertex) { { x1, y1 }, color, { u1, 1 } };
+        v[3] = v[0];
+        v[4] = v[2];
+        v[5] = (SDL_Vertex) { { x0, y1 }, color, { u0, 1 } };
+        atlas->nverts += 6;
+    }
+}
+
+void flush_text(SDL_Renderer * renderer, struct GlyphAtlas * atlas) {
+    if ((atlas == NULL) || !atlas->nverts) return;
+    SDL_RenderGeometry(renderer, atlas->tex, atlas->verts, atlas->nverts, NULL, 0);
+    atlas->nverts = 0;
 }
 
 
@@ -173,8 +235,9 @@ static void dur_to_str(double duration, char * dst) {
 
 
 void draw_timeline(
-    SDL_Renderer * renderer, TTF_Font * font, SDL_Rect rect,
+    SDL_Renderer * renderer, struct GlyphAtlas * glyphs, SDL_Rect rect,
     double start_time, double timestamp, double duration,
+    struct ThumbnailStrip * thumbs, struct Waveform * wave,
     const struct ColorScheme * colors
 ) {
     int label_h = 20;
@@ -194,6 +257,18 @@ void draw_timeline(
         &(SDL_Rect) { rect.x, rect.y + label_h, rect.w, rect.h - label_h }
     );
 
+    /* thumbnails and the waveform below them, under the tickmarks */
+    draw_thumbnails(
+        thumbs, renderer,
+        (SDL_Rect) { rect.x, rect.y + label_h, rect.w, rect.h - label_h - WAVEFORM_HEIGHT },
+        timestamp, pixels_per_sec
+    );
+    draw_waveform(
+        wave, renderer,
+        (SDL_Rect) { rect.x, rect.y + rect.h - WAVEFORM_HEIGHT, rect.w, WAVEFORM_HEIGHT },
+        timestamp, pixels_per_sec, colors->fg[0], colors->fg[2]
+    );
+
     /* draw darker area left of the video start point & right of video end*/
     double tlend= timestamp - halfwidth/pixels_per_sec;
     double trend = timestamp + halfwidth/pixels_per_sec;
@@ -250,7 +325,7 @@ void draw_timeline(
         );
         dur_to_str(time, timestamp_str);
         draw_text(
-            renderer, timestamp_str, font,
+            glyphs, timestamp_str,
             colors->fg[1], ALIGN_CENTER, x,
             rect.y
         );
@@ -270,6 +345,9 @@ void draw_timeline(
     SDL_SetRenderDrawColor(renderer, CL(colors->bg[3]));
     SDL_RenderDrawLine(renderer, rect.x, rect.y + label_h, rect.w + rect.x, rect.y + label_h);
 
+    /* tick labels go under the current frame's label */
+    flush_text(renderer, glyphs);
+
     /* draw current frame */
     SDL_SetRenderDrawColor(renderer, CL(colors->highl_bg));
     SDL_RenderFillRect(
@@ -291,10 +369,11 @@ void draw_timeline(
 
     dur_to_str(timestamp, timestamp_str);
     draw_text(
-        renderer, timestamp_str, font,
+        glyphs, timestamp_str,
         colors->highl_fg, ALIGN_RIGHT, halfwidth,
         rect.y
     );
+    flush_text(renderer, glyphs);
     SDL_SetRenderDrawColor(renderer, CL(colors->bg[4]));
     SDL_RenderDrawLine(renderer, rect.x, rect.y, rect.w + rect.x, rect.y);
 }
@@ -1,4 +1,6 @@
 #include "av.h"
+#include "playback/thumbnails.h"
+#include "playback/waveform.h"
 
 struct ColorScheme {
     SDL_Color bg[5]; /* backgrounds, lowest to highest contrast */
@@ -9,6 +11,8 @@ struct ColorScheme {
     SDL_Color acc_fg;
 };
 
+#define WAVEFORM_HEIGHT 32 /* at the bottom of the timeline */
+
 struct Layout {
     SDL_Rect viewer_rect;
     SDL_Rect timeline_rect;
@@ -21,15 +25,33 @@ enum TextAlignment {
     ALIGN_RIGHT
 };
 
-/* draws text at x, y.
+/* every printable ascii glyph of a monospace font, rendered once into
+ * one texture. text is queued as quads and drawn in a single call */
+struct GlyphAtlas {
+    SDL_Texture * tex;
+    int tex_w, tex_h;
+    int glyph_w, glyph_h;
+    SDL_Vertex * verts; /* queued by draw_text */
+    int nverts, allocated;
+};
+
+/* font must be monospace. returns NULL on failure */
+struct GlyphAtlas * create_glyph_atlas(SDL_Renderer * renderer, TTF_Font * font);
+
+void destroy_glyph_atlas(struct GlyphAtlas * atlas);
+
+/* queues text at x, y, to be drawn by flush_text.
  * horizontal alignment is specified by alignment,
- * vertical algignment is always from top. */
+ * vertical algignment is always from top.
+ * characters outside printable ascii come out as '?' */
 void draw_text(
-    SDL_Renderer * renderer, const char * message, 
-    TTF_Font * font, const SDL_Color color, 
-    enum TextAlignment alignment, int x, int y
+    struct GlyphAtlas * atlas, const char * message,
+    const SDL_Color color, enum TextAlignment alignment, int x, int y
 );
 
+/* draws all text queued since the last flush */
+void flush_text(SDL_Renderer * renderer, struct GlyphAtlas * atlas);
+
 /* get default color scheme (catppuccin mocha) */
 struct ColorScheme default_colors(void);
 
@@ -58,9 +80,11 @@ void draw_progress(
     const struct ColorScheme * colors
 );
 
+/* thumbs and wave can be NULL */
 void draw_timeline(
-    SDL_Renderer * renderer, TTF_Font * font, SDL_Rect rect,
+    SDL_Renderer * renderer, struct GlyphAtlas * glyphs, SDL_Rect rect,
     double start_time, double timestamp, double duration,
+    struct ThumbnailStrip * thumbs, struct Waveform * wave,
     const struct ColorScheme * colors
 );
 
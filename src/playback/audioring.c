@@ -0,0 +1,91 @@
+#include "audioring.h"
+#include "utils.h"
+
+struct AudioRing * create_audio_ring(size_t min_bytes) {
+    size_t size = 4096;
+    while (size < min_bytes) size *= 2;
+
+    struct AudioRing * ring = aligned_alloc(64, sizeof(struct AudioRing));
+    ring->buf = malloc(size);
+    ring->size = size;
+    ring->dry = true;
+    ring->space = SDL_CreateSemaphore(0);
+    atomic_init(&ring->read, 0);
+    atomic_init(&ring->callback_ns, 0);
+    atomic_init(&ring->underruns, 0);
+    atomic_init(&ring->written, 0);
+    atomic_init(&ring->writer_waiting, 0);
+    return ring;
+}
+
+void destroy_audio_ring(struct AudioRing * ring) {
+    if (ring == NULL) return;
+    SDL_DestroySemaphore(ring->space);
+    free(ring->buf);
+    free(ring);
+}
+
+size_t audio_ring_write(struct AudioRing * ring, const uint8_t * data, size_t len) {
+    size_t written = atomic_load_explicit(&ring->written, memory_order_relaxed);
+    size_t read = atomic_load_explicit(&ring->read, memory_order_acquire);
+
+    len = MIN(len, ring->size - (written - read));
+    size_t pos = written & (ring->size - 1);
+    size_t first = MIN(len, ring->size - pos);
+    memcpy(ring->buf + pos, data, first);
+    memcpy(ring->buf, data + first, len - first);
+
+    atomic_store_explicit(&ring->written, written + len, memory_order_release);
+    return len;
+}
+
+/* same handshake as MessageQueue's: either the callback sees the flag,
+ * or we see the space it made */
+void audio_ring_wait_space(struct AudioRing * ring, int timeout_ms) {
+    atomic_store(&ring->writer_waiting, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (audio_ring_queued(ring) < ring->size)
+        atomic_store(&ring->writer_waiting, 0);
+    else
+        SDL_SemWaitTimeout(ring->space, timeout_ms);
+}
+
+size_t audio_ring_queued(struct AudioRing * ring) {
+    size_t read = atomic_load_explicit(&ring->read, memory_order_acquire);
+    return atomic_load_explicit(&ring->written, memory_order_acquire) - read;
+}
+
+void audio_ring_clear(struct AudioRing * ring) {
+    atomic_store(&ring->read, atomic_load(&ring->written));
+    ring->dry = true;
+}
+
+void audio_ring_callback(void * userdata, Uint8 * stream, int len) {
+    struct AudioRing * ring = userdata;
+
+    size_t read = atomic_load_explicit(&ring->read, memory_order_relaxed);
+    size_t queued = atomic_load_explicit(&ring->written, memory_order_acquire) - read;
+
+    size_t n = MIN(queued, (size_t) len);
+    size_t pos = read & (ring->size - 1);
+    size_t first = MIN(n, ring->size - pos);
+    memcpy(stream, ring->buf + pos, first);
+    memcpy(stream + first, ring->buf, n - first);
+    memset(stream + n, 0, len - n); /* signed samples, so 0 is silence */
+
+    atomic_store_explicit(&ring->read, read + n, memory_order_release);
+    atomic_store_explicit(&ring->callback_ns, mono_ns(), memory_order_release);
+
+    /* running out right after a clear or at the start isn't an underrun */
+    if (n < (size_t) len) {
+        if (!ring->dry) atomic_fetch_add(&ring->underruns, 1);
+        ring->dry = true;
+    } else {
+        ring->dry = false;
+    }
+
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&ring->writer_waiting, memory_order_relaxed) &&
+        atomic_exchange(&ring->writer_waiting, 0))
+        SDL_SemPost(ring->space);
+}
@@ -0,0 +1,47 @@
+#pragma once
+#include "../av.h"
+#include <stdatomic.h>
+
+/* samples on their way to the audio device, allocated once up front.
+ * the audio decoder writes and the device's callback reads, as a
+ * single-producer/single-consumer ring like MessageQueue. the callback
+ * never waits: if the ring runs out it plays silence.
+ * read and written count every byte ever passed through, so
+ * written - read is how much is queued */
+struct AudioRing {
+    uint8_t * buf;
+    size_t size; /* power of two */
+
+    /* consumer (callback) side */
+    _Alignas(64) atomic_size_t read;
+    atomic_int_fast64_t callback_ns; /* CLOCK_MONOTONIC time of the last callback */
+    atomic_int underruns; /* times the callback ran dry mid-playback */
+    bool dry;
+
+    /* producer (decoder) side */
+    _Alignas(64) atomic_size_t written;
+
+    /* the decoder sleeps on this when the ring is full */
+    _Alignas(64) atomic_int writer_waiting;
+    SDL_semaphore * space;
+};
+
+/* holds at least min_bytes */
+struct AudioRing * create_audio_ring(size_t min_bytes);
+void destroy_audio_ring(struct AudioRing * ring);
+
+/* copies up to len bytes in, and returns how many fit */
+size_t audio_ring_write(struct AudioRing * ring, const uint8_t * data, size_t len);
+
+/* waits until there's space or timeout_ms passes */
+void audio_ring_wait_space(struct AudioRing * ring, int timeout_ms);
+
+size_t audio_ring_queued(struct AudioRing * ring);
+
+/* drops everything queued. the callback must not be running,
+ * so lock the device around this */
+void audio_ring_clear(struct AudioRing * ring);
+
+/* SDL_AudioSpec.callback, with the ring as userdata.
+ * pads with silence if the ring runs out */
+void audio_ring_callback(void * userdata, Uint8 * stream, int len);
@@ -0,0 +1,168 @@
+#include "clock.h"
+#include "utils.h"
+
+#define SNAP_THRESHOLD 0.1 /* seconds of drift beyond which the clock jumps */
+#define SLEW_RATE 0.05 /* fraction of smaller drifts corrected per read */
+
+struct Clock * create_clock(void) {
+    struct Clock * clock = malloc(sizeof(struct Clock));
+    *clock = (struct Clock) {
+        .mutex = SDL_CreateMutex(),
+        .base_time = 0,
+        .base_mono = mono_now(),
+        .paused = true,
+        .direction = 1,
+        .adev = 0,
+        .ring = NULL,
+        .audio_synced = false,
+        .drift = 0,
+        .max_drift = 0,
+        .corrections = 0
+    };
+    return clock;
+}
+
+void destroy_clock(struct Clock * clock) {
+    SDL_DestroyMutex(clock->mutex);
+    free(clock);
+}
+
+/* the functions below expect the caller to hold the mutex */
+
+static double system_time(const struct Clock * clock, double now) {
+    if (clock->paused) return clock->base_time;
+    return clock->base_time + clock->direction * (now - clock->base_mono);
+}
+
+static void rebase(struct Clock * clock, double time, double now) {
+    clock->base_time = time;
+    clock->base_mono = now;
+}
+
+/* NAN if the audio can't be followed right now. the callback takes a
+ * device buffer at a time, so count how far into the last one the device
+ * should have got by now rather than stepping with the ring */
+static double audio_time(const struct Clock * clock, double now) {
+    if (!clock->adev || !clock->audio_synced || clock->paused || (clock->direction < 0))
+        return NAN;
+
+    size_t queued = audio_ring_queued(clock->ring);
+    if (!queued) return NAN; /* ran dry, nothing to follow */
+
+    double since = now - atomic_load(&clock->ring->callback_ns) / 1000000000.0;
+    double played = MAX(since, 0);
+    played = MIN(played, clock->latency);
+    return clock->audio_end - queued / clock->bytes_per_sec - clock->latency + played;
+}
+
+static void update_device(struct Clock * clock) {
+    if (clock->adev)
+        SDL_PauseAudioDevice(clock->adev, clock->paused || (clock->direction < 0));
+}
+
+double clock_get(struct Clock * clock) {
+    SDL_LockMutex(clock->mutex);
+
+    double now = mono_now();
+    double time = system_time(clock, now);
+    double audio = audio_time(clock, now);
+
+    /* slewing smooths out the audio clock's jitter */
+    if (!isnan(audio)) {
+        clock->drift = audio - time;
+        clock->max_drift = MAX(clock->max_drift, fabs(clock->drift));
+        if (fabs(clock->drift) > SNAP_THRESHOLD) {
+            time = audio;
+            clock->corrections++;
+        } else {
+            time += clock->drift * SLEW_RATE;
+        }
+        rebase(clock, time, now);
+    }
+
+    SDL_UnlockMutex(clock->mutex);
+    return time;
+}
+
+void clock_set(struct Clock * clock, double time) {
+    SDL_LockMutex(clock->mutex);
+    rebase(clock, time, mono_now());
+    clock->audio_synced = false;
+    SDL_UnlockMutex(clock->mutex);
+}
+
+void clock_set_paused(struct Clock * clock, bool paused) {
+    SDL_LockMutex(clock->mutex);
+    double now = mono_now();
+    rebase(clock, system_time(clock, now), now);
+    clock->paused = paused;
+    update_device(clock);
+    SDL_UnlockMutex(clock->mutex);
+}
+
+void clock_set_direction(struct Clock * clock, int direction) {
+    SDL_LockMutex(clock->mutex);
+    if (direction != clock->direction) {
+        double now = mono_now();
+        rebase(clock, system_time(clock, now), now);
+        clock->direction = direction;
+
+        /* whatever was queued doesn't follow on from here anymore */
+        if (clock->adev) {
+            SDL_LockAudioDevice(clock->adev);
+            audio_ring_clear(clock->ring);
+            SDL_UnlockAudioDevice(clock->adev);
+        }
+        clock->audio_synced = false;
+        update_device(clock);
+    }
+    SDL_UnlockMutex(clock->mutex);
+}
+
+bool clock_paused(struct Clock * clock) {
+    SDL_LockMutex(clock->mutex);
+    bool paused = clock->paused;
+    SDL_UnlockMutex(clock->mutex);
+    return paused;
+}
+
+bool clock_playing_forward(struct Clock * clock) {
+    SDL_LockMutex(clock->mutex);
+    bool forward = !clock->paused && (clock->direction > 0);
+    SDL_UnlockMutex(clock->mutex);
+    return forward;
+}
+
+void clock_attach_audio(
+    struct Clock * clock, SDL_AudioDeviceID adev, struct AudioRing * ring,
+    double bytes_per_sec, double latency
+) {
+    SDL_LockMutex(clock->mutex);
+    clock->adev = adev;
+    clock->ring = ring;
+    clock->bytes_per_sec = bytes_per_sec;
+    clock->latency = latency;
+    clock->audio_synced = false;
+    update_device(clock);
+    SDL_UnlockMutex(clock->mutex);
+}
+
+bool clock_audio_synced(struct Clock * clock) {
+    SDL_LockMutex(clock->mutex);
+    bool synced = clock->audio_synced;
+    SDL_UnlockMutex(clock->mutex);
+    return synced;
+}
+
+void clock_audio_queued(struct Clock * clock, double end) {
+    SDL_LockMutex(clock->mutex);
+    clock->audio_end = end;
+    clock->audio_synced = true;
+    SDL_UnlockMutex(clock->mutex);
+}
+
+void clock_audio_flushed(struct Clock * clock) {
+    SDL_LockMutex(clock->mutex);
+    clock->audio_synced = false;
+    SDL_UnlockMutex(clock->mutex);
+}
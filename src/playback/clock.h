@@ -0,0 +1,60 @@
+#pragma once
+#include "../av.h"
+#include "audioring.h"
+
+/* the playback clock, in seconds on the streams' shared timeline.
+ * while audio is playing forward, it follows the samples the device has
+ * actually played, and video is shown against it. otherwise (no audio,
+ * paused, playing backwards, or the audio has run dry) it runs off the
+ * monotonic system clock. reading it from the main thread while the
+ * audio decoder feeds it is fine, everything goes through the mutex */
+struct Clock {
+    SDL_mutex * mutex;
+
+    /* the system clock part: time was base_time at base_mono */
+    double base_time, base_mono;
+    bool paused;
+    int direction; /* 1 forward, -1 backward */
+
+    /* the audio part, set by the audio decoder */
+    SDL_AudioDeviceID adev; /* 0 if there's no audio */
+    struct AudioRing * ring; /* what the device plays from */
+    double bytes_per_sec;
+    double latency; /* seconds of audio the device takes per callback */
+    bool audio_synced; /* audio_end lines up with the clock */
+    double audio_end; /* time right after the last queued sample */
+
+    /* how far audio and system clock were apart, and how often the
+     * system clock had to jump to catch up rather than slewing */
+    double drift, max_drift;
+    int corrections;
+};
+
+struct Clock * create_clock(void);
+void destroy_clock(struct Clock * clock);
+
+double clock_get(struct Clock * clock);
+
+/* jumps to time, e.g. after a seek. queued audio no longer counts until
+ * the audio decoder has caught up with clock_audio_queued */
+void clock_set(struct Clock * clock, double time);
+
+void clock_set_paused(struct Clock * clock, bool paused);
+void clock_set_direction(struct Clock * clock, int direction);
+/* not paused, and going forward */
+bool clock_playing_forward(struct Clock * clock);
+bool clock_paused(struct Clock * clock);
+
+/* called by the audio decoder. adev plays from ring,
+ * and bytes_per_sec and latency describe it */
+void clock_attach_audio(
+    struct Clock * clock, SDL_AudioDeviceID adev, struct AudioRing * ring,
+    double bytes_per_sec, double latency
+);
+/* false if the audio decoder has to line its next samples up with
+ * clock_get before queueing them */
+bool clock_audio_synced(struct Clock * clock);
+/* it has queued audio up to time end */
+void clock_audio_queued(struct Clock * clock, double end);
+/* it has cleared the ring */
+void clock_audio_flushed(struct Clock * clock);
@@ -0,0 +1,152 @@
+#include "convert.h"
+#include "pool.h"
+#include "../trace.h"
+
+struct FrameConverter * create_frame_converter(
+    const AVCodecContext * codec_ctx, uint32_t tex_format
+) {
+    struct FrameConverter * conv = malloc(sizeof(struct FrameConverter));
+    *conv = (struct FrameConverter) {
+        .method = CONVERT_NONE,
+        .width = codec_ctx->width,
+        .height = codec_ctx->height,
+        .dst_fmt = codec_ctx->pix_fmt,
+        .sws_context = NULL,
+        .rescale_context = NULL,
+        .pool = NULL
+    };
+
+    switch (tex_format) {
+        case SDL_PIXELFORMAT_ARGB8888:
+            /* byte order B, G, R, A on little endian */
+            conv->method = CONVERT_YUV2RGB;
+            conv->dst_fmt = AV_PIX_FMT_BGRA;
+            conv->pitch = conv->width * 4;
+            conv->yuv2rgb = make_yuv2rgb(
+                codec_ctx->pix_fmt, codec_ctx->colorspace, codec_ctx->color_range,
+                codec_ctx->height, YUV2RGB_ARGB
+            );
+            break;
+
+        case SDL_PIXELFORMAT_RGB24:
+            conv->method = CONVERT_SWS;
+            conv->dst_fmt = AV_PIX_FMT_RGB24;
+            conv->pitch = conv->width * 3;
+            conv->sws_context = sws_getContext(
+                conv->width, conv->height, codec_ctx->pix_fmt,
+                conv->width, conv->height, AV_PIX_FMT_RGB24,
+                SWS_POINT, NULL, NULL,
+                NULL
+            );
+            if (conv->sws_context == NULL) {
+                fprintf(stderr, "failed to create conversion context\n");
+                free(conv);
+                return NULL;
+            }
+            /* by default swscale assumes bt.601 limited range whatever the stream says */
+            sws_setColorspaceDetails(
+                conv->sws_context,
+                sws_getCoefficients(codec_ctx->colorspace),
+                codec_ctx->color_range == AVCOL_RANGE_JPEG,
+                sws_getCoefficients(SWS_CS_DEFAULT), 1,
+                0, 1 << 16, 1 << 16
+            );
+            break;
+
+        default:
+            return conv;
+    }
+
+    /* keep rows 64 byte aligned for the simd kernels and SDL's copy */
+    conv->pitch = FFALIGN(conv->pitch, 64);
+    conv->pool = av_buffer_pool_init(conv->pitch * conv->height, NULL);
+    return conv;
+}
+
+void destroy_frame_converter(struct FrameConverter * conv) {
+    if (conv == NULL) return;
+    sws_freeContext(conv->sws_context);
+    sws_freeContext(conv->rescale_context);
+    av_buffer_pool_uninit(&conv->pool);
+    free(conv);
+}
+
+/* the texture and pool are sized for the stream's initial dimensions,
+ * but some streams change size. scales frame to fit, keeping its format */
+static AVFrame * rescale_frame(struct FrameConverter * conv, AVFrame * frame) {
+    conv->rescale_context = sws_getCachedContext(
+        conv->rescale_context,
+        frame->width, frame->height, frame->format,
+        conv->width, conv->height, frame->format,
+        SWS_FAST_BILINEAR, NULL, NULL, NULL
+    );
+
+    AVFrame * out = pool_get_frame();
+    out->width = conv->width;
+    out->height = conv->height;
+    out->format = frame->format;
+    if ((conv->rescale_context == NULL) || av_frame_get_buffer(out, 0)) {
+        fprintf(stderr, "failed to rescale frame, dropping it\n");
+        pool_put_frame(&out);
+        pool_put_frame(&frame);
+        return NULL;
+    }
+
+    av_frame_copy_props(out, frame);
+    sws_scale(
+        conv->rescale_context,
+        (const uint8_t * const *) frame->data, frame->linesize,
+        0, frame->height, out->data, out->linesize
+    );
+    pool_put_frame(&frame);
+    return out;
+}
+
+AVFrame * convert_frame(struct FrameConverter * conv, AVFrame * frame) {
+    TRACE_SCOPE("convert");
+    if ((frame->width != conv->width) || (frame->height != conv->height)) {
+        frame = rescale_frame(conv, frame);
+        if (frame == NULL) return NULL;
+    }
+
+    if (conv->method == CONVERT_NONE) return frame;
+
+    AVFrame * out = pool_get_frame();
+    out->buf[0] = av_buffer_pool_get(conv->pool);
+    if (out->buf[0] == NULL) {
+        fprintf(stderr, "out of memory converting frame, dropping it\n");
+        pool_put_frame(&out);
+        pool_put_frame(&frame);
+        return NULL;
+    }
+    out->data[0] = out->buf[0]->data;
+    out->linesize[0] = conv->pitch;
+    out->width = conv->width;
+    out->height = conv->height;
+    out->format = conv->dst_fmt;
+    av_frame_copy_props(out, frame);
+
+    switch (conv->method) {
+        case CONVERT_YUV2RGB:
+            yuv2rgb_convert(&conv->yuv2rgb, frame, out->data[0], out->linesize[0]);
+            break;
+
+        case CONVERT_SWS:
+            sws_scale(
+                conv->sws_context,
+                (const uint8_t * const *) frame->data,
+                frame->linesize,
+                0,
+                frame->height,
+                out->data,
+                out->linesize
+            );
+            break;
+
+        default:
+            break;
+    }
+
+    pool_put_frame(&frame);
+    return out;
+}
@@ -0,0 +1,37 @@
+#pragma once
+#include "../av.h"
+#include "yuv2rgb.h"
+
+/* turns decoded frames into something that can go straight into the
+ * video texture. runs on its own thread (see thread_conv) so that the
+ * main thread only ever copies finished frames.
+ * no scaling is done here, SDL scales on the gpu */
+
+enum ConvertMethod {
+    CONVERT_NONE, /* texture takes the decoder's format as is */
+    CONVERT_YUV2RGB,
+    CONVERT_SWS
+};
+
+struct FrameConverter {
+    enum ConvertMethod method;
+    int width, height;
+    int pitch; /* of converted frames */
+    enum AVPixelFormat dst_fmt;
+    struct Yuv2Rgb yuv2rgb;
+    struct SwsContext * sws_context;
+    struct SwsContext * rescale_context; /* for frames that aren't width x height */
+    AVBufferPool * pool; /* converted frames are allocated from here */
+};
+
+/* tex_format is the format of the texture frames will be uploaded to */
+struct FrameConverter * create_frame_converter(
+    const AVCodecContext * codec_ctx, uint32_t tex_format
+);
+
+/* converted frames may outlive the converter */
+void destroy_frame_converter(struct FrameConverter * conv);
+
+/* takes ownership of frame and returns a display-ready one
+ * (possibly frame itself), or NULL on failure */
+AVFrame * convert_frame(struct FrameConverter * conv, AVFrame * frame);
@@ -0,0 +1,307 @@
+#include "fileio.h"
+#include "utils.h"
+#include "../trace.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#ifdef __linux__
+#include <sys/vfs.h>
+#endif
+
+#define AVIO_BUFFER_SIZE (256 << 10)
+
+/* where every read is a round trip to another machine */
+static bool on_network_fs(int fd) {
+#ifdef __linux__
+    struct statfs fs;
+    if (fstatfs(fd, &fs)) return false;
+    switch ((uint32_t) fs.f_type) {
+        case 0x6969: /* nfs */
+        case 0x517b: /* smb */
+        case 0xff534d42: /* cifs */
+        case 0xfe534d42: /* smb2 */
+        case 0x65735546: /* fuse, e.g. sshfs */
+        case 0x5346414f: /* afs */
+        case 0x01161970: /* gfs2 */
+        case 0x00c36400: /* ceph */
+            return true;
+    }
+#endif
+    (void) fd;
+    return false;
+}
+
+/* caller holds the mutex. stalled is how long the read waited, or 0 */
+static void record_read(struct FileIo * io, int size, double stalled) {
+    struct FileIoStats * stats = &io->stats;
+    stats->reads++;
+    stats->bytes += size;
+    if (stalled > 0) {
+        stats->stalls++;
+        stats->stall_time += stalled;
+        if (stalled > stats->max_stall) stats->max_stall = stalled;
+    }
+}
+
+static int mmap_read(void * opaque, uint8_t * buf, int size) {
+    struct FileIo * io = opaque;
+    if (io->pos >= io->size) return AVERROR_EOF;
+    if (size > io->size - io->pos) size = io->size - io->pos;
+
+    /* page it in before the demuxer gets there, rather than one
+     * fault at a time as it reads */
+    if (io->pos + (int64_t) io->window / 2 > io->advised) {
+        int64_t from = io->advised > io->pos ? io->advised : io->pos;
+        from &= ~(int64_t) (sysconf(_SC_PAGESIZE) - 1);
+        int64_t len = io->window;
+        if (len > io->size - from) len = io->size - from;
+        madvise(io->map + from, len, MADV_WILLNEED);
+        io->advised = from + len;
+    }
+
+    /* copying is what faults in anything that isn't there yet */
+    double start = mono_now();
+    memcpy(buf, io->map + io->pos, size);
+    double took = mono_now() - start;
+    io->pos += size;
+
+    SDL_LockMutex(io->mutex);
+    record_read(io, size, took > FILE_IO_STALL ? took : 0);
+    SDL_UnlockMutex(io->mutex);
+    return size;
+}
+
+/* caller holds the mutex. drops the buffer and reads from pos instead */
+static void restart_readahead(struct FileIo * io) {
+    io->generation++;
+    io->start = io->end = io->pos;
+    io->error = 0;
+    posix_fadvise(io->fd, io->pos, io->window, POSIX_FADV_WILLNEED);
+    SDL_CondBroadcast(io->cond);
+}
+
+static int readahead_read(void * opaque, uint8_t * buf, int size) {
+    struct FileIo * io = opaque;
+    SDL_LockMutex(io->mutex);
+
+    if (io->pos >= io->size) {
+        SDL_UnlockMutex(io->mutex);
+        return AVERROR_EOF;
+    }
+
+    /* seeked somewhere the buffer doesn't reach, and won't soon */
+    if ((io->pos < io->start) || (io->pos > io->end + (int64_t) FILE_IO_BLOCK))
+        restart_readahead(io);
+
+    double stalled = 0;
+    if (io->pos >= io->end) {
+        double start = mono_now();
+        while ((io->pos >= io->end) && !io->error)
+            SDL_CondWait(io->cond, io->mutex);
+        stalled = mono_now() - start;
+    }
+    if (io->pos >= io->end) {
+        /* the demuxer gets it once, the next read tries again */
+        int error = io->error;
+        io->error = 0;
+        SDL_CondBroadcast(io->cond);
+        SDL_UnlockMutex(io->mutex);
+        return error;
+    }
+
+    if (size > io->end - io->pos) size = io->end - io->pos;
+    size_t off = io->pos % io->window;
+    size_t first = size;
+    if (first > io->window - off) first = io->window - off;
+    memcpy(buf, io->buf + off, first);
+    memcpy(buf + first, io->buf, size - first);
+
+    io->pos += size;
+    record_read(io, size, stalled);
+    SDL_CondBroadcast(io->cond);
+    SDL_UnlockMutex(io->mutex);
+    return size;
+}
+
+static int thread_readahead(void * data) {
+    struct FileIo * io = data;
+    trace_thread_name("readahead");
+
+    SDL_LockMutex(io->mutex);
+    while (!io->stop) {
+        int64_t limit = io->pos + io->window * 3 / 4;
+        if (io->error || (io->end >= io->size) || (io->end >= limit)) {
+            SDL_CondWait(io->cond, io->mutex);
+            continue;
+        }
+
+        int64_t at = io->end;
+        size_t off = at % io->window;
+        int64_t len = FILE_IO_BLOCK;
+        if (len > (int64_t) (io->window - off)) len = io->window - off;
+        if (len > io->size - at) len = io->size - at;
+        if (len > limit - at) len = limit - at;
+
+        /* the oldest bytes are about to be overwritten */
+        if (io->start < at + len - (int64_t) io->window)
+            io->start = at + len - io->window;
+        int generation = io->generation;
+        SDL_UnlockMutex(io->mutex);
+
+        /* interrupted, or e.g. a soft nfs mount timing out */
+        struct TraceSpan span = trace_span_begin("read ahead");
+        ssize_t got;
+        int tries = 0;
+        do {
+            got = pread(io->fd, io->buf + off, len, at);
+        } while ((got < 0) && ((errno == EINTR) || (errno == EAGAIN)) &&
+                 (++tries < FILE_IO_RETRIES));
+        int error = errno;
+        trace_span_end(&span);
+
+        SDL_LockMutex(io->mutex);
+        /* seeked away while reading */
+        if (generation != io->generation) continue;
+
+        if (got > 0) io->end += got;
+        else io->error = got < 0 ? AVERROR(error) : AVERROR_EOF;
+        SDL_CondBroadcast(io->cond);
+    }
+    SDL_UnlockMutex(io->mutex);
+    return 0;
+}
+
+static int64_t file_io_seek(void * opaque, int64_t offset, int whence) {
+    struct FileIo * io = opaque;
+    if (whence & AVSEEK_SIZE) return io->size;
+
+    int64_t pos;
+    switch (whence & ~AVSEEK_FORCE) {
+        case SEEK_SET: pos = offset; break;
+        case SEEK_CUR: pos = io->pos + offset; break;
+        case SEEK_END: pos = io->size + offset; break;
+        default: return AVERROR(EINVAL);
+    }
+    if (pos < 0) return AVERROR(EINVAL);
+
+    /* the readahead thread works out how far to go from pos */
+    SDL_LockMutex(io->mutex);
+    io->pos = pos;
+    if ((pos < io->advised - (int64_t) io->window) || (pos > io->advised))
+        io->advised = pos;
+    SDL_CondBroadcast(io->cond);
+    SDL_UnlockMutex(io->mutex);
+    return pos;
+}
+
+struct FileIo * open_file_io(const char * path, enum FileIoMode mode, size_t window) {
+    if (mode == FILE_IO_FFMPEG) return NULL;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode) || (st.st_size == 0)) {
+        close(fd);
+        return NULL;
+    }
+
+    if (mode == FILE_IO_AUTO)
+        mode = on_network_fs(fd) ? FILE_IO_READAHEAD : FILE_IO_MMAP;
+    if (window == 0) window = FILE_IO_DEFAULT_WINDOW;
+    if (window < 4 * FILE_IO_BLOCK) window = 4 * FILE_IO_BLOCK;
+
+    struct FileIo * io = malloc(sizeof(struct FileIo));
+    *io = (struct FileIo) {
+        .mode = mode,
+        .fd = fd,
+        .size = st.st_size,
+        .pos = 0,
+        .window = window,
+        .map = NULL,
+        .advised = 0,
+        .buf = NULL,
+        .start = 0,
+        .end = 0,
+        .generation = 0,
+        .error = 0,
+        .stop = false,
+        .thread = NULL,
+        .mutex = SDL_CreateMutex(),
+        .cond = SDL_CreateCond()
+    };
+
+    if (io->mode == FILE_IO_MMAP) {
+        io->map = mmap(NULL, io->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        /* e.g. bigger than the address space */
+        if (io->map == MAP_FAILED) {
+            io->map = NULL;
+            io->mode = FILE_IO_READAHEAD;
+        }
+    }
+
+    if (io->mode == FILE_IO_READAHEAD) {
+        io->buf = malloc(window);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        io->thread = SDL_CreateThread(thread_readahead, "Readahead", io);
+        /* nothing would ever fill the buffer */
+        if (io->thread == NULL) {
+            fprintf(stderr, "couldn't start reading ahead: %s\n", SDL_GetError());
+            close_file_io(io);
+            return NULL;
+        }
+    }
+
+    uint8_t * avio_buf = av_malloc(AVIO_BUFFER_SIZE);
+    io->avio = avio_alloc_context(
+        avio_buf, AVIO_BUFFER_SIZE, 0, io,
+        io->mode == FILE_IO_MMAP ? mmap_read : readahead_read, NULL, file_io_seek
+    );
+    if (io->avio == NULL) {
+        av_free(avio_buf);
+        close_file_io(io);
+        return NULL;
+    }
+    return io;
+}
+
+void close_file_io(struct FileIo * io) {
+    if (io == NULL) return;
+
+    if (io->thread) {
+        SDL_LockMutex(io->mutex);
+        io->stop = true;
+        SDL_CondBroadcast(io->cond);
+        SDL_UnlockMutex(io->mutex);
+        SDL_WaitThread(io->thread, NULL);
+    }
+
+    if (io->avio) av_freep(&io->avio->buffer);
+    avio_context_free(&io->avio);
+    if (io->map) munmap(io->map, io->size);
+    free(io->buf);
+    close(io->fd);
+    SDL_DestroyCond(io->cond);
+    SDL_DestroyMutex(io->mutex);
+    free(io);
+}
+
+void file_io_stats(struct FileIo * io, struct FileIoStats * stats) {
+    if (io == NULL) {
+        *stats = (struct FileIoStats) {0};
+        return;
+    }
+    SDL_LockMutex(io->mutex);
+    *stats = io->stats;
+    SDL_UnlockMutex(io->mutex);
+}
+
+const char * file_io_mode_name(enum FileIoMode mode) {
+    switch (mode) {
+        case FILE_IO_AUTO: return "auto";
+        case FILE_IO_MMAP: return "mmap";
+        case FILE_IO_READAHEAD: return "readahead";
+        default: return "ffmpeg";
+    }
+}
@@ -0,0 +1,68 @@
+#pragma once
+#include "../av.h"
+
+/* reads local files for the demuxer in place of avformat's own file
+ * protocol, which asks for a few KiB at a time and blocks on each one.
+ * that's fine off a local ssd, but from a nas or a spinning disk every
+ * read can wait a whole round trip or seek, and high bitrate video
+ * stalls the demuxer on them all the time */
+
+enum FileIoMode {
+    FILE_IO_AUTO, /* readahead on network filesystems, mmap otherwise */
+    FILE_IO_MMAP, /* maps the whole file, hinting the kernel ahead of the reads */
+    FILE_IO_READAHEAD, /* a thread reads big blocks ahead into a buffer */
+    FILE_IO_FFMPEG /* avformat's own file reading */
+};
+
+#define FILE_IO_DEFAULT_WINDOW ((size_t) 64 << 20) /* bytes */
+#define FILE_IO_BLOCK ((size_t) 1 << 20) /* the readahead thread reads this much at once */
+#define FILE_IO_STALL 0.001 /* seconds. a read that took longer waited for the disk */
+#define FILE_IO_RETRIES 8 /* for a read that was interrupted or timed out */
+
+struct FileIoStats {
+    int64_t bytes; /* read by the demuxer */
+    int reads;
+    int stalls; /* reads that had to wait for the disk */
+    double stall_time, max_stall; /* seconds */
+};
+
+struct FileIo {
+    AVIOContext * avio;
+    enum FileIoMode mode; /* never FILE_IO_AUTO */
+    int fd;
+    int64_t size;
+    int64_t pos; /* where the demuxer reads next */
+    size_t window; /* how far ahead to read or hint */
+
+    /* FILE_IO_MMAP */
+    uint8_t * map;
+    int64_t advised; /* the kernel has been told about everything before here */
+
+    /* FILE_IO_READAHEAD. byte n of the file goes in buf[n % window], and
+     * bytes start to end are there. the thread keeps reading until end is
+     * window * 3/4 past pos, leaving the rest for seeking back a little */
+    uint8_t * buf;
+    int64_t start, end;
+    int generation; /* bumped when the buffer starts over somewhere else */
+    int error; /* from the last read, the demuxer gets it once it runs out,
+                * then the thread tries again */
+    bool stop;
+    SDL_Thread * thread;
+    SDL_mutex * mutex; /* everything above, and stats */
+    SDL_cond * cond; /* signalled when either side has moved */
+
+    struct FileIoStats stats;
+};
+
+/* opens path for reading, window being how much to read or hint ahead
+ * (0 for FILE_IO_DEFAULT_WINDOW). returns NULL for FILE_IO_FFMPEG,
+ * anything that isn't a regular file, e.g. a url, or if it couldn't be
+ * set up, in which case leave it to avformat. put avio in AVFormatContext.pb with AVFMT_FLAG_CUSTOM_IO
+ * set, and close it after the format context */
+struct FileIo * open_file_io(const char * path, enum FileIoMode mode, size_t window);
+void close_file_io(struct FileIo * io);
+
+void file_io_stats(struct FileIo * io, struct FileIoStats * stats);
+
+/* e.g. "mmap", for printing */
+const char * file_io_mode_name(enum FileIoMode mode);
@@ -0,0 +1,117 @@
+#include "framecache.h"
+#include "pool.h"
+
+struct FrameCache * create_frame_cache(int max_before, int max_after) {
+    struct FrameCache * cache = malloc(sizeof(struct FrameCache));
+    *cache = (struct FrameCache) {
+        .frames = NULL,
+        .count = 0,
+        .allocated = 0,
+        .cur = -1,
+        .detached = NULL,
+        .max_before = max_before,
+        .max_after = max_after
+    };
+    return cache;
+}
+
+void destroy_frame_cache(struct FrameCache * cache) {
+    for (int i = 0; i < cache->count; i++)
+        pool_put_frame(&cache->frames[i]);
+    pool_put_frame(&cache->detached);
+    free(cache->frames);
+    free(cache);
+}
+
+int cache_behind(const struct FrameCache * cache) {
+    return cache->cur < 0 ? 0 : cache->cur;
+}
+
+int cache_ahead(const struct FrameCache * cache) {
+    return cache->count - cache->cur - 1;
+}
+
+AVFrame * cache_front(const struct FrameCache * cache) {
+    return cache->count ? cache->frames[0] : NULL;
+}
+
+AVFrame * cache_back(const struct FrameCache * cache) {
+    return cache->count ? cache->frames[cache->count - 1] : NULL;
+}
+
+AVFrame * cache_current(const struct FrameCache * cache) {
+    return cache->cur < 0 ? cache->detached : cache->frames[cache->cur];
+}
+
+static void reserve(struct FrameCache * cache, int n) {
+    if (cache->count + n <= cache->allocated) return;
+    while (cache->count + n > cache->allocated)
+        cache->allocated = cache->allocated ? cache->allocated * 2 : 64;
+    cache->frames = realloc(cache->frames, cache->allocated * sizeof(AVFrame *));
+}
+
+void cache_append(struct FrameCache * cache, AVFrame * frame) {
+    reserve(cache, 1);
+    cache->frames[cache->count++] = frame;
+}
+
+void cache_prepend(struct FrameCache * cache, AVFrame ** frames, int n) {
+    reserve(cache, n);
+    memmove(cache->frames + n, cache->frames, cache->count * sizeof(AVFrame *));
+    memcpy(cache->frames, frames, n * sizeof(AVFrame *));
+    cache->count += n;
+    if (cache->cur >= 0) cache->cur += n;
+}
+
+int cache_find(const struct FrameCache * cache, int64_t ts) {
+    if (!cache->count || (ts < cache->frames[0]->pts)) return -1;
+
+    /* last frame starting at or before ts */
+    int lo = 0, hi = cache->count - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (cache->frames[mid]->pts <= ts) lo = mid;
+        else hi = mid - 1;
+    }
+
+    /* past the end of the last frame, whatever comes next isn't cached */
+    AVFrame * frame = cache->frames[lo];
+    if ((lo == cache->count - 1) && (ts != frame->pts) &&
+        ((frame->duration <= 0) || (ts >= frame->pts + frame->duration)))
+        return -1;
+    return lo;
+}
+
+void cache_show(struct FrameCache * cache, int idx) {
+    cache->cur = idx;
+    pool_put_frame(&cache->detached);
+}
+
+int cache_trim(struct FrameCache * cache) {
+    if (cache->cur < 0) return 0;
+
+    int drop_front = MAX(0, cache_behind(cache) - cache->max_before);
+    int drop_back = MAX(0, cache_ahead(cache) - cache->max_after);
+
+    for (int i = 0; i < drop_front; i++)
+        pool_put_frame(&cache->frames[i]);
+    for (int i = cache->count - drop_back; i < cache->count; i++)
+        pool_put_frame(&cache->frames[i]);
+
+    cache->count -= drop_front + drop_back;
+    memmove(cache->frames, cache->frames + drop_front, cache->count * sizeof(AVFrame *));
+    cache->cur -= drop_front;
+
+    return (drop_front ? CACHE_TRIMMED_FRONT : 0) | (drop_back ? CACHE_TRIMMED_BACK : 0);
+}
+
+void cache_clear(struct FrameCache * cache) {
+    for (int i = 0; i < cache->count; i++) {
+        if (i == cache->cur)
+            cache->detached = cache->frames[i];
+        else
+            pool_put_frame(&cache->frames[i]);
+    }
+    cache->count = 0;
+    cache->cur = -1;
+}
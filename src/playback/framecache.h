@@ -0,0 +1,49 @@
+#pragma once
+#include "../av.h"
+
+/* display-ready frames around the playhead, sorted by pts.
+ * frames[cur] is the frame being shown. the cached frames are always
+ * consecutive in the stream, so stepping either way inside the cache
+ * never skips a frame. the manager fills it at both ends: forward by
+ * decoding on, backward by decoding the gop before the first frame */
+struct FrameCache {
+    AVFrame ** frames;
+    int count, allocated;
+    int cur; /* -1 if no cached frame is being shown */
+    AVFrame * detached; /* the shown frame, kept alive after cache_clear */
+    int max_before, max_after; /* frames kept either side of cur */
+};
+
+struct FrameCache * create_frame_cache(int max_before, int max_after);
+void destroy_frame_cache(struct FrameCache * cache);
+
+/* frames cached before/after the current one */
+int cache_behind(const struct FrameCache * cache);
+int cache_ahead(const struct FrameCache * cache);
+
+/* NULL if the cache is empty */
+AVFrame * cache_front(const struct FrameCache * cache);
+AVFrame * cache_back(const struct FrameCache * cache);
+
+/* the frame being shown, which may be detached */
+AVFrame * cache_current(const struct FrameCache * cache);
+
+/* frame must come right after cache_back */
+void cache_append(struct FrameCache * cache, AVFrame * frame);
+
+/* frames must be in pts order and come right before cache_front */
+void cache_prepend(struct FrameCache * cache, AVFrame ** frames, int n);
+
+/* index of the frame that is showing at ts, or -1 if it isn't cached */
+int cache_find(const struct FrameCache * cache, int64_t ts);
+
+void cache_show(struct FrameCache * cache, int idx);
+
+#define CACHE_TRIMMED_FRONT 1
+#define CACHE_TRIMMED_BACK 2
+/* evicts frames outside the window around cur.
+ * returns which ends lost frames, as CACHE_TRIMMED_ flags */
+int cache_trim(struct FrameCache * cache);
+
+/* frees every frame but the one being shown */
+void cache_clear(struct FrameCache * cache);
@@ -0,0 +1,133 @@
+#include "framelru.h"
+#include "pool.h"
+
+struct FrameLru * create_frame_lru(size_t budget) {
+    struct FrameLru * lru = malloc(sizeof(struct FrameLru));
+    *lru = (struct FrameLru) {
+        .entries = NULL,
+        .count = 0,
+        .allocated = 0,
+        .bytes = 0,
+        .budget = budget,
+        .clock = 0
+    };
+    return lru;
+}
+
+void destroy_frame_lru(struct FrameLru * lru) {
+    for (int i = 0; i < lru->count; i++)
+        pool_put_frame(&lru->entries[i].frame);
+    free(lru->entries);
+    free(lru);
+}
+
+size_t frame_bytes(const AVFrame * frame) {
+    size_t bytes = sizeof(AVFrame);
+    for (int i = 0; i < AV_NUM_DATA_POINTERS; i++)
+        if (frame->buf[i]) bytes += frame->buf[i]->size;
+    return bytes;
+}
+
+/* index of the first entry with pts >= pts */
+static int lower_bound(const struct FrameLru * lru, int64_t pts) {
+    int lo = 0, hi = lru->count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (lru->entries[mid].frame->pts < pts) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+static void remove_entry(struct FrameLru * lru, int idx) {
+    lru->bytes -= lru->entries[idx].bytes;
+    pool_put_frame(&lru->entries[idx].frame);
+    lru->count--;
+    memmove(
+        lru->entries + idx, lru->entries + idx + 1,
+        (lru->count - idx) * sizeof(struct LruEntry)
+    );
+}
+
+/* a linear scan, but there are only ever a few thousand frames
+ * and this runs once per decoded frame at most */
+static void evict(struct FrameLru * lru) {
+    while (lru->bytes > lru->budget && lru->count) {
+        int oldest = 0;
+        for (int i = 1; i < lru->count; i++)
+            if (lru->entries[i].used < lru->entries[oldest].used) oldest = i;
+        remove_entry(lru, oldest);
+    }
+}
+
+void lru_insert(struct FrameLru * lru, const AVFrame * frame) {
+    if (frame->pts == AV_NOPTS_VALUE) return;
+
+    int idx = lower_bound(lru, frame->pts);
+    if (idx < lru->count && lru->entries[idx].frame->pts == frame->pts) {
+        lru->entries[idx].used = ++lru->clock;
+        return;
+    }
+
+    size_t bytes = frame_bytes(frame);
+    if (bytes > lru->budget) return;
+
+    AVFrame * ref = pool_clone_frame(frame);
+    if (ref == NULL) return;
+
+    if (lru->count == lru->allocated) {
+        lru->allocated = lru->allocated ? lru->allocated * 2 : 64;
+        lru->entries = realloc(lru->entries, lru->allocated * sizeof(struct LruEntry));
+    }
+    memmove(
+        lru->entries + idx + 1, lru->entries + idx,
+        (lru->count - idx) * sizeof(struct LruEntry)
+    );
+    lru->entries[idx] = (struct LruEntry) {
+        .frame = ref,
+        .bytes = bytes,
+        .used = ++lru->clock
+    };
+    lru->count++;
+    lru->bytes += bytes;
+
+    evict(lru);
+}
+
+static AVFrame * take_ref(struct FrameLru * lru, int idx) {
+    lru->entries[idx].used = ++lru->clock;
+    return pool_clone_frame(lru->entries[idx].frame);
+}
+
+AVFrame * lru_find(struct FrameLru * lru, int64_t ts) {
+    /* last frame starting at or before ts */
+    int idx = lower_bound(lru, ts);
+    if (idx < lru->count && lru->entries[idx].frame->pts == ts)
+        return take_ref(lru, idx);
+    if (idx == 0) return NULL;
+
+    const AVFrame * frame = lru->entries[idx - 1].frame;
+    if ((frame->duration <= 0) || (ts >= frame->pts + frame->duration))
+        return NULL;
+    return take_ref(lru, idx - 1);
+}
+
+AVFrame * lru_following(struct FrameLru * lru, const AVFrame * frame) {
+    if (frame->duration <= 0) return NULL;
+
+    int64_t pts = frame->pts + frame->duration;
+    int idx = lower_bound(lru, pts);
+    if (idx < lru->count && lru->entries[idx].frame->pts == pts)
+        return take_ref(lru, idx);
+    return NULL;
+}
+
+AVFrame * lru_preceding(struct FrameLru * lru, const AVFrame * frame) {
+    int idx = lower_bound(lru, frame->pts);
+    if (idx == 0) return NULL;
+
+    const AVFrame * prev = lru->entries[idx - 1].frame;
+    if ((prev->duration <= 0) || (prev->pts + prev->duration != frame->pts))
+        return NULL;
+    return take_ref(lru, idx - 1);
+}
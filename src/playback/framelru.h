@@ -0,0 +1,38 @@
+#pragma once
+#include "../av.h"
+
+/* display-ready frames that have been shown or cached before, kept by
+ * pts so revisiting them (scrubbing back and forth) needs no decoding.
+ * holds its own references, so frames stay alive while both this and
+ * the frame cache use them. bounded by the bytes their buffers take up,
+ * evicting the least recently used frames first */
+struct LruEntry {
+    AVFrame * frame;
+    size_t bytes;
+    uint64_t used; /* lru->clock when last inserted or looked up */
+};
+
+struct FrameLru {
+    struct LruEntry * entries; /* sorted by pts */
+    int count, allocated;
+    size_t bytes, budget;
+    uint64_t clock;
+};
+
+struct FrameLru * create_frame_lru(size_t budget);
+void destroy_frame_lru(struct FrameLru * lru);
+
+/* keeps a reference to frame. does nothing if a frame with
+ * the same pts is already in, or frame has no pts */
+void lru_insert(struct FrameLru * lru, const AVFrame * frame);
+
+/* what frame's buffers take up, and the frame itself */
+size_t frame_bytes(const AVFrame * frame);
+
+/* new reference to the frame showing at ts, or NULL */
+AVFrame * lru_find(struct FrameLru * lru, int64_t ts);
+
+/* new reference to the frame right after/before frame, or NULL.
+ * frames only count as adjacent if their durations say so */
+AVFrame * lru_following(struct FrameLru * lru, const AVFrame * frame);
+AVFrame * lru_preceding(struct FrameLru * lru, const AVFrame * frame);
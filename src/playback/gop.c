@@ -0,0 +1,214 @@
+#include "gop.h"
+#include "pool.h"
+#include "framelru.h"
+
+struct GopEngine * create_gop_engine(
+    struct ChNode * workers, int nworkers, bool intra_only, size_t budget
+) {
+    struct GopEngine * engine = malloc(sizeof(struct GopEngine));
+    *engine = (struct GopEngine) {
+        .workers = workers,
+        .busy = calloc(nworkers, sizeof(bool)),
+        .nworkers = nworkers,
+        .intra_only = intra_only,
+        .gops = NULL,
+        .ngops = 0,
+        .gops_allocated = 0,
+        .last_duration = 0,
+        .budget = budget,
+        .frame_bytes = 0
+    };
+    return engine;
+}
+
+void destroy_gop(struct Gop * gop) {
+    if (gop == NULL) return;
+    for (int i = 0; i < gop->npkts; i++)
+        pool_put_packet(&gop->pkts[i]);
+    for (int i = gop->next_frame; i < gop->nframes; i++)
+        pool_put_frame(&gop->frames[i]);
+    free(gop->pkts);
+    free(gop->frames);
+    free(gop);
+}
+
+/* waits for the workers to hand back anything they're still decoding */
+void destroy_gop_engine(struct GopEngine * engine) {
+    if (engine == NULL) return;
+    gop_reset(engine);
+    for (int i = 0; i < engine->nworkers; i++) {
+        if (!engine->busy[i]) continue;
+        struct Message msg = ch_wait_receive(engine->workers[i]);
+        destroy_gop(msg.gop);
+    }
+    free(engine->gops);
+    free(engine->busy);
+    free(engine);
+}
+
+static struct Gop * last_gop(const struct GopEngine * engine) {
+    return engine->ngops ? engine->gops[engine->ngops - 1] : NULL;
+}
+
+static void start_gop(struct GopEngine * engine) {
+    struct Gop * gop = malloc(sizeof(struct Gop));
+    *gop = (struct Gop) { .state = GOP_BUILDING };
+
+    if (engine->ngops == engine->gops_allocated) {
+        engine->gops_allocated = engine->gops_allocated ? engine->gops_allocated * 2 : 8;
+        engine->gops = realloc(engine->gops, engine->gops_allocated * sizeof(struct Gop *));
+    }
+    engine->gops[engine->ngops++] = gop;
+}
+
+static void queue_gop(struct Gop * gop) {
+    gop->state = GOP_QUEUED;
+    gop->frames_expected = gop->npkts;
+}
+
+void gop_end_of_stream(struct GopEngine * engine) {
+    struct Gop * gop = last_gop(engine);
+    if (gop && (gop->state == GOP_BUILDING))
+        queue_gop(gop);
+}
+
+void gop_add_packet(struct GopEngine * engine, AVPacket * pkt) {
+    struct Gop * gop = last_gop(engine);
+    bool building = gop && (gop->state == GOP_BUILDING);
+
+    /* some muxers don't bother flagging intra-only packets */
+    if (engine->intra_only || (pkt->flags & AV_PKT_FLAG_KEY)) {
+        gop_end_of_stream(engine);
+        start_gop(engine);
+        gop = last_gop(engine);
+    } else if (!building) {
+        /* nothing before the first keyframe can be decoded on its own */
+        pool_put_packet(&pkt);
+        return;
+    }
+
+    if (gop->npkts == gop->pkts_allocated) {
+        gop->pkts_allocated = gop->pkts_allocated ? gop->pkts_allocated * 2 : 32;
+        gop->pkts = realloc(gop->pkts, gop->pkts_allocated * sizeof(AVPacket *));
+    }
+    gop->pkts[gop->npkts++] = pkt;
+
+    /* no point waiting for the next packet to know this one's complete */
+    if (engine->intra_only) queue_gop(gop);
+}
+
+/* bytes of frames gop holds, or will once it's decoded */
+static size_t gop_bytes(const struct GopEngine * engine, const struct Gop * gop) {
+    int frames = gop->state == GOP_DONE ?
+        gop->nframes - gop->next_frame : gop->frames_expected;
+    return (size_t) frames * engine->frame_bytes;
+}
+
+/* of the gops in the given states or later */
+static size_t held_bytes(const struct GopEngine * engine, enum GopState from) {
+    size_t bytes = 0;
+    for (int i = 0; i < engine->ngops; i++)
+        if (engine->gops[i]->state >= from) bytes += gop_bytes(engine, engine->gops[i]);
+    return bytes;
+}
+
+void gop_dispatch(struct GopEngine * engine) {
+    size_t held = held_bytes(engine, GOP_DECODING);
+    bool holding = false;
+    for (int i = 0; i < engine->ngops; i++)
+        if (engine->gops[i]->state >= GOP_DECODING) holding = true;
+
+    int worker = 0;
+    for (int i = 0; i < engine->ngops; i++) {
+        struct Gop * gop = engine->gops[i];
+        if (gop->state != GOP_QUEUED) continue;
+
+        while ((worker < engine->nworkers) && engine->busy[worker]) worker++;
+        if (worker == engine->nworkers) return;
+
+        /* one gop always goes, however big, or nothing would move */
+        size_t bytes = gop_bytes(engine, gop);
+        if (holding && ((engine->frame_bytes == 0) || (held + bytes > engine->budget)))
+            return;
+        held += bytes;
+        holding = true;
+
+        gop->state = GOP_DECODING;
+        engine->busy[worker] = true;
+        ch_send(engine->workers[worker],
+            (struct Message) { .type = MSG_DECODE_GOP, .gop = gop }
+        );
+    }
+}
+
+bool gop_wants_packets(const struct GopEngine * engine) {
+    /* one gop per worker plus the one being built, and no more queued up
+     * than the budget would let through. what bounds the frames' memory
+     * is gop_dispatch holding gops back */
+    return (engine->ngops <= engine->nworkers) &&
+        (held_bytes(engine, GOP_QUEUED) < engine->budget);
+}
+
+void gop_decoded(struct GopEngine * engine, int worker, struct Gop * gop) {
+    engine->busy[worker] = false;
+    if ((engine->frame_bytes == 0) && gop->nframes)
+        engine->frame_bytes = frame_bytes(gop->frames[0]);
+    if (gop->orphaned)
+        destroy_gop(gop);
+    else
+        gop->state = GOP_DONE;
+}
+
+static void pop_gop(struct GopEngine * engine) {
+    destroy_gop(engine->gops[0]);
+    engine->ngops--;
+    memmove(engine->gops, engine->gops + 1, engine->ngops * sizeof(struct Gop *));
+}
+
+int gop_next_frame(struct GopEngine * engine, AVFrame ** frame) {
+    while (engine->ngops) {
+        struct Gop * gop = engine->gops[0];
+        if (gop->state != GOP_DONE) return 0;
+
+        if (gop->next_frame == gop->nframes) {
+            pop_gop(engine);
+            continue;
+        }
+
+        AVFrame * next = gop->frames[gop->next_frame];
+
+        /* a missing intra frame is just a decode error, nothing to fall back from */
+        if ((gop->next_frame == 0) && !engine->intra_only) {
+            if (gop->corrupt) return GOP_BROKEN;
+
+            /* frames shown before the keyframe depend on the previous gop.
+             * if they're missing there's a gap */
+            int64_t expected = engine->last_pts + engine->last_duration;
+            if (!gop->lossy && (engine->last_duration > 0) &&
+                (next->pts > expected + engine->last_duration / 2))
+                return GOP_BROKEN;
+        }
+
+        gop->next_frame++;
+        engine->last_pts = next->pts;
+        engine->last_duration = gop->lossy ? 0 : next->duration;
+        *frame = next;
+        return 1;
+    }
+    return 0;
+}
+
+bool gop_empty(const struct GopEngine * engine) {
+    return engine->ngops == 0;
+}
+
+void gop_reset(struct GopEngine * engine) {
+    for (int i = 0; i < engine->ngops; i++) {
+        if (engine->gops[i]->state == GOP_DECODING)
+            engine->gops[i]->orphaned = true;
+        else
+            destroy_gop(engine->gops[i]);
+    }
+    engine->ngops = 0;
+    engine->last_duration = 0;
+}
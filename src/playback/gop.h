@@ -0,0 +1,84 @@
+#pragma once
+#include "../av.h"
+#include "ipc.h"
+
+/* decodes independent gops (a keyframe and the packets up to the next one)
+ * on several decoders at once. for intra-only codecs every packet is its
+ * own gop. the manager collects packets into gops,
+ * hands each one to an idle thread_gopdec and takes the frames back out in
+ * stream order.
+ * this only works for closed gops. in an open gop the frames shown before
+ * the keyframe reference the previous gop, so they come out missing or
+ * corrupt. gop_next_frame notices that and the manager falls back to
+ * decoding serially */
+
+enum GopState {
+    GOP_BUILDING, /* still collecting packets */
+    GOP_QUEUED, /* waiting for a decoder */
+    GOP_DECODING,
+    GOP_DONE
+};
+
+struct Gop {
+    enum GopState state;
+    bool orphaned; /* dropped by a seek while decoding, free it when it comes back */
+    AVPacket ** pkts;
+    int npkts, pkts_allocated;
+    AVFrame ** frames; /* in presentation order */
+    int nframes, frames_allocated;
+    int next_frame; /* frames before this have been taken out */
+    int frames_expected; /* one per packet, counted once it's queued */
+    bool corrupt; /* the decoder flagged at least one frame */
+    bool lossy; /* decoded skipping frames (see quality.h), so gaps are expected */
+};
+
+struct GopEngine {
+    struct ChNode * workers;
+    bool * busy;
+    int nworkers;
+    bool intra_only; /* every packet is a gop */
+    struct Gop ** gops; /* oldest first. only the last can be building */
+    int ngops, gops_allocated;
+    int64_t last_pts, last_duration; /* of the last frame taken out */
+
+    /* every gop keeps all its frames until they're taken out, so the
+     * decoded ones plus those being decoded are kept under budget bytes.
+     * frame_bytes is measured off the first gop to come back, until
+     * then only one is decoded at a time */
+    size_t budget, frame_bytes;
+};
+
+/* the engine doesn't own workers */
+struct GopEngine * create_gop_engine(
+    struct ChNode * workers, int nworkers, bool intra_only, size_t budget
+);
+void destroy_gop_engine(struct GopEngine * engine);
+
+void destroy_gop(struct Gop * gop);
+
+/* takes ownership of pkt */
+void gop_add_packet(struct GopEngine * engine, AVPacket * pkt);
+
+/* no more packets are coming, the building gop is complete */
+void gop_end_of_stream(struct GopEngine * engine);
+
+/* sends queued gops to idle workers, as far as the budget allows */
+void gop_dispatch(struct GopEngine * engine);
+
+/* true while there's room for another gop, by count and by budget */
+bool gop_wants_packets(const struct GopEngine * engine);
+
+/* worker is done with gop */
+void gop_decoded(struct GopEngine * engine, int worker, struct Gop * gop);
+
+#define GOP_BROKEN (-1)
+/* gives the next frame in stream order.
+ * returns 1 and sets frame, 0 if it isn't decoded yet, or GOP_BROKEN if
+ * frames went missing between gops (an open gop) or came out corrupt */
+int gop_next_frame(struct GopEngine * engine, AVFrame ** frame);
+
+/* true if every gop has been taken out */
+bool gop_empty(const struct GopEngine * engine);
+
+/* drops every gop, for seeking. gops being decoded are freed when they come back */
+void gop_reset(struct GopEngine * engine);
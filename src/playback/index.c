@@ -0,0 +1,225 @@
+#include "index.h"
+#include "utils.h"
+#include "../trace.h"
+#include <sys/mman.h>
+
+#define INDEX_INITIAL_SIZE 256
+
+/* the cache holds the sorted KeyframeEntrys */
+static const struct CacheFormat cache_format = {
+    .magic = "AVKI",
+    .version = 1,
+    .extra_size = 0,
+    .record_size = sizeof(struct KeyframeEntry)
+};
+
+static struct KeyframeIndex * create_keyframe_index(const char * filename, int stream_idx) {
+    struct KeyframeIndex * index = malloc(sizeof(struct KeyframeIndex));
+    *index = (struct KeyframeIndex) {
+        .entries = malloc(INDEX_INITIAL_SIZE * sizeof(struct KeyframeEntry)),
+        .count = 0,
+        .allocated = INDEX_INITIAL_SIZE,
+        .complete = false,
+        .scanned_pts = INT64_MIN,
+        .mutex = SDL_CreateMutex(),
+        .builder = NULL,
+        .map = NULL,
+        .filename = strdup(filename),
+        .stream_idx = stream_idx,
+        .cache_path = NULL
+    };
+    atomic_init(&index->cancel, false);
+    return index;
+}
+
+void destroy_keyframe_index(struct KeyframeIndex * index) {
+    if (index == NULL) return;
+
+    if (index->builder) {
+        atomic_store(&index->cancel, true);
+        SDL_WaitThread(index->builder, NULL);
+    }
+
+    if (index->map)
+        munmap(index->map, index->map_size);
+    else
+        free(index->entries);
+
+    SDL_DestroyMutex(index->mutex);
+    free(index->filename);
+    free(index->cache_path);
+    free(index);
+}
+
+/* caller holds the mutex, unless no other thread can see index yet */
+static void index_add_keyframe(struct KeyframeIndex * index, struct KeyframeEntry entry) {
+    if (index->count == index->allocated) {
+        index->allocated *= 2;
+        index->entries = realloc(
+            index->entries, index->allocated * sizeof(struct KeyframeEntry)
+        );
+    }
+    index->entries[index->count++] = entry;
+}
+
+static int compare_entries(const void * a, const void * b) {
+    int64_t pts_a = ((const struct KeyframeEntry *) a)->pts;
+    int64_t pts_b = ((const struct KeyframeEntry *) b)->pts;
+    return (pts_a > pts_b) - (pts_a < pts_b);
+}
+
+/* the mov/mp4 demuxer reads every sample into the stream's index while
+ * opening the file, so there's no need to scan. other containers only
+ * index some keyframes (if any), which would make decode-forward too long */
+static bool has_complete_index(AVFormatContext * format_ctx, AVStream * stream) {
+    return
+        !strncmp(format_ctx->iformat->name, "mov,", 4) &&
+        avformat_index_get_entries_count(stream) > 0;
+}
+
+static void index_from_container(struct KeyframeIndex * index, AVStream * stream) {
+    int nentries = avformat_index_get_entries_count(stream);
+    for (int i = 0; i < nentries; i++) {
+        const AVIndexEntry * entry = avformat_index_get_entry(stream, i);
+        if (!(entry->flags & AVINDEX_KEYFRAME)) continue;
+        /* the table only has dts. decode-forward copes with the
+         * keyframe's pts being a little later than this. */
+        index_add_keyframe(index, (struct KeyframeEntry) {
+            .pts = entry->timestamp,
+            .dts = entry->timestamp,
+            .pos = entry->pos
+        });
+    }
+    qsort(index->entries, index->count, sizeof(struct KeyframeEntry), compare_entries);
+    index->complete = true;
+}
+
+/* the entries are used straight from the mapping */
+static int load_index_cache(struct KeyframeIndex * index, const struct FileIdentity * file_id) {
+    size_t map_size;
+    void * map = map_cache_file(index->cache_path, &cache_format, file_id, &map_size);
+    if (map == NULL) return -1;
+
+    const struct CacheHeader * header = map;
+    free(index->entries);
+    index->entries = (struct KeyframeEntry *) (header + 1);
+    index->count = index->allocated = header->count;
+    index->map = map;
+    index->map_size = map_size;
+    index->complete = true;
+    return 0;
+}
+
+static int thread_build_index(void * data) {
+    struct KeyframeIndex * index = data;
+    trace_thread_name("indexer");
+
+    SDL_SetThreadPriority(SDL_THREAD_PRIORITY_LOW);
+
+    AVFormatContext * format_ctx = NULL;
+    if (avformat_open_input(&format_ctx, index->filename, NULL, NULL)) {
+        fprintf(stderr, "failed to index `%s`\n", index->filename);
+        return -1;
+    }
+
+    /* we only need packet flags and timestamps of one stream */
+    for (unsigned i = 0; i < format_ctx->nb_streams; i++)
+        if ((int) i != index->stream_idx)
+            format_ctx->streams[i]->discard = AVDISCARD_ALL;
+
+    AVPacket * pkt = av_packet_alloc();
+    int ret = AVERROR(EAGAIN); /* in case it was cancelled before reading anything */
+    while (!atomic_load(&index->cancel) && !(ret = av_read_frame(format_ctx, pkt))) {
+        if (pkt->stream_index == index->stream_idx) {
+            int64_t pts = pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts;
+
+            SDL_LockMutex(index->mutex);
+            if (pkt->flags & AV_PKT_FLAG_KEY) {
+                index_add_keyframe(index, (struct KeyframeEntry) {
+                    .pts = pts,
+                    .dts = pkt->dts,
+                    .pos = pkt->pos
+                });
+            }
+            index->scanned_pts = MAX(index->scanned_pts, pts);
+            SDL_UnlockMutex(index->mutex);
+        }
+        av_packet_unref(pkt);
+    }
+    av_packet_free(&pkt);
+    avformat_close_input(&format_ctx);
+
+    if (ret != AVERROR_EOF) return 0;
+
+    SDL_LockMutex(index->mutex);
+    qsort(index->entries, index->count, sizeof(struct KeyframeEntry), compare_entries);
+    index->complete = true;
+    SDL_UnlockMutex(index->mutex);
+
+    /* nothing modifies entries anymore, so no need to hold the lock */
+    struct FileIdentity file_id;
+    if (index->cache_path && !get_file_identity(index->filename, &file_id))
+        save_cache_file(
+            index->cache_path, &cache_format, &file_id,
+            NULL, index->entries, index->count
+        );
+
+    return 0;
+}
+
+struct KeyframeIndex * open_keyframe_index(
+    const char * filename, AVFormatContext * format_ctx, int stream_idx
+) {
+    struct KeyframeIndex * index = create_keyframe_index(filename, stream_idx);
+    AVStream * stream = format_ctx->streams[stream_idx];
+
+    if (has_complete_index(format_ctx, stream)) {
+        index_from_container(index, stream);
+        return index;
+    }
+
+    struct FileIdentity file_id;
+    char cache_path[PATH_MAX];
+    if (!get_file_identity(filename, &file_id) &&
+        !get_cache_path(&file_id, "idx", cache_path, sizeof(cache_path))) {
+        index->cache_path = strdup(cache_path);
+        if (!load_index_cache(index, &file_id))
+            return index;
+    }
+
+    index->builder = SDL_CreateThread(thread_build_index, "Indexer", index);
+    if (index->builder == NULL) {
+        destroy_keyframe_index(index);
+        return NULL;
+    }
+    return index;
+}
+
+int index_find_keyframe(struct KeyframeIndex * index, int64_t ts) {
+    if (index == NULL) return -1;
+
+    SDL_LockMutex(index->mutex);
+
+    int ret = -1;
+    if (index->complete || ts <= index->scanned_pts) {
+        int lo = 0, hi = index->count;
+        while (lo < hi) {
+            int mid = lo + (hi - lo) / 2;
+            if (index->entries[mid].pts <= ts)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        ret = lo - 1;
+    }
+
+    SDL_UnlockMutex(index->mutex);
+    return ret;
+}
+
+struct KeyframeEntry index_get_keyframe(struct KeyframeIndex * index, int n) {
+    SDL_LockMutex(index->mutex);
+    struct KeyframeEntry entry = index->entries[n];
+    SDL_UnlockMutex(index->mutex);
+    return entry;
+}
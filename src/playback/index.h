@@ -0,0 +1,50 @@
+#pragma once
+#include "../av.h"
+#include <stdatomic.h>
+
+/* a keyframe of the video stream. timestamps are in stream time base,
+ * pos is the byte position of the packet in the file, or -1 */
+struct KeyframeEntry {
+    int64_t pts, dts, pos;
+};
+
+/* keyframes of one stream, sorted by pts.
+ * may still be filling in on a background thread, so
+ * only access it through the functions below. */
+struct KeyframeIndex {
+    struct KeyframeEntry * entries;
+    int count;
+    int allocated;
+    bool complete;
+    int64_t scanned_pts; /* keyframes up to here are in entries */
+
+    SDL_mutex * mutex;
+    SDL_Thread * builder;
+    atomic_bool cancel;
+
+    /* if loaded from the cache, entries points into this mapping */
+    void * map;
+    size_t map_size;
+
+    char * filename;
+    int stream_idx;
+    char * cache_path; /* NULL if there's nowhere to cache */
+};
+
+/* uses the container's sample table when it has a complete one.
+ * otherwise loads the index cached from an earlier run, or if there
+ * isn't one, starts scanning the whole file with a separate demuxer
+ * in the background and caches the result when done.
+ * format_ctx is only read from, never advanced. returns NULL on failure */
+struct KeyframeIndex * open_keyframe_index(
+    const char * filename, AVFormatContext * format_ctx, int stream_idx
+);
+
+void destroy_keyframe_index(struct KeyframeIndex * index);
+
+/* returns the number of the last keyframe with pts <= ts, or -1 if there
+ * is none, the background scan hasn't got that far yet, or index is NULL */
+int index_find_keyframe(struct KeyframeIndex * index, int64_t ts);
+
+/* the n'th keyframe, as numbered by index_find_keyframe */
+struct KeyframeEntry index_get_keyframe(struct KeyframeIndex * index, int n);
@@ -1,109 +1,164 @@
 #include "ipc.h"
+#include <stdatomic.h>
 
-struct QueuedMessage {
-    struct Message msg;
-    struct QueuedMessage * next;
-};
+/* every MessageQueue has exactly one producer thread and one consumer thread,
+ * so it is a bounded lock-free ring. the semaphores are only touched when
+ * one side has to sleep because the ring is empty or full. */
+#define MSGQ_CAPACITY 64
+#define MSGQ_MASK (MSGQ_CAPACITY - 1)
+#define CACHELINE_SIZE 64
 
 struct MessageQueue {
-    SDL_mutex * mutex;
-    SDL_semaphore * count;
-    struct QueuedMessage * first;
-    struct QueuedMessage * last;
+    /* consumer side */
+    _Alignas(CACHELINE_SIZE) atomic_size_t head;
+    size_t tail_cache;
+
+    /* producer side */
+    _Alignas(CACHELINE_SIZE) atomic_size_t tail;
+    size_t head_cache;
+
+    /* sleep/wake, only used when the ring is empty or full */
+    _Alignas(CACHELINE_SIZE) atomic_int rx_waiting;
+    atomic_int tx_waiting;
+    SDL_semaphore * rx_wake; /* may be shared with a ChSelector */
+    SDL_semaphore * tx_wake;
+    SDL_semaphore * own_rx_wake;
+
+    _Alignas(CACHELINE_SIZE) struct Message slots[MSGQ_CAPACITY];
 };
 
-struct MessageQueue create_message_queue(void) {
-    return (struct MessageQueue) {
-        SDL_CreateMutex(),
-        SDL_CreateSemaphore(0),
-        NULL, NULL 
-    };
-}
+static struct MessageQueue * create_message_queue(void) {
+    struct MessageQueue * msgq =
+        aligned_alloc(CACHELINE_SIZE, sizeof(struct MessageQueue));
 
-void msgq_print(struct MessageQueue * msgq) {
-    SDL_LockMutex(msgq->mutex);
-
-    struct QueuedMessage * next = msgq->first;
-    printf("(MessageQueue) [ ");
+    atomic_init(&msgq->head, 0);
+    atomic_init(&msgq->tail, 0);
+    msgq->tail_cache = msgq->head_cache = 0;
+    atomic_init(&msgq->rx_waiting, 0);
+    atomic_init(&msgq->tx_waiting, 0);
+    msgq->rx_wake = msgq->own_rx_wake = SDL_CreateSemaphore(0);
+    msgq->tx_wake = SDL_CreateSemaphore(0);
 
-    while (next) {
-        printf("%ld", next->msg.type);
-        next = next->next;
-        if (next) printf(", "); else printf(" ");
-    }
+    return msgq;
+}
 
-    printf("]\n");
-    SDL_UnlockMutex(msgq->mutex);
+static void destroy_message_queue(struct MessageQueue * msgq) {
+    SDL_DestroySemaphore(msgq->own_rx_wake);
+    SDL_DestroySemaphore(msgq->tx_wake);
+    free(msgq);
 }
 
-struct Message msgq_peek(struct MessageQueue * msgq) {
-    if (msgq->first) return msgq->first->msg;
-    else return (struct Message) { .type = MSG_NONE };
+/* wake the other side if it went to sleep on `waiting`.
+ * the fence pairs with the one in msgq_wait_receive/msgq_send so that
+ * either we see the flag or the sleeper sees our index update. */
+static void wake_if_waiting(atomic_int * waiting, SDL_semaphore * wake) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(waiting, memory_order_relaxed) &&
+        atomic_exchange(waiting, 0))
+        SDL_SemPost(wake);
 }
 
-void msgq_send(struct MessageQueue * msgq, struct Message msg) {
-    SDL_LockMutex(msgq->mutex);
+static bool msgq_try_pop(struct MessageQueue * msgq, struct Message * msg) {
+    size_t head = atomic_load_explicit(&msgq->head, memory_order_relaxed);
 
-    struct QueuedMessage * qd_msg = malloc(sizeof(struct QueuedMessage));
+    if (head == msgq->tail_cache) {
+        msgq->tail_cache = atomic_load_explicit(&msgq->tail, memory_order_acquire);
+        if (head == msgq->tail_cache) return false;
+    }
 
-    *qd_msg = (struct QueuedMessage) {
-        .msg = msg,
-        .next = NULL
-    };
+    *msg = msgq->slots[head & MSGQ_MASK];
+    atomic_store_explicit(&msgq->head, head + 1, memory_order_release);
+
+    wake_if_waiting(&msgq->tx_waiting, msgq->tx_wake);
+    return true;
+}
 
-    if (msgq->last) {
-        msgq->last->next = qd_msg;
-        msgq->last = qd_msg;
-    } else {
-        msgq->first = msgq->last = qd_msg;
+static bool msgq_try_push(struct MessageQueue * msgq, struct Message msg) {
+    size_t tail = atomic_load_explicit(&msgq->tail, memory_order_relaxed);
+
+    if (tail - msgq->head_cache == MSGQ_CAPACITY) {
+        msgq->head_cache = atomic_load_explicit(&msgq->head, memory_order_acquire);
+        if (tail - msgq->head_cache == MSGQ_CAPACITY) return false;
     }
 
-    SDL_UnlockMutex(msgq->mutex);    
+    msgq->slots[tail & MSGQ_MASK] = msg;
+    atomic_store_explicit(&msgq->tail, tail + 1, memory_order_release);
 
-    SDL_SemPost(msgq->count);
+    wake_if_waiting(&msgq->rx_waiting, msgq->rx_wake);
+    return true;
 }
 
-struct Message msgq_wait_receive(struct MessageQueue * msgq) {
-    SDL_LockMutex(msgq->mutex);
+void msgq_print(struct MessageQueue * msgq) {
+    size_t head = atomic_load(&msgq->head);
+    size_t tail = atomic_load(&msgq->tail);
+    printf("(MessageQueue) [ %zu/%d ]\n", tail - head, MSGQ_CAPACITY);
+}
 
-    SDL_SemWait(msgq->count);
+/* consumer side only */
+struct Message msgq_peek(struct MessageQueue * msgq) {
+    size_t head = atomic_load_explicit(&msgq->head, memory_order_relaxed);
+    if (head == atomic_load_explicit(&msgq->tail, memory_order_acquire))
+        return (struct Message) { .type = MSG_NONE };
+    return msgq->slots[head & MSGQ_MASK];
+}
 
-    struct QueuedMessage * got_msg = msgq->first;
-    struct Message ret = got_msg->msg;
+/* consumer side only. whether any of the waiting messages is of type */
+bool msgq_pending(struct MessageQueue * msgq, uint64_t type) {
+    size_t head = atomic_load_explicit(&msgq->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&msgq->tail, memory_order_acquire);
+    for (; head != tail; head++)
+        if (msgq->slots[head & MSGQ_MASK].type == type) return true;
+    return false;
+}
 
-    if (msgq->last == msgq->first) {
-        msgq->last = msgq->first = NULL;
-    } else {
-        msgq->first = msgq->first->next;
+/* blocks only if the queue is full */
+void msgq_send(struct MessageQueue * msgq, struct Message msg) {
+    while (!msgq_try_push(msgq, msg)) {
+        atomic_store(&msgq->tx_waiting, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (msgq_try_push(msgq, msg)) {
+            atomic_store(&msgq->tx_waiting, 0);
+            break;
+        }
+        SDL_SemWait(msgq->tx_wake);
     }
-    free(got_msg);
-
-    SDL_UnlockMutex(msgq->mutex);
-
-    return ret;
+}
 
+/* blocks only if the queue is empty.
+ * rx_wake may be shared with other queues in a selector, so a wakeup
+ * doesn't guarantee this queue has anything; just try again */
+struct Message msgq_wait_receive(struct MessageQueue * msgq) {
+    struct Message msg;
+    while (!msgq_try_pop(msgq, &msg)) {
+        atomic_store(&msgq->rx_waiting, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (msgq_try_pop(msgq, &msg)) {
+            atomic_store(&msgq->rx_waiting, 0);
+            break;
+        }
+        SDL_SemWait(msgq->rx_wake);
+    }
+    return msg;
 }
 
 struct Message msgq_receive(struct MessageQueue * msgq) {
-    if (SDL_SemValue(msgq->count))
-        return msgq_wait_receive(msgq);
+    struct Message msg;
+    if (msgq_try_pop(msgq, &msg))
+        return msg;
     else
         return (struct Message) { MSG_NONE };
 }
 
 struct ChNode create_channel(void) {
-    struct ChNode ret = {
-        .msgq_in = malloc(sizeof(struct MessageQueue)),
-        .msgq_out = malloc(sizeof(struct MessageQueue))
+    return (struct ChNode) {
+        .msgq_in = create_message_queue(),
+        .msgq_out = create_message_queue()
     };
-    *ret.msgq_in = create_message_queue();
-    *ret.msgq_out = create_message_queue();
-    return ret;
 }
 
 void destroy_channel(struct ChNode node) {
-    free(node.msgq_in);
-    free(node.msgq_out);
+    destroy_message_queue(node.msgq_in);
+    destroy_message_queue(node.msgq_out);
 }
 struct ChNode ch_remote_node(struct ChNode local_node) {
     return (struct ChNode) {
@@ -117,3 +172,80 @@ struct Message ch_receive(struct ChNode ch) { return msgq_receive(ch.msgq_in); }
 struct Message ch_wait_receive(struct ChNode ch) { return msgq_wait_receive(ch.msgq_in); }
 
 void ch_send(struct ChNode ch, struct Message msg) { msgq_send(ch.msgq_out, msg); }
+
+bool ch_try_send(struct ChNode ch, struct Message msg) { return msgq_try_push(ch.msgq_out, msg); }
+
+bool ch_pending(struct ChNode ch, enum MessageType type) { return msgq_pending(ch.msgq_in, type); }
+
+int ch_backlog(struct ChNode ch) {
+    size_t head = atomic_load_explicit(&ch.msgq_in->head, memory_order_relaxed);
+    return atomic_load_explicit(&ch.msgq_in->tail, memory_order_relaxed) - head;
+}
+
+struct ChSelector {
+    SDL_semaphore * wake;
+    struct MessageQueue ** msgqs;
+    int count;
+    int next; /* where to start polling, so no node can starve the others */
+};
+
+struct ChSelector * create_selector(void) {
+    struct ChSelector * sel = malloc(sizeof(struct ChSelector));
+    *sel = (struct ChSelector) {
+        .wake = SDL_CreateSemaphore(0),
+        .msgqs = NULL,
+        .count = 0,
+        .next = 0
+    };
+    return sel;
+}
+
+void destroy_selector(struct ChSelector * sel) {
+    for (int i = 0; i < sel->count; i++)
+        sel->msgqs[i]->rx_wake = sel->msgqs[i]->own_rx_wake;
+    SDL_DestroySemaphore(sel->wake);
+    free(sel->msgqs);
+    free(sel);
+}
+
+int selector_add(struct ChSelector * sel, struct ChNode ch) {
+    sel->msgqs = realloc(sel->msgqs, (sel->count + 1) * sizeof(struct MessageQueue *));
+    sel->msgqs[sel->count] = ch.msgq_in;
+    ch.msgq_in->rx_wake = sel->wake;
+    return sel->count++;
+}
+
+static int selector_try_pop(struct ChSelector * sel, struct Message * msg) {
+    for (int i = 0; i < sel->count; i++) {
+        int idx = (sel->next + i) % sel->count;
+        if (msgq_try_pop(sel->msgqs[idx], msg)) {
+            sel->next = (idx + 1) % sel->count;
+            return idx;
+        }
+    }
+    return -1;
+}
+
+static void selector_set_waiting(struct ChSelector * sel, int waiting) {
+    for (int i = 0; i < sel->count; i++)
+        atomic_store(&sel->msgqs[i]->rx_waiting, waiting);
+}
+
+int ch_try_select(struct ChSelector * sel, struct Message * msg) {
+    return selector_try_pop(sel, msg);
+}
+
+int ch_select(struct ChSelector * sel, struct Message * msg) {
+    int idx;
+    while ((idx = selector_try_pop(sel, msg)) < 0) {
+        selector_set_waiting(sel, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        if ((idx = selector_try_pop(sel, msg)) >= 0) {
+            selector_set_waiting(sel, 0);
+            break;
+        }
+        SDL_SemWait(sel->wake);
+        selector_set_waiting(sel, 0);
+    }
+    return idx;
+}
@@ -5,31 +5,64 @@ enum MessageType {
     /* all */
     MSG_NONE,
 
+    /* main -> manage, manage -> demux, vdec, adec, conv, gopdec */
+    MSG_QUIT,
+
+    /* main -> manage, manage -> demux */
+    MSG_SEEK,
+
     /* main -> manage */
     MSG_ADVANCE_FRAME,
+    MSG_STEP_BACK,
+    MSG_PAUSED, /* just wakes the manager to look at the clock */
 
     /* manage -> demux */
     MSG_DEMUX_PKT,
 
     /* manage -> vdec, manage -> adec */
-    MSG_DECODE_FRAME,
+    MSG_DECODE_FRAME, /* feeds a packet, which may give any number of frames */
+    MSG_FLUSH,
+
+    /* manage -> vdec */
+    MSG_DRAIN, /* no more packets, send out whatever the decoder holds */
+
+    /* manage -> conv */
+    MSG_CONVERT_FRAME,
+
+    /* manage -> gopdec */
+    MSG_DECODE_GOP,
 
     /* demux -> manage */
     MSG_VIDEO_PKT_READY,
     MSG_AUDIO_PKT_READY,
     MSG_NO_PKT_READY,
+    MSG_DEMUX_EOF,
     
-    /* vdec -> manage */
+    /* vdec -> manage, conv -> manage */
     MSG_VIDEO_FRAME_READY,
+
+    /* vdec -> manage */
+    MSG_PKT_DONE, /* after the frames from a MSG_DECODE_FRAME */
+    MSG_VIDEO_EOF, /* after the frames from a MSG_DRAIN */
+
+    /* conv -> manage */
     MSG_NO_VIDEO_FRAME_READY,
+
+    /* gopdec -> manage */
+    MSG_GOP_DONE,
 };
 
 
+struct Gop;
+
 struct Message {
     uint64_t type;
+    int serial; /* which seek a request belongs to. replies echo it back */
     union {
         AVPacket * pkt; /* MSG_VIDEO_PKT_READY */
-        AVFrame * frame; /* MSG_VIDEO_FRAME_READY */
+        AVFrame * frame; /* MSG_VIDEO_FRAME_READY, MSG_CONVERT_FRAME */
+        int64_t ts; /* MSG_SEEK, MSG_ADVANCE_FRAME (AV_NOPTS_VALUE to just step) */
+        struct Gop * gop; /* MSG_DECODE_GOP, MSG_GOP_DONE */
     };
 };
 
@@ -37,7 +70,10 @@ struct Message {
 /* one side of a two-way communication channel.
  * get the other side with ch_remote_node()
  * it gets passed by value a lot cause its
- * basically a pointer */
+ * basically a pointer.
+ * each direction is a bounded single-producer/single-consumer ring,
+ * so a node must only be used from one thread, and ch_send blocks
+ * if the other side has fallen too far behind. */
 struct MessageQueue;
 
 struct ChNode {
@@ -51,3 +87,27 @@ struct Message ch_receive(struct ChNode ch);
 struct Message ch_wait_receive(struct ChNode ch);
 void destroy_channel(struct ChNode node);
 void ch_send(struct ChNode ch, struct Message msg);
+/* like ch_send, but gives up instead of waiting if the queue is full */
+bool ch_try_send(struct ChNode ch, struct Message msg);
+/* whether a message of type is waiting to be received, behind any others */
+bool ch_pending(struct ChNode ch, enum MessageType type);
+/* how many messages are waiting for ch to receive them. from any
+ * thread, but only a snapshot. ch_remote_node gives what ch has sent */
+int ch_backlog(struct ChNode ch);
+
+/* lets one thread sleep until any of several channels has a message.
+ * every node added must belong to the thread calling ch_select */
+struct ChSelector;
+
+struct ChSelector * create_selector(void);
+void destroy_selector(struct ChSelector * sel);
+
+/* returns the index the node will be reported as by ch_select.
+ * add nodes before the other side starts sending */
+int selector_add(struct ChSelector * sel, struct ChNode ch);
+
+/* blocks until one of the selector's nodes has a message, stores it in msg,
+ * and returns the index of the node it came from. */
+int ch_select(struct ChSelector * sel, struct Message * msg);
+/* like ch_select, but returns -1 instead of waiting */
+int ch_try_select(struct ChSelector * sel, struct Message * msg);
@@ -1,5 +1,12 @@
 #include "parallel.h"
 #include "utils.h"
+#include "pool.h"
+#include "gop.h"
+#include "framecache.h"
+#include "framelru.h"
+#include "prefetch.h"
+#include "quality.h"
+#include "../trace.h"
 #include <SDL2/SDL_mutex.h>
 #include <SDL2/SDL_thread.h>
 #include <libavcodec/packet.h>
@@ -8,201 +15,957 @@
 
 extern bool quit;
 
-int threads_initialized = 0;
-
-#define PACKET_QUEUE_SIZE 16
-#define FRAME_QUEUE_SIZE 16
+#define MAX_DECODE_SEEK_FRAMES 100
 
+/* packets waiting for vdec. grows if it has to, though the prefetch
+ * depth keeps it short */
 struct PacketQueue {
-    AVPacket * data[PACKET_QUEUE_SIZE];
-    int capacity;
+    AVPacket ** data;
+    int count, allocated;
     int front_idx;
 };
 
-struct FrameQueue {
-    AVFrame * data[FRAME_QUEUE_SIZE];
-    int capacity;
-    int front_idx;
-};
+struct PacketQueue create_packet_queue(void) { return (struct PacketQueue) {0}; }
 
-struct FrameQueue create_frame_queue(void) { return (struct FrameQueue) {0}; }
+/* puts back every packet, but keeps the space for more */
+static void clear_packet_queue(struct PacketQueue * pktq) {
+    for (int i = 0; i < pktq->count; i++) {
+        int idx = (i + pktq->front_idx) % pktq->allocated;
+        pool_put_packet(&pktq->data[idx]);
+    }
+    pktq->count = pktq->front_idx = 0;
+}
 
-static void destroy_frame_queue( struct FrameQueue * frameq) {
-    for (int i = 0; i < frameq->capacity; i++) {
-        int idx = (i + frameq->front_idx) % FRAME_QUEUE_SIZE;
-        av_frame_free(&frameq->data[idx]);
+static void destroy_packet_queue(struct PacketQueue * pktq) {
+    clear_packet_queue(pktq);
+    free(pktq->data);
+}
+
+static void queue_pkt(struct PacketQueue * pktq, AVPacket * pkt) {
+    if (pktq->count == pktq->allocated) {
+        int allocated = pktq->allocated ? pktq->allocated * 2 : 16;
+        pktq->data = realloc(pktq->data, allocated * sizeof(AVPacket *));
+        /* move the part that wrapped around to just after the rest */
+        for (int i = 0; i < pktq->front_idx; i++)
+            pktq->data[pktq->allocated + i] = pktq->data[i];
+        pktq->allocated = allocated;
     }
+    int back = (pktq->front_idx + pktq->count) % pktq->allocated;
+    pktq->data[back] = pkt;
+    pktq->count++;
 }
 
-static void queue_frame(struct FrameQueue * frameq, AVFrame * frame) {
-    int back = (frameq->front_idx + frameq->capacity) % PACKET_QUEUE_SIZE;
-    frameq->data[back] = frame;
-    frameq->capacity++;
+static AVPacket * dequeue_pkt(struct PacketQueue * pktq) {
+    if (!pktq->count) return NULL;
+    pktq->count--;
+    AVPacket * ret = pktq->data[pktq->front_idx];
+    pktq->front_idx = (pktq->front_idx + 1) % pktq->allocated;
+    return ret;
 }
 
-static AVFrame * dequeue_frame(struct FrameQueue * frameq) {
-    if (!frameq->capacity) return NULL;
-    frameq->capacity--;
-    AVFrame * ret = frameq->data[frameq->front_idx];
-    frameq->front_idx = (frameq->front_idx + 1) % FRAME_QUEUE_SIZE;
+/* feeds pkt to the decoder, or starts draining it if pkt is NULL.
+ * decoders are free to hold on to packets (frame threading delays output
+ * by up to one frame per thread), so this gives back zero or more frames
+ * through receive_frames, which is called until the decoder wants more input.
+ * returns 0, or the error from sending pkt */
+static int decode_packet(
+    AVCodecContext * codec_ctx, AVPacket * pkt,
+    int (* receive_frames)(AVCodecContext *, void *), void * userdata
+) {
+    int ret;
+    /* EAGAIN means frames have to be taken out before it accepts more */
+    while ((ret = avcodec_send_packet(codec_ctx, pkt)) == AVERROR(EAGAIN))
+        receive_frames(codec_ctx, userdata);
+
+    receive_frames(codec_ctx, userdata);
     return ret;
 }
 
-struct PacketQueue create_packet_queue(void) { return (struct PacketQueue) {0}; }
 
-static void destroy_packet_queue(struct PacketQueue * pktq) {
-    for (int i = 0; i < pktq->capacity; i++) {
-        int idx = (i + pktq->front_idx) % PACKET_QUEUE_SIZE;
-        av_packet_free(&pktq->data[idx]);
+/* state of an in-progress seek. frames are decoded forward from the
+ * keyframe before target, and the latest one starting at or before
+ * target is held in candidate until we know it's the one to show. */
+struct SeekState {
+    bool active;
+    int64_t target;
+    int keyframe; /* entry in the keyframe index we seeked to, or -1 */
+    int nframes; /* frames decoded since the keyframe */
+    AVFrame * candidate;
+    bool show_next; /* the next converted frame is where the seek landed */
+};
+
+/* what the decoders are working on, besides seeks */
+enum FillMode {
+    FILL_NONE,
+    FILL_FORWARD, /* decoding on from the back of the cache */
+    FILL_BACKWARD /* decoding the gop(s) before the front of the cache */
+};
+
+/* frames decoded before the front of the cache. they're only added to the
+ * cache once all of them are in, so the cache never has a hole in it */
+struct Backfill {
+    int64_t until; /* pts of the cache's front when this started */
+    int keyframe; /* entry in the keyframe index we seeked to, or -1 */
+    int64_t seek_ts;
+    int retries;
+    int sent; /* frames sent to the converter */
+    bool done; /* decoded up to `until` */
+    AVFrame ** frames;
+    int nframes, allocated;
+};
+
+#define MAX_BACKFILL_RETRIES 8
+#define MAX_LATE_DROPS 8 /* in a row, then one gets shown anyway */
+
+struct ManageState {
+    struct ManageInfo * in;
+    struct PacketQueue pktq;
+    struct FrameCache * cache;
+    struct FrameLru * lru; /* everything recently converted, for seeks outside the cache */
+    struct PlaybackStats stats;
+    struct Prefetch prefetch; /* how many frames and packets to keep ahead */
+
+    /* packets_decoding counts packets sent to vdec that it hasn't acknowledged
+     * yet. frames the decoder holds on to internally aren't counted, so
+     * frame threading can keep all its threads busy */
+    int packets_requested, packets_decoding, frames_converting;
+    bool eof; /* demuxer reached the end */
+    bool draining; /* told vdec to flush out its last frames */
+    bool video_eof; /* and it has */
+
+    /* bumped whenever the pipeline restarts. requests carry it and replies
+     * echo it back, so anything from before can be recognized and dropped */
+    int serial;
+    struct SeekState seek;
+
+    enum FillMode fill;
+    int64_t fill_after; /* FILL_FORWARD: frames up to here are cached already */
+    struct Backfill backfill;
+    bool at_start, at_end; /* the cache reaches that end of the stream */
+    int direction; /* 1 or -1, which way the playhead last moved */
+    bool audio; /* audio packets are in step with the playhead, pass them on */
+    bool audio_gap; /* some were dropped while the device was stopped */
+
+    /* frames dropped for being late, and what the decoders are told to
+     * leave out to catch up. last_pts is the last frame decoded forward */
+    struct DecodeQuality quality;
+    int late_drops;
+    int64_t last_pts;
+    bool degraded; /* the cache has frames like that, or gaps from dropped ones */
+
+    /* decoding gops in parallel instead of using vdec. gops stays around
+     * after falling back to vdec, to collect what the workers hand back */
+    bool use_gops;
+    struct GopEngine * gops;
+};
+
+/* the main thread only reads the current frame with the mutex held,
+ * and the cache never frees the current frame, so this is the only
+ * place that needs it */
+static void show_cached_frame(struct ManageState * st, int idx) {
+    struct ManageInfo * in = st->in;
+    SDL_LockMutex(in->current_frame_mutex);
+
+    cache_show(st->cache, idx);
+    *in->current_frame_ptr = cache_current(st->cache);
+    (*in->current_frame_seq)++;
+
+    SDL_UnlockMutex(in->current_frame_mutex);
+}
+
+static void clear_backfill(struct Backfill * backfill) {
+    for (int i = 0; i < backfill->nframes; i++)
+        pool_put_frame(&backfill->frames[i]);
+    free(backfill->frames);
+    *backfill = (struct Backfill) { .frames = NULL };
+}
+
+/* throw away everything in flight and restart demuxing and decoding from
+ * the keyframe at or before ts. replies to anything sent before this still
+ * arrive, but with an old serial */
+static void restart_pipeline(struct ManageState * st, int64_t ts) {
+    struct ManageInfo * in = st->in;
+
+    st->serial++;
+    st->eof = st->draining = st->video_eof = false;
+    st->last_pts = AV_NOPTS_VALUE;
+    prefetch_restart(&st->prefetch);
+
+    clear_packet_queue(&st->pktq);
+    if (st->gops) gop_reset(st->gops);
+
+    ch_send(in->ch_demux,
+        (struct Message) { .type = MSG_SEEK, .serial = st->serial, .ts = ts }
+    );
+    ch_send(in->ch_vdec, (struct Message) { .type = MSG_FLUSH, .serial = st->serial });
+}
+
+/* stop decoding, e.g. because what's being decoded no longer joins up with the cache */
+static void stop_fill(struct ManageState * st) {
+    st->serial++;
+    st->fill = FILL_NONE;
+    st->last_pts = AV_NOPTS_VALUE;
+    prefetch_restart(&st->prefetch);
+    clear_packet_queue(&st->pktq);
+    if (st->gops) gop_reset(st->gops);
+    clear_backfill(&st->backfill);
+}
+
+static void flush_audio(struct ManageState * st) {
+    ch_send(st->in->ch_adec, (struct Message) { .type = MSG_FLUSH, .serial = st->serial });
+    st->audio = true;
+}
+
+/* forget the cache and start decoding from the given keyframe
+ * (or from target, if there is no index) */
+static void seek_pipeline(struct ManageState * st, int keyframe) {
+    struct SeekState * seek = &st->seek;
+
+    cache_clear(st->cache);
+    clear_backfill(&st->backfill);
+    st->fill = FILL_FORWARD;
+    st->fill_after = AV_NOPTS_VALUE;
+    st->at_start = st->at_end = false;
+
+    pool_put_frame(&seek->candidate);
+    seek->active = true;
+    seek->show_next = false;
+    seek->keyframe = keyframe;
+    seek->nframes = 0;
+
+    restart_pipeline(st,
+        keyframe >= 0 ? index_get_keyframe(st->in->index, keyframe).pts : seek->target
+    );
+    flush_audio(st);
+}
+
+/* call after the current frame changes */
+static void playhead_moved(struct ManageState * st) {
+    int trimmed = cache_trim(st->cache);
+    if (trimmed & CACHE_TRIMMED_FRONT) {
+        st->at_start = false;
+        if (st->fill == FILL_BACKWARD) stop_fill(st);
+    }
+    if (trimmed & CACHE_TRIMMED_BACK) {
+        st->at_end = false;
+        if (st->fill == FILL_FORWARD) stop_fill(st);
     }
 }
 
-static void queue_pkt(struct PacketQueue * pktq, AVPacket * pkt) {
-    int back = (pktq->front_idx + pktq->capacity) % PACKET_QUEUE_SIZE;
-    pktq->data[back] = pkt;
-    pktq->capacity++;
+/* drop whatever the pipeline is doing and show frame, which came from
+ * the lru. the cache starts over from it, and fills back in from the lru
+ * as far as it can before decoding anything */
+static void show_lru_frame(struct ManageState * st, AVFrame * frame) {
+    struct SeekState * seek = &st->seek;
+    pool_put_frame(&seek->candidate);
+    seek->active = seek->show_next = false;
+    stop_fill(st);
+
+    cache_clear(st->cache);
+    st->at_start = st->at_end = false;
+    cache_append(st->cache, frame);
+    show_cached_frame(st, 0);
 }
 
-static AVPacket * dequeue_pkt(struct PacketQueue * pktq) {
-    if (!pktq->capacity) return NULL;
-    pktq->capacity--;
-    AVPacket * ret = pktq->data[pktq->front_idx];
-    pktq->front_idx = (pktq->front_idx + 1) % PACKET_QUEUE_SIZE;
-    return ret;
+static void start_seek(struct ManageState * st, int64_t ts) {
+    /* no need to decode anything if it's cached */
+    int idx = cache_find(st->cache, ts);
+    if (!st->seek.active && !st->seek.show_next && (idx >= 0)) {
+        st->stats.seek_hits++;
+        show_cached_frame(st, idx);
+        playhead_moved(st);
+        return;
+    }
+
+    AVFrame * frame = lru_find(st->lru, ts);
+    if (frame) {
+        st->stats.seek_hits++;
+        show_lru_frame(st, frame);
+        return;
+    }
+
+    st->stats.seek_misses++;
+    st->seek.target = ts;
+    seek_pipeline(st, index_find_keyframe(st->in->index, ts));
 }
 
-/* decode a single frame from pkt.
- * returns 0 on success, AVERROR_EOF on end of file, nonzero error code on decode error. */
-static int decode_frame(AVCodecContext * codec_ctx, AVPacket * pkt, AVFrame * frame_out) {
-    int ret;
-    send_packet:
-    switch (ret = avcodec_send_packet(codec_ctx, pkt)) {
-        case 0:
-            break;
-        default:
-            return ret;
+/* grows the cache with frames from the lru, as long as they join up */
+static void extend_from_lru(struct ManageState * st) {
+    struct FrameCache * cache = st->cache;
+    AVFrame * frame;
+
+    while ((cache_ahead(cache) < cache->max_after) &&
+           (frame = lru_following(st->lru, cache_back(cache))))
+        cache_append(cache, frame);
+
+    while (!st->at_start && (cache_behind(cache) < cache->max_before) &&
+           (frame = lru_preceding(st->lru, cache_front(cache))))
+        cache_prepend(cache, &frame, 1);
+}
+
+static void start_forward_fill(struct ManageState * st) {
+    int64_t after = cache_back(st->cache)->pts;
+    int keyframe = index_find_keyframe(st->in->index, after);
+
+    st->fill = FILL_FORWARD;
+    st->fill_after = after;
+    restart_pipeline(st,
+        keyframe >= 0 ? index_get_keyframe(st->in->index, keyframe).pts : after
+    );
+
+    /* picks the sound back up roughly where the pictures are */
+    if (st->direction > 0) flush_audio(st);
+}
+
+static void backfill_from(struct ManageState * st, int keyframe, int64_t seek_ts) {
+    struct Backfill * backfill = &st->backfill;
+    backfill->keyframe = keyframe;
+    backfill->seek_ts =
+        keyframe >= 0 ? index_get_keyframe(st->in->index, keyframe).pts : seek_ts;
+    restart_pipeline(st, backfill->seek_ts);
+}
+
+static void start_backfill(struct ManageState * st) {
+    int64_t until = cache_front(st->cache)->pts;
+
+    clear_backfill(&st->backfill);
+    st->backfill.until = until;
+    st->fill = FILL_BACKWARD;
+    st->audio = false;
+    backfill_from(st, index_find_keyframe(st->in->index, until - 1), until - 1);
+}
+
+static void finish_backfill(struct ManageState * st) {
+    struct Backfill * backfill = &st->backfill;
+
+    cache_prepend(st->cache, backfill->frames, backfill->nframes);
+    backfill->nframes = 0;
+    if (backfill->keyframe == 0) st->at_start = true;
+    clear_backfill(backfill);
+
+    st->fill = FILL_NONE;
+    playhead_moved(st);
+}
+
+/* the first frame decoded is already at or past `until`, so the keyframe
+ * we seeked to was too late (index only knew its dts, or there's no index) */
+static void retry_backfill(struct ManageState * st) {
+    struct Backfill * backfill = &st->backfill;
+
+    if ((backfill->keyframe == 0) || (backfill->retries++ >= MAX_BACKFILL_RETRIES)) {
+        st->at_start = true;
+        backfill->done = true;
+    } else if (backfill->keyframe > 0) {
+        backfill_from(st, backfill->keyframe - 1, 0);
+    } else {
+        /* no index, go back twice as far */
+        backfill_from(st, -1, backfill->seek_ts - (backfill->until - backfill->seek_ts) - 1);
     }
-    //return avcodec_receive_frame(codec_ctx, frame_out);
-    switch (ret = avcodec_receive_frame(codec_ctx, frame_out)) {
-        case AVERROR(EAGAIN):
-            goto send_packet;
-        case 0:
-            break;
+}
+
+/* decides what to decode next, when nothing more urgent is going on */
+static void schedule_fill(struct ManageState * st) {
+    if (st->seek.active || st->seek.show_next) return;
+    if (st->cache->cur < 0) return;
+
+    if (st->fill == FILL_BACKWARD) {
+        if (st->backfill.done && !st->frames_converting) finish_backfill(st);
+        return;
+    }
+
+    if (st->fill == FILL_NONE) extend_from_lru(st);
+
+    bool want_back = !st->at_start &&
+        (cache_behind(st->cache) <= st->cache->max_before / 2);
+    bool want_forward = !st->at_end &&
+        (cache_ahead(st->cache) < st->prefetch.frames);
+
+    if (want_back && ((st->direction < 0) || !want_forward)) {
+        if (st->fill == FILL_FORWARD) stop_fill(st);
+        start_backfill(st);
+    } else if (want_forward && (st->fill == FILL_NONE)) {
+        start_forward_fill(st);
+    }
+}
+
+/* frames go through the converter in order, so the first one back
+ * after this is frame */
+static void convert_async(struct ManageState * st, AVFrame * frame) {
+    ch_send(st->in->ch_conv,
+        (struct Message) { .type = MSG_CONVERT_FRAME, .serial = st->serial, .frame = frame }
+    );
+    st->frames_converting++;
+}
+
+static void finish_seek(struct ManageState * st, AVFrame * frame) {
+    struct SeekState * seek = &st->seek;
+    if (frame != seek->candidate)
+        pool_put_frame(&seek->candidate);
+    seek->candidate = NULL;
+    seek->active = false;
+    seek->show_next = true;
+    st->fill_after = frame->pts;
+    convert_async(st, frame);
+}
+
+static void handle_seek_frame(struct ManageState * st, AVFrame * frame) {
+    struct SeekState * seek = &st->seek;
+
+    if (frame->pts <= seek->target) {
+        pool_put_frame(&seek->candidate);
+        seek->candidate = frame;
+        seek->nframes++;
+
+        bool covers_target =
+            (frame->duration > 0) &&
+            (frame->pts + frame->duration > seek->target);
+
+        if (covers_target || seek->nframes >= MAX_DECODE_SEEK_FRAMES)
+            finish_seek(st, seek->candidate);
+    } else if (seek->candidate) {
+        finish_seek(st, seek->candidate);
+        convert_async(st, frame);
+    } else if (seek->keyframe > 0 && !seek->nframes) {
+        /* the keyframe's pts turned out to be after target
+         * (index only knew its dts), go back one more */
+        pool_put_frame(&frame);
+        seek_pipeline(st, seek->keyframe - 1);
+    } else {
+        /* target is before the first frame */
+        finish_seek(st, frame);
+    }
+}
+
+/* frames the decoders left out show up as gaps between the pts of
+ * the ones they didn't */
+static void count_skipped(struct ManageState * st, const AVFrame * frame) {
+    if ((st->last_pts != AV_NOPTS_VALUE) && (frame->duration > 0) &&
+        (atomic_load(st->quality.level) >= QUALITY_SKIP_NONREF)) {
+        int64_t missing = (frame->pts - st->last_pts) / frame->duration - 1;
+        if (missing > 0) st->stats.skipped_frames += missing;
+    }
+    st->last_pts = frame->pts;
+}
+
+/* whether frame is over before it could be shown, because playback has
+ * already gone past it. only while playing, stepping shows every frame.
+ * everything being late means nothing would ever be shown, so after
+ * enough drops in a row one goes through regardless */
+static bool drop_late_frame(struct ManageState * st, AVFrame * frame) {
+    struct ManageInfo * in = st->in;
+
+    if (!clock_playing_forward(in->clock)) {
+        quality_reset(&st->quality);
+        return false;
+    }
+    count_skipped(st, frame);
+
+    double duration = frame->duration > 0 ?
+        frame->duration * av_q2d(in->time_base) : in->frame_period;
+    double end = frame->pts * av_q2d(in->time_base) + duration;
+    bool late = end <= clock_get(in->clock);
+    quality_frame(&st->quality, late);
+
+    if (!late || (st->late_drops >= MAX_LATE_DROPS)) {
+        st->late_drops = 0;
+        return false;
+    }
+    st->late_drops++;
+    st->stats.dropped_frames++;
+    st->degraded = true;
+    pool_put_frame(&frame);
+    return true;
+}
+
+/* frame is the next one in presentation order, from vdec or the gop engine */
+static void handle_video_frame(struct ManageState * st, AVFrame * frame) {
+    struct Backfill * backfill = &st->backfill;
+
+    prefetch_frame_decoded(&st->prefetch, frame);
+
+    if (st->seek.active) {
+        handle_seek_frame(st, frame);
+    } else if (st->fill == FILL_FORWARD) {
+        /* restarted from a keyframe inside the cache */
+        if ((st->fill_after != AV_NOPTS_VALUE) && (frame->pts <= st->fill_after))
+            pool_put_frame(&frame);
+        else if (!drop_late_frame(st, frame))
+            convert_async(st, frame);
+    } else if ((st->fill == FILL_BACKWARD) && !backfill->done) {
+        if (frame->pts < backfill->until) {
+            convert_async(st, frame);
+            backfill->sent++;
+        } else {
+            pool_put_frame(&frame);
+            if (backfill->sent) backfill->done = true;
+            else retry_backfill(st);
+        }
+    } else {
+        pool_put_frame(&frame);
+    }
+}
+
+static void handle_converted_frame(struct ManageState * st, AVFrame * frame) {
+    struct Backfill * backfill = &st->backfill;
+
+    /* only ever shown once, while playing */
+    if (frame_degraded(frame)) st->degraded = true;
+    else lru_insert(st->lru, frame);
+
+    if (st->seek.show_next) {
+        st->seek.show_next = false;
+        cache_append(st->cache, frame);
+        show_cached_frame(st, st->cache->count - 1);
+    } else if (st->fill == FILL_BACKWARD) {
+        if (backfill->nframes == backfill->allocated) {
+            backfill->allocated = backfill->allocated ? backfill->allocated * 2 : 32;
+            backfill->frames =
+                realloc(backfill->frames, backfill->allocated * sizeof(AVFrame *));
+        }
+        backfill->frames[backfill->nframes++] = frame;
+    } else {
+        cache_append(st->cache, frame);
+    }
+}
+
+/* the converter couldn't do anything with a frame (it has said why).
+ * if that was where a seek landed, the next frame back is shown instead.
+ * conversions come back in order, so anything still converting was sent
+ * after it. with nothing left, the cache's first frame will do, if any */
+static void conversion_failed(struct ManageState * st) {
+    if (!st->seek.show_next || st->frames_converting) return;
+    st->seek.show_next = false;
+    if (st->cache->count) {
+        show_cached_frame(st, 0);
+        playhead_moved(st);
+    }
+}
+
+/* once playback stops after falling behind, the cache is decoded again
+ * from the current frame at full quality, so stepping and scrubbing
+ * show every frame as it really is */
+static void restore_quality(struct ManageState * st) {
+    st->degraded = false;
+    quality_reset(&st->quality);
+
+    /* a seek underway decodes everything again anyway. anything it
+     * gets that's still degraded sets degraded again */
+    if (st->seek.active || st->seek.show_next || (st->cache->cur < 0)) return;
+
+    st->seek.target = cache_current(st->cache)->pts;
+    seek_pipeline(st, index_find_keyframe(st->in->index, st->seek.target));
+}
+
+static bool wants_frames(const struct ManageState * st) {
+    int in_flight = st->packets_decoding + st->frames_converting;
+    switch (st->fill) {
+        case FILL_FORWARD:
+            return (in_flight + cache_ahead(st->cache)) < st->prefetch.frames;
+        case FILL_BACKWARD:
+            return !st->backfill.done && (in_flight < st->prefetch.frames);
         default:
-            return ret;
+            return false;
     }
-    return 0;
 }
 
+/* open gops can't be decoded on their own. carry on from the frame
+ * being shown (or the seek in progress) with vdec */
+static void stop_gop_decoding(struct ManageState * st) {
+    fprintf(stderr, "stream has open gops, decoding serially\n");
+    st->use_gops = false;
+    gop_reset(st->gops);
 
-int thread_manage(void * data) {
-    struct ManageInfo in = *(struct ManageInfo * )data;
+    AVFrame * current = cache_current(st->cache);
+    if (!st->seek.active && current)
+        st->seek.target = current->pts;
+    seek_pipeline(st, index_find_keyframe(st->in->index, st->seek.target));
+}
 
-    threads_initialized += 1;
+static void take_gop_frames(struct ManageState * st) {
+    AVFrame * frame;
+    int ret;
 
-    #define PREFETCH_FRAMES 3
+    /* a seek looks at every frame up to its target, so don't hold it back */
+    while (
+        st->use_gops && (st->seek.active || wants_frames(st)) &&
+        (ret = gop_next_frame(st->gops, &frame))
+    ) {
+        if (ret == GOP_BROKEN) {
+            stop_gop_decoding(st);
+            return;
+        }
+        handle_video_frame(st, frame);
+    }
+
+    if (st->use_gops && st->eof && gop_empty(st->gops))
+        st->video_eof = true;
+}
+
+static void send_decode_requests(struct ManageState * st) {
+    struct ManageInfo * in = st->in;
+
+    while ((st->seek.active || wants_frames(st)) && st->pktq.count) {
+        ch_send(in->ch_vdec, 
+            (struct Message) {
+                .type = MSG_DECODE_FRAME,
+                .serial = st->serial,
+                .pkt = dequeue_pkt(&st->pktq)
+            }
+        );
+        st->packets_decoding++;
+    }
+
+    if (st->eof && !st->draining && !st->pktq.count && !st->packets_decoding) {
+        ch_send(in->ch_vdec, (struct Message) { .type = MSG_DRAIN, .serial = st->serial });
+        st->draining = true;
+    }
+}
+
+static bool wants_packets(const struct ManageState * st) {
+    if (st->eof) return false;
+    if (!st->seek.active && !wants_frames(st)) return false;
+    if (st->use_gops)
+        return (st->packets_requested < st->prefetch.packets) && gop_wants_packets(st->gops);
+    return (st->packets_requested + st->pktq.count) < st->prefetch.packets;
+}
+
+/* reached the end of the stream, or of the keyframe's gop when it's
+ * all before the cache */
+static void handle_video_eof(struct ManageState * st) {
+    if (st->seek.active) {
+        /* ran out of file before passing the seek target */
+        if (st->seek.candidate) finish_seek(st, st->seek.candidate);
+    } else if (st->fill == FILL_FORWARD) {
+        st->fill = FILL_NONE;
+        st->at_end = true;
+    } else if ((st->fill == FILL_BACKWARD) && !st->backfill.done) {
+        if (st->backfill.sent) st->backfill.done = true;
+        else retry_backfill(st);
+    }
+}
+
+static void publish_stats(struct ManageState * st) {
+    st->stats.cached_frames = st->lru->count;
+    st->stats.cached_bytes = st->lru->bytes;
+    st->stats.prefetch_frames = st->prefetch.frames;
+    st->stats.prefetch_packets = st->prefetch.packets;
+    st->stats.decode_time = st->prefetch.decode_avg;
+    st->stats.decode_jitter = st->prefetch.decode_dev;
+    st->stats.decode_quality = atomic_load(st->quality.level);
+    st->stats.ended = st->at_end && !st->frames_converting && !cache_ahead(st->cache);
+
+    SDL_LockMutex(st->in->current_frame_mutex);
+    *st->in->stats = st->stats;
+    SDL_UnlockMutex(st->in->current_frame_mutex);
+}
+
+void release_message(struct Message msg) {
+    switch (msg.type) {
+        case MSG_VIDEO_PKT_READY:
+        case MSG_AUDIO_PKT_READY:
+        case MSG_DECODE_FRAME:
+            pool_put_packet(&msg.pkt);
+            break;
+        case MSG_VIDEO_FRAME_READY:
+        case MSG_CONVERT_FRAME:
+            pool_put_frame(&msg.frame);
+            break;
+        case MSG_DECODE_GOP:
+        case MSG_GOP_DONE:
+            destroy_gop(msg.gop);
+            break;
+    }
+}
+
+int thread_manage(void * data) {
+    struct ManageInfo in = *(struct ManageInfo * )data;
+    trace_thread_name("manager");
 
+    struct ManageState st = {
+        .in = &in,
+        .pktq = create_packet_queue(),
+        .cache = create_frame_cache(in.cache_before, MAX(in.cache_after, MIN_PREFETCH_FRAMES)),
+        .lru = create_frame_lru(in.lru_budget),
+        .stats = {0},
+        .packets_requested = 0,
+        .packets_decoding = 0,
+        .frames_converting = 0,
+        .eof = false,
+        .draining = false,
+        .video_eof = false,
+        .serial = 0,
+        .seek = { .active = false, .candidate = NULL, .show_next = false },
+        .fill = FILL_NONE,
+        .backfill = { .frames = NULL },
+        .at_start = false,
+        .at_end = false,
+        .direction = 1,
+        .audio = false,
+        .audio_gap = false,
+        .late_drops = 0,
+        .last_pts = AV_NOPTS_VALUE,
+        .degraded = false,
+        .use_gops = in.ngopdec > 0,
+        .gops = in.ngopdec > 0 ?
+            create_gop_engine(in.ch_gopdec, in.ngopdec, in.intra_only, in.lru_budget) : NULL
+    };
 
-    struct PacketQueue pktq = create_packet_queue();
-    struct FrameQueue frameq = create_frame_queue();
+    prefetch_init(&st.prefetch, in.frame_period, st.cache->max_after);
+    quality_init(&st.quality, in.quality);
 
-    int packets_requested, frames_requested;
-    packets_requested = frames_requested = 0;
+    struct ChSelector * sel = in.sel;
+    const int sel_main = selector_add(sel, in.ch);
+    const int sel_demux = selector_add(sel, in.ch_demux);
+    const int sel_vdec = selector_add(sel, in.ch_vdec);
+    const int sel_conv = selector_add(sel, in.ch_conv);
+    const int sel_gopdec = sel_conv + 1;
+    for (int i = 0; i < in.ngopdec; i++)
+        selector_add(sel, in.ch_gopdec[i]);
 
     while (!quit) {
-        /* for seeking, make a state machine */
-    
-        while (
-            (packets_requested + pktq.capacity) < PREFETCH_FRAMES
-        ) {
+        if (st.degraded && clock_paused(in.clock)) restore_quality(&st);
+        schedule_fill(&st);
+        publish_stats(&st);
+
+        while (wants_packets(&st)) {
             ch_send(in.ch_demux,
                 (struct Message) {
-                    .type = MSG_DEMUX_PKT
+                    .type = MSG_DEMUX_PKT,
+                    .serial = st.serial
                 }
             );
-            packets_requested++;
+            st.packets_requested++;
+            prefetch_packet_requested(&st.prefetch);
         }
 
-        while (
-            ((frames_requested + frameq.capacity) < PREFETCH_FRAMES) && pktq.capacity
-        ) {
-            ch_send(in.ch_vdec, 
-                (struct Message) {
-                    .type = MSG_DECODE_FRAME,
-                    .pkt = dequeue_pkt(&pktq)
-                }
-            );
-            frames_requested++;
+        if (st.use_gops) {
+            gop_dispatch(st.gops);
+            take_gop_frames(&st);
+        } else {
+            send_decode_requests(&st);
         }
-        
+
+        if (st.video_eof) handle_video_eof(&st);
+
+        /* the decoders are busy while there's anything left to send them
+         * or they haven't finished */
+        prefetch_set_busy(&st.prefetch,
+            st.seek.active || wants_frames(&st) || st.packets_decoding ||
+            (st.use_gops && !gop_empty(st.gops))
+        );
+
+        trace_counter("packets requested", st.packets_requested);
+        trace_counter("vdec queue", ch_backlog(ch_remote_node(in.ch_vdec)));
+        trace_counter("adec queue", ch_backlog(ch_remote_node(in.ch_adec)));
+        trace_counter("conv queue", ch_backlog(ch_remote_node(in.ch_conv)));
+        trace_counter("frames ahead", cache_ahead(st.cache));
+
+        /* sleep until one of the other threads has something for us */
         struct Message msg;
- 
-        msg = ch_receive(in.ch_demux);
+        int from = ch_select(sel, &msg);
+        TRACE_SCOPE("manage");
 
-        switch (msg.type) {
-            case MSG_VIDEO_PKT_READY:
-                queue_pkt(&pktq, msg.pkt);
-                packets_requested--;
-                break;
-            case MSG_AUDIO_PKT_READY:
-                ch_send(in.ch_adec,
-                    (struct Message) {
-                        .type = MSG_DECODE_FRAME,
-                        .pkt = msg.pkt
+        if (from == sel_demux) {
+            st.packets_requested--;
+            prefetch_packet_demuxed(&st.prefetch);
+            bool stale = msg.serial != st.serial;
+
+            switch (msg.type) {
+                case MSG_VIDEO_PKT_READY:
+                    if (stale)
+                        pool_put_packet(&msg.pkt);
+                    else if (st.use_gops)
+                        gop_add_packet(st.gops, msg.pkt);
+                    else
+                        queue_pkt(&st.pktq, msg.pkt);
+                    break;
+                case MSG_AUDIO_PKT_READY:
+                    if (stale || !st.audio) {
+                        pool_put_packet(&msg.pkt);
+                        break;
                     }
-                );
-            case MSG_NO_PKT_READY:
-                packets_requested--;
-                break;
+                    /* the device isn't playing, so the audio decoder
+                     * couldn't keep up with stepping. what's left out is
+                     * flushed so the rest lines up with the clock again */
+                    if (!clock_playing_forward(in.clock)) {
+                        pool_put_packet(&msg.pkt);
+                        st.audio_gap = true;
+                        break;
+                    }
+                    if (st.audio_gap) {
+                        flush_audio(&st);
+                        st.audio_gap = false;
+                    }
+                    ch_send(in.ch_adec,
+                        (struct Message) {
+                            .type = MSG_DECODE_FRAME,
+                            .serial = st.serial,
+                            .pkt = msg.pkt
+                        }
+                    );
+                    break;
+                case MSG_DEMUX_EOF:
+                    if (stale) break;
+                    st.eof = true;
+                    if (st.use_gops) gop_end_of_stream(st.gops);
+                    break;
+            }
+        }
+
+        if (from == sel_vdec) {
+            if (msg.type == MSG_PKT_DONE) {
+                st.packets_decoding--;
+            } else if (msg.type == MSG_VIDEO_EOF) {
+                if (msg.serial == st.serial) st.video_eof = true;
+            } else if (msg.serial != st.serial) {
+                pool_put_frame(&msg.frame);
+            } else {
+                handle_video_frame(&st, msg.frame);
+            }
         }
 
-        msg = ch_receive(in.ch_vdec);
+        if (from == sel_conv) {
+            st.frames_converting--;
 
-        switch (msg.type) {
-            case MSG_VIDEO_FRAME_READY:
-                queue_frame(&frameq, msg.frame);
-            case MSG_NO_VIDEO_FRAME_READY:
-                frames_requested--;
-                break;
+            if (msg.serial != st.serial) {
+                pool_put_frame(&msg.frame);
+            } else if (msg.type != MSG_VIDEO_FRAME_READY) {
+                conversion_failed(&st);
+            } else {
+                handle_converted_frame(&st, msg.frame);
+            }
         }
 
-        msg = ch_receive(in.ch);
+        if ((from >= sel_gopdec) && (from < sel_gopdec + in.ngopdec))
+            gop_decoded(st.gops, from - sel_gopdec, msg.gop);
 
-        switch (msg.type) {
+        /* nothing to step to until a seek lands */
+        bool can_step = !st.seek.active && !st.seek.show_next && (st.cache->cur >= 0);
+
+        if (from == sel_main) switch (msg.type) {
             case MSG_ADVANCE_FRAME:
-                SDL_LockMutex(in.current_frame_mutex);
-
-                if (frameq.capacity) {
-                    //if (frameq.data[frameq.front_idx] != *in.current_frame_ptr) {
-                    if (*in.current_frame_ptr)
-                        av_frame_free(in.current_frame_ptr);
-                    //}
-                    *in.current_frame_ptr = dequeue_frame(&frameq);
+                st.direction = 1;
+                if (can_step && cache_ahead(st.cache)) {
+                    /* when playing has fallen behind, go straight
+                     * to the last frame that has started by now */
+                    int idx = st.cache->cur + 1;
+                    while ((msg.ts != AV_NOPTS_VALUE) && (idx + 1 < st.cache->count) &&
+                        (st.cache->frames[idx + 1]->pts <= msg.ts)) {
+                        idx++;
+                        st.stats.dropped_frames++;
+                    }
+                    show_cached_frame(&st, idx);
+                    playhead_moved(&st);
                 }
+                break;
 
-                SDL_UnlockMutex(in.current_frame_mutex);
+            case MSG_STEP_BACK:
+                st.direction = -1;
+                if (can_step && cache_behind(st.cache)) {
+                    show_cached_frame(&st, st.cache->cur - 1);
+                    playhead_moved(&st);
+                }
                 break;
+
+            case MSG_SEEK:
+                start_seek(&st, msg.ts);
+                break;
+
+            case MSG_QUIT:
+                goto quit;
+        }
+    }
+    quit:
+    ch_send(in.ch_adec, (struct Message) { .type = MSG_QUIT });
+
+    /* the others may be blocked sending to us, with their own queue full
+     * too, so they're told without waiting and drained meanwhile. until
+     * each has answered, anything it sent would leak */
+    struct ChNode * untold = malloc((3 + in.ngopdec) * sizeof(struct ChNode));
+    int nuntold = 0;
+    untold[nuntold++] = in.ch_demux;
+    untold[nuntold++] = in.ch_vdec;
+    if (*in.converter) untold[nuntold++] = in.ch_conv;
+    for (int i = 0; i < in.ngopdec; i++)
+        untold[nuntold++] = in.ch_gopdec[i];
+    int nquitting = nuntold;
+
+    while (nquitting) {
+        for (int i = nuntold - 1; i >= 0; i--)
+            if (ch_try_send(untold[i], (struct Message) { .type = MSG_QUIT }))
+                untold[i] = untold[--nuntold];
+
+        /* a thread still untold might not send anything that would wake
+         * us, so poll until everyone has been told */
+        struct Message msg;
+        int from;
+        if (nuntold) {
+            from = ch_try_select(sel, &msg);
+            if (from < 0) {
+                SDL_Delay(1);
+                continue;
+            }
+        } else {
+            from = ch_select(sel, &msg);
         }
+        if (from == sel_main) continue;
 
-        usleep(10);
+        if (msg.type == MSG_QUIT)
+            nquitting--;
+        else if ((from >= sel_gopdec) && (from < sel_gopdec + in.ngopdec))
+            gop_decoded(st.gops, from - sel_gopdec, msg.gop);
+        else
+            release_message(msg);
     }
+    free(untold);
+
+    destroy_gop_engine(st.gops);
+    destroy_packet_queue(&st.pktq);
+    pool_put_frame(&st.seek.candidate);
+    clear_backfill(&st.backfill);
+
+    SDL_LockMutex(in.current_frame_mutex);
+    *in.current_frame_ptr = NULL;
+    SDL_UnlockMutex(in.current_frame_mutex);
+    destroy_frame_cache(st.cache);
+    destroy_frame_lru(st.lru);
     return 0;
 }
 
 
 int thread_demux(void * data) {
     struct DemuxInfo in = *(struct DemuxInfo *) data;
+    trace_thread_name("demuxer");
     
-    threads_initialized++;
-
-    while (!quit) {
-        struct Message msg = ch_receive(in.ch);
+    while (true) {
+        struct Message msg = ch_wait_receive(in.ch);
 
         switch (msg.type) {
-            case MSG_DEMUX_PKT:
-                AVPacket * pkt = av_packet_alloc();
+            case MSG_QUIT:
+                ch_send(in.ch, (struct Message) { .type = MSG_QUIT });
+                return 0;
+
+            case MSG_SEEK:
                 int ret;
-                if ((ret = av_read_frame(in.format_ctx, pkt))) {
+                if ((ret = av_seek_frame(
+                    in.format_ctx, in.vstream_idx, msg.ts, AVSEEK_FLAG_BACKWARD
+                )) < 0)
+                    fprintf(stderr, "Seeking Error: %s\n", av_err2str(ret));
+                break;
+
+            case MSG_DEMUX_PKT:
+                AVPacket * pkt = pool_get_packet();
+                struct TraceSpan span = trace_span_begin("demux");
+                ret = av_read_frame(in.format_ctx, pkt);
+                trace_span_end(&span);
+                if (ret) {
+                    pool_put_packet(&pkt);
+                    if (ret == AVERROR_EOF) {
+                        ch_send(in.ch,
+                            (struct Message) { .type = MSG_DEMUX_EOF, .serial = msg.serial }
+                        );
+                        break;
+                    }
                     fprintf(stderr, "Demuxing Error: %s\n", av_err2str(ret));
                     goto no_packet;
                 }
@@ -211,6 +974,7 @@ int thread_demux(void * data) {
                         in.ch,
                         (struct Message) {
                             .type = MSG_VIDEO_PKT_READY,
+                            .serial = msg.serial,
                             .pkt = pkt
                         }
                     );
@@ -220,130 +984,455 @@ int thread_demux(void * data) {
                         in.ch,
                         (struct Message) {
                             .type = MSG_AUDIO_PKT_READY,
+                            .serial = msg.serial,
                             .pkt = pkt
                         }
                     );
                     break;
                 }
                 no_packet:
+                pool_put_packet(&pkt);
                 ch_send(
                     in.ch,
-                    (struct Message) { .type = MSG_NO_PKT_READY }
+                    (struct Message) { .type = MSG_NO_PKT_READY, .serial = msg.serial }
                 );
                 break;
         }
     }
-    return 0;
 }
 
-#define MAX_DECODE_SEEK_FRAMES 100
+struct VDecodeState {
+    struct VDecodeInfo * in;
+    int serial;
+    int quality; /* the level frames come out at */
+};
+
+/* sends every frame the decoder has ready to the manager */
+static int receive_video_frames(AVCodecContext * codec_ctx, void * userdata) {
+    struct VDecodeState * state = userdata;
+    int ret;
+
+    while (true) {
+        AVFrame * frame = pool_get_frame();
+        if ((ret = avcodec_receive_frame(codec_ctx, frame))) {
+            pool_put_frame(&frame);
+            break;
+        }
+        if (frame->pts == AV_NOPTS_VALUE)
+            frame->pts = frame->best_effort_timestamp;
+        mark_decode_quality(frame, state->quality);
+        ch_send(state->in->ch,
+            (struct Message) {
+                .type = MSG_VIDEO_FRAME_READY,
+                .serial = state->serial,
+                .frame = frame
+            }
+        );
+    }
+
+    if ((ret != AVERROR(EAGAIN)) && (ret != AVERROR_EOF))
+        fprintf(stderr, "Decoding Error: %s\n", av_err2str(ret));
+    return ret;
+}
 
 int thread_vdec(void * data) {
     struct VDecodeInfo in = *(struct VDecodeInfo *) data;
+    trace_thread_name("video decoder");
+    int quality = QUALITY_FULL;
 
-    threads_initialized++;
-
-    while (!quit) {
-        struct Message msg = ch_receive(in.ch);
+    while (true) {
+        struct Message msg = ch_wait_receive(in.ch);
+        struct VDecodeState state = { .in = &in, .serial = msg.serial, .quality = quality };
+        int ret;
 
         switch (msg.type) {
+            case MSG_QUIT:
+                ch_send(in.ch, (struct Message) { .type = MSG_QUIT });
+                return 0;
+
+            case MSG_FLUSH:
+                avcodec_flush_buffers(in.codec_ctx);
+                break;
+
             case MSG_DECODE_FRAME:
-                AVFrame * frame = av_frame_alloc();
-                int ret;
-                if ((ret = decode_frame(in.codec_ctx, msg.pkt, frame))) {
+                apply_decode_quality(in.codec_ctx, atomic_load(in.quality), &quality);
+                /* frame threading hands frames back a few packets late,
+                 * so after a change these are marked a little off */
+                state.quality = quality;
+                struct TraceSpan span = trace_span_begin("decode");
+                ret = decode_packet(in.codec_ctx, msg.pkt, receive_video_frames, &state);
+                trace_span_end(&span);
+                pool_put_packet(&msg.pkt);
+                if (ret)
                     fprintf(stderr, "Decoding Error: %s\n", av_err2str(ret));
-                    goto no_frame;
+                ch_send(in.ch, (struct Message) { .type = MSG_PKT_DONE, .serial = msg.serial });
+                break;
+
+            case MSG_DRAIN:
+                struct TraceSpan drain_span = trace_span_begin("decode");
+                decode_packet(in.codec_ctx, NULL, receive_video_frames, &state);
+                trace_span_end(&drain_span);
+                ch_send(in.ch, (struct Message) { .type = MSG_VIDEO_EOF, .serial = msg.serial });
+                break;
+        }
+    }
+}
+
+/* collects every frame the decoder has ready into the gop */
+static int receive_gop_frames(AVCodecContext * codec_ctx, void * userdata) {
+    struct Gop * gop = userdata;
+    int ret;
+
+    while (true) {
+        AVFrame * frame = pool_get_frame();
+        if ((ret = avcodec_receive_frame(codec_ctx, frame))) {
+            pool_put_frame(&frame);
+            break;
+        }
+        if (frame->pts == AV_NOPTS_VALUE)
+            frame->pts = frame->best_effort_timestamp;
+        if ((frame->flags & AV_FRAME_FLAG_CORRUPT) || frame->decode_error_flags)
+            gop->corrupt = true;
+
+        if (gop->nframes == gop->frames_allocated) {
+            gop->frames_allocated = gop->frames_allocated ? gop->frames_allocated * 2 : 32;
+            gop->frames = realloc(gop->frames, gop->frames_allocated * sizeof(AVFrame *));
+        }
+        gop->frames[gop->nframes++] = frame;
+    }
+
+    if ((ret != AVERROR(EAGAIN)) && (ret != AVERROR_EOF))
+        fprintf(stderr, "Decoding Error: %s\n", av_err2str(ret));
+    return ret;
+}
+
+int thread_gopdec(void * data) {
+    struct GopDecodeInfo in = *(struct GopDecodeInfo *) data;
+    trace_thread_name("gop decoder");
+    int quality = QUALITY_FULL;
+
+    /* the manager waits for every gop it sent to come back,
+     * so keep answering until told to quit */
+    while (true) {
+        struct Message msg = ch_wait_receive(in.ch);
+
+        switch (msg.type) {
+            case MSG_QUIT:
+                ch_send(in.ch, (struct Message) { .type = MSG_QUIT });
+                return 0;
+
+            case MSG_DECODE_GOP:
+                struct Gop * gop = msg.gop;
+
+                /* every gop starts from a keyframe with nothing before it */
+                avcodec_flush_buffers(in.codec_ctx);
+                apply_decode_quality(in.codec_ctx, atomic_load(in.quality), &quality);
+                gop->lossy = quality >= QUALITY_SKIP_NONREF;
+                struct TraceSpan span = trace_span_begin("decode gop");
+                for (int i = 0; i < gop->npkts; i++) {
+                    if (!quit)
+                        decode_packet(in.codec_ctx, gop->pkts[i], receive_gop_frames, gop);
+                    pool_put_packet(&gop->pkts[i]);
                 }
+                gop->npkts = 0;
+                decode_packet(in.codec_ctx, NULL, receive_gop_frames, gop);
+                trace_span_end(&span);
+                for (int i = 0; i < gop->nframes; i++)
+                    mark_decode_quality(gop->frames[i], quality);
+
+                ch_send(in.ch, (struct Message) { .type = MSG_GOP_DONE, .gop = gop });
+                break;
+        }
+    }
+}
+
+int thread_conv(void * data) {
+    struct ConvertInfo in = *(struct ConvertInfo *) data;
+    trace_thread_name("converter");
+
+    while (true) {
+        struct Message msg = ch_wait_receive(in.ch);
+
+        switch (msg.type) {
+            case MSG_QUIT:
+                ch_send(in.ch, (struct Message) { .type = MSG_QUIT });
+                return 0;
+
+            case MSG_CONVERT_FRAME:
+                AVFrame * frame = convert_frame(in.conv, msg.frame);
                 ch_send(in.ch,
                     (struct Message) {
-                        MSG_VIDEO_FRAME_READY,
+                        .type = frame ? MSG_VIDEO_FRAME_READY : MSG_NO_VIDEO_FRAME_READY,
+                        .serial = msg.serial,
                         .frame = frame
                     }
                 );
                 break;
-                no_frame:
-                ch_send(in.ch,
-                    (struct Message) { .type = MSG_NO_VIDEO_FRAME_READY }
-                );
-                break;
         }
     }
-    return 0;
 }
 
-int thread_adec(void * data) {
-    struct ADecodeInfo in = *(struct ADecodeInfo *) data;
-    AVCodecContext * codec_ctx = in.codec_ctx;
+/* the device, ring and resampler are opened for the first frame that
+ * comes out of the decoder, since the stream's parameters can still be
+ * incomplete after a short probe. until then adev is 0 */
+struct ADecodeState {
+    AVFrame * frame;
+    struct SwrContext * swr_ctx;
+    SDL_AudioSpec aspec;
+    SDL_AudioDeviceID adev;
+    bool failed; /* couldn't open them, so the audio is thrown away */
+    int bytes_per_sample; /* all channels */
+    AVRational time_base;
+    struct Clock * clock;
+    struct AudioRing * ring;
+    struct ChNode ch;
+    int error; /* from receiving frames, reported along with sending's */
 
-    threads_initialized += 1;
+    /* resampler output, only ever grows */
+    uint8_t * buf;
+    int buf_samples;
+};
 
-    AVFrame * frame = av_frame_alloc();
+static void clear_ring(struct ADecodeState * state) {
+    SDL_LockAudioDevice(state->adev);
+    audio_ring_clear(state->ring);
+    SDL_UnlockAudioDevice(state->adev);
+    clock_audio_flushed(state->clock);
+}
+
+/* writes all of data into the ring, waiting for the device to make room
+ * if it has to. gives up if a flush or quit comes in meanwhile, since
+ * nothing would play then, or if the device stops and wouldn't make room.
+ * returns false if it did */
+static bool write_ring(struct ADecodeState * state, const uint8_t * data, size_t len) {
+    while (true) {
+        size_t n = audio_ring_write(state->ring, data, len);
+        data += n;
+        len -= n;
+        if (!len) return true;
+
+        if (quit || ch_pending(state->ch, MSG_FLUSH) || ch_pending(state->ch, MSG_QUIT))
+            return false;
+        /* part of it is in already, so start over lined up with the clock */
+        if (!clock_playing_forward(state->clock)) {
+            clear_ring(state);
+            return false;
+        }
+        audio_ring_wait_space(state->ring, 20);
+    }
+}
+
+static bool queue_silence(struct ADecodeState * state, int64_t bytes) {
+    static const uint8_t silence[4096] = {0};
+    bytes -= bytes % state->bytes_per_sample;
+    while (bytes > 0) {
+        int len = MIN(bytes, (int64_t) sizeof(silence));
+        if (!write_ring(state, silence, len)) return false;
+        bytes -= len;
+    }
+    return true;
+}
+
+/* queues samples that start at time start. after a seek or flush, they're
+ * first lined up with the clock: trimmed if they start before it, or
+ * preceded by silence if they start after it */
+static void queue_samples(
+    struct ADecodeState * state, uint8_t * samples, int nb_samples, double start
+) {
+    double rate = state->aspec.freq;
+    double end = start + nb_samples / rate;
+
+    if (!clock_audio_synced(state->clock)) {
+        double now = clock_get(state->clock);
+        if (end <= now) return;
+
+        if (start < now) {
+            int skip = (now - start) * rate;
+            samples += skip * state->bytes_per_sample;
+            nb_samples -= skip;
+        } else if (!queue_silence(state, (start - now) * rate * state->bytes_per_sample)) {
+            return;
+        }
+    }
+
+    if (write_ring(state, samples, nb_samples * state->bytes_per_sample))
+        clock_audio_queued(state->clock, end);
+}
+
+/* no changes allowed, so the device plays exactly what we ask for */
+static bool open_audio_output(struct ADecodeState * state, const AVFrame * frame) {
+    int channels = frame->ch_layout.nb_channels;
+    int bytes_per_sample = channels * SDL_AUDIO_BITSIZE(SDL_AUDIO_FMT) / 8;
+    struct AudioRing * ring = create_audio_ring(
+        (size_t) frame->sample_rate * bytes_per_sample * AUDIO_RING_SECONDS
+    );
 
     SDL_AudioSpec aspec;
     SDL_AudioDeviceID adev = SDL_OpenAudioDevice(
         0, 0,
         &(SDL_AudioSpec) {
-            .freq = codec_ctx->sample_rate,
+            .freq = frame->sample_rate,
             .format = SDL_AUDIO_FMT,
-            .channels = codec_ctx->ch_layout.nb_channels,
+            .channels = channels,
             .silence = 0,
             .samples = SDL_AUDIO_SAMPLES,
-            .callback = NULL,
-            .userdata = NULL,
+            .callback = audio_ring_callback,
+            .userdata = ring,
         },
         &aspec, 0
     );
-
-    SDL_PauseAudioDevice(adev, 0);
+    if (adev == 0) {
+        fprintf(stderr, "failed to open audio device: %s\n", SDL_GetError());
+        destroy_audio_ring(ring);
+        return false;
+    }
 
     struct SwrContext * swr_ctx = NULL;
     AVChannelLayout ch_layout = nb_ch_to_av_ch_layout(aspec.channels);
-    if (codec_ctx) {
-        swr_alloc_set_opts2(
-            &swr_ctx,
-            &ch_layout,
-            sample_fmt_sdl_to_av(aspec.format),
-            aspec.freq,
-            &codec_ctx->ch_layout,
-            codec_ctx->sample_fmt,
-            codec_ctx->sample_rate,
-            0,
-            NULL
+    swr_alloc_set_opts2(
+        &swr_ctx,
+        &ch_layout,
+        sample_fmt_sdl_to_av(aspec.format),
+        aspec.freq,
+        &frame->ch_layout,
+        frame->format,
+        frame->sample_rate,
+        0,
+        NULL
+    );
+    if (swr_init(swr_ctx)) {
+        fprintf(stderr, "failed to create audio resampling context\n");
+        swr_free(&swr_ctx);
+        SDL_CloseAudioDevice(adev);
+        destroy_audio_ring(ring);
+        return false;
+    }
+
+    state->swr_ctx = swr_ctx;
+    state->aspec = aspec;
+    state->adev = adev;
+    state->bytes_per_sample = bytes_per_sample;
+    state->ring = ring;
+    state->buf = malloc(AUDIO_BUF_SAMPLES * bytes_per_sample);
+    state->buf_samples = AUDIO_BUF_SAMPLES;
+
+    /* the clock lines the first samples up with itself, like after a flush */
+    clock_attach_audio(
+        state->clock, adev, ring,
+        (double) aspec.freq * bytes_per_sample,
+        (double) aspec.samples / aspec.freq
+    );
+    return true;
+}
+
+static void close_audio_output(struct ADecodeState * state) {
+    if (state->adev == 0) return;
+    clock_attach_audio(state->clock, 0, NULL, 0, 0);
+    SDL_CloseAudioDevice(state->adev);
+    destroy_audio_ring(state->ring);
+    swr_free(&state->swr_ctx);
+    free(state->buf);
+    state->adev = 0;
+}
+
+/* resamples every frame the decoder has ready and queues it for the device */
+static int receive_audio_frames(AVCodecContext * codec_ctx, void * userdata) {
+    struct ADecodeState * state = userdata;
+    AVFrame * frame = state->frame;
+    int ret;
+
+    while (!(ret = avcodec_receive_frame(codec_ctx, frame))) {
+        if ((state->adev == 0) && !state->failed)
+            state->failed = !open_audio_output(state, frame);
+        if (state->failed) {
+            av_frame_unref(frame);
+            continue;
+        }
+
+        int max_samples = swr_get_out_samples(state->swr_ctx, frame->nb_samples);
+        if (max_samples > state->buf_samples) {
+            while (state->buf_samples < max_samples) state->buf_samples *= 2;
+            state->buf = realloc(state->buf, state->buf_samples * state->bytes_per_sample);
+        }
+
+        int nb_samples = swr_convert(
+            state->swr_ctx,
+            &state->buf,
+            state->buf_samples,
+            (const uint8_t **) frame->extended_data,
+            frame->nb_samples
         );
-        if (swr_init(swr_ctx)) {
-            fprintf(stderr, "failed to create audio resampling context");
-            avcodec_free_context(&codec_ctx);
-        };
+
+        int64_t pts = frame->best_effort_timestamp;
+        if ((nb_samples > 0) && (pts != AV_NOPTS_VALUE))
+            queue_samples(state, state->buf, nb_samples, pts * av_q2d(state->time_base));
+
+        av_frame_unref(frame);
     }
+
+    if ((ret != AVERROR(EAGAIN)) && (ret != AVERROR_EOF))
+        state->error = ret;
+    return ret;
+}
+
+/* without an audio stream there's nothing to do but wait to quit */
+static int idle_adec(struct ADecodeInfo in) {
     while (!quit) {
-        struct Message msg = ch_receive(in.ch);
+        struct Message msg = ch_wait_receive(in.ch);
+        if (msg.type == MSG_QUIT) break;
+        if (msg.type == MSG_DECODE_FRAME) pool_put_packet(&msg.pkt);
+    }
+    return 0;
+}
+
+int thread_adec(void * data) {
+    struct ADecodeInfo in = *(struct ADecodeInfo *) data;
+    trace_thread_name("audio decoder");
+    AVCodecContext * codec_ctx = in.codec_ctx;
+
+    if (codec_ctx == NULL) return idle_adec(in);
+
+    struct ADecodeState state = {
+        .frame = pool_get_frame(),
+        .swr_ctx = NULL,
+        .adev = 0,
+        .failed = false,
+        .time_base = in.time_base,
+        .clock = in.clock,
+        .ring = NULL,
+        .ch = in.ch,
+        .error = 0,
+        .buf = NULL,
+        .buf_samples = 0
+    };
+    while (!quit) {
+        struct Message msg = ch_wait_receive(in.ch);
         switch (msg.type) {
+            case MSG_QUIT:
+                goto quit;
+
+            case MSG_FLUSH:
+                avcodec_flush_buffers(codec_ctx);
+                if (state.adev)
+                    clear_ring(&state);
+                else
+                    clock_audio_flushed(in.clock);
+                break;
+
             case MSG_DECODE_FRAME:
                 int ret;
-                if ((ret = decode_frame(codec_ctx, msg.pkt, frame))) {
-                    printf("Audio Decoding Error: %s\n", av_err2str(ret));
-                    break;
-                }
-                int len;
-                av_samples_get_buffer_size(
-                    &len, 
-                    aspec.channels, 
-                    frame->nb_samples,
-                    sample_fmt_sdl_to_av(aspec.format),
-                    1
-                );
-                uint8_t * audio_buf = malloc(len);
-                swr_convert(
-                    swr_ctx,
-                    &audio_buf,
-                    len,
-                    (const uint8_t **) frame->data,
-                    frame->nb_samples
-                );
-                SDL_QueueAudio(adev, audio_buf, len);
-                free(audio_buf);
+                struct TraceSpan span = trace_span_begin("decode audio");
+                state.error = 0;
+                ret = decode_packet(codec_ctx, msg.pkt, receive_audio_frames, &state);
+                trace_span_end(&span);
+                pool_put_packet(&msg.pkt);
+                if (ret || state.error)
+                    fprintf(stderr, "Audio Decoding Error: %s\n", av_err2str(ret ? ret : state.error));
                 break; 
         }
     }
+    quit:
+    close_audio_output(&state);
+    pool_put_frame(&state.frame);
     return 0;
 }
@@ -1,24 +1,52 @@
 #pragma once
 #include "../av.h"
 #include "ipc.h"
+#include "index.h"
+#include "convert.h"
+#include "playback.h"
+#include "clock.h"
+#include "quality.h"
 
 
 #define SDL_AUDIO_FMT AUDIO_S16SYS
 #define SDL_AUDIO_SAMPLES 1024
+#define AUDIO_RING_SECONDS 4 /* how far the audio decoder can get ahead of the device */
+#define AUDIO_BUF_SAMPLES 8192 /* initial resampler output size, grows if needed */
 
+/* the demuxer, decoders and converter only stop for MSG_QUIT, and answer
+ * it with one of their own as the last thing they send, so the manager
+ * can drain its side of their channels before it goes */
 struct ManageInfo {
     struct ChNode ch;
+    struct ChSelector * sel; /* empty, outlives the thread so nothing posts to freed memory */
+    SDL_Thread * const * converter; /* only read after MSG_QUIT, NULL if never started */
     struct ChNode ch_demux;
     struct ChNode ch_vdec;
     struct ChNode ch_adec;
-    AVFrame ** current_frame_ptr;
+    struct ChNode ch_conv;
+    struct ChNode * ch_gopdec; /* one per gop decoder, can be empty */
+    int ngopdec;
+    bool intra_only; /* gop decoders take one packet at a time */
+    AVFrame ** current_frame_ptr; /* always display-ready */
+    int * current_frame_seq; /* incremented whenever current frame changes */
     SDL_mutex * current_frame_mutex;
+    struct KeyframeIndex * index; /* can be NULL */
+    int cache_before, cache_after; /* decoded frames kept either side of the current one */
+    size_t lru_budget; /* bytes of frames kept for revisiting, see framelru.h,
+                        * and of frames gop decoding holds on to, see gop.h */
+    double frame_period; /* seconds per frame, a guess from the stream's frame rate */
+    AVRational time_base; /* of the video stream */
+    struct Clock * clock; /* to tell which frames are already too late to show */
+    atomic_int * quality; /* the video decoders' QUALITY_ level, see quality.h */
+    struct PlaybackStats * stats; /* also guarded by current_frame_mutex */
 };
 int thread_manage(void *);
 
 struct ADecodeInfo {
     struct ChNode ch;
-    AVCodecContext * codec_ctx;
+    AVCodecContext * codec_ctx; /* NULL if there's no audio */
+    AVRational time_base; /* of the audio stream */
+    struct Clock * clock;
 };
 int thread_adec(void *);
 
@@ -33,6 +61,24 @@ int thread_demux(void *);
 struct VDecodeInfo {
     struct ChNode ch;
     AVCodecContext * codec_ctx;
+    atomic_int * quality; /* set by the manager */
 };
 int thread_vdec(void *);
 
+/* decodes whole gops, see gop.h */
+struct GopDecodeInfo {
+    struct ChNode ch;
+    AVCodecContext * codec_ctx;
+    atomic_int * quality; /* set by the manager */
+};
+int thread_gopdec(void *);
+
+
+struct ConvertInfo {
+    struct ChNode ch;
+    struct FrameConverter * conv;
+};
+int thread_conv(void *);
+
+/* frees the packet, frame or gop msg carries, if any */
+void release_message(struct Message msg);
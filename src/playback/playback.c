@@ -1,70 +1,173 @@
 #include "playback.h"
 #include "parallel.h"
 #include "utils.h"
+#include "pool.h"
+#include "../trace.h"
 #include <libavformat/avformat.h>
 #include <time.h>
 
 extern bool quit;
 
-/* data used to convert frames to a common format
- * sws_context is not used for scaling, only format conversion.
- * any scaling is done using SDL on the gpu */
-struct VFrameConverter {
-    struct SwsContext * sws_context;
-    int linesize;
+#define DEFAULT_CACHE_FRAMES 32
+#define DEFAULT_FRAME_CACHE_BYTES ((size_t)512 << 20)
+
+/* how much avformat_find_stream_info may read, and how much of the
+ * stream it may look at, before it settles for what it has. by default
+ * it can read through seconds of a big transport stream or mxf looking
+ * for details only the first decoded frames would tell us anyway.
+ * formats with their streams all described in a header stop early by
+ * themselves, so these only matter where they're found by reading packets */
+static const struct {
+    const char * format; /* a prefix of AVInputFormat.name */
+    int64_t probesize; /* bytes */
+    int64_t analyzeduration; /* microseconds */
+} probe_limits[] = {
+    { "mov,",     1 << 20, 500000 },
+    { "matroska", 1 << 20, 500000 },
+    { "avi",      1 << 20, 500000 },
+    { "mxf",      2 << 20, 1000000 },
+    { "mpegts",   4 << 20, 1000000 },
+    { "mpeg",     4 << 20, 1000000 }, /* program streams */
 };
 
-static struct VFrameConverter make_frame_converter(
-    const AVCodecContext * const codec_ctx, const int format, const int linesize
-) {
-    return (struct VFrameConverter) {
-        sws_getContext(
-            codec_ctx->width, codec_ctx->height, codec_ctx->pix_fmt,
-            codec_ctx->width, codec_ctx->height, format,
-            SWS_POINT, NULL, NULL,
-            NULL
-        ),
-        linesize
-    };
+/* lets quitting cut a slow open short */
+static int interrupt_open(void * opaque) {
+    (void) opaque;
+    return quit;
 }
 
-static void destroy_frame_converter(struct VFrameConverter * frame_conv) {
-    sws_freeContext(frame_conv->sws_context);
+/* returns false if format_ctx's format isn't in probe_limits */
+static bool limit_probing(AVFormatContext * format_ctx) {
+    const char * name = format_ctx->iformat->name;
+    for (size_t i = 0; i < sizeof(probe_limits) / sizeof(probe_limits[0]); i++) {
+        if (strncmp(name, probe_limits[i].format, strlen(probe_limits[i].format))) continue;
+        format_ctx->probesize = probe_limits[i].probesize;
+        format_ctx->max_analyze_duration = probe_limits[i].analyzeduration;
+        return true;
+    }
+    return false;
 }
 
-static void convert_frame(
-    struct VFrameConverter * frame_conv, AVFrame * frame, uint8_t * pixels
-) {
-    //TODO: needs an array of linesizes to work with multi-plane images
-    sws_scale(
-        frame_conv->sws_context, 
-        (const uint8_t *const *) frame->data,
-        frame->linesize,
-        0,
-        frame->height,
-        &pixels, 
-        &frame_conv->linesize
-    );    
+/* a video stream, with what the decoders and the texture need to know */
+static bool video_params_known(AVFormatContext * format_ctx) {
+    int idx = av_find_best_stream(format_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    if (idx < 0) return false;
+    const AVCodecParameters * codecpar = format_ctx->streams[idx]->codecpar;
+    return (codecpar->format >= 0) && (codecpar->width > 0) && (codecpar->height > 0);
+}
+
+/* SDL texture format that can hold frames of pix_fmt as they are,
+ * or SDL_PIXELFORMAT_UNKNOWN */
+static uint32_t native_texture_format(enum AVPixelFormat pix_fmt) {
+    switch (pix_fmt) {
+        case AV_PIX_FMT_YUV420P:
+        case AV_PIX_FMT_YUVJ420P:
+            return SDL_PIXELFORMAT_IYUV;
+        case AV_PIX_FMT_NV12:
+            return SDL_PIXELFORMAT_NV12;
+        case AV_PIX_FMT_NV21:
+            return SDL_PIXELFORMAT_NV21;
+        default:
+            return SDL_PIXELFORMAT_UNKNOWN;
+    }
+}
+
+static bool renderer_supports_format(SDL_Renderer * renderer, uint32_t format) {
+    SDL_RendererInfo info;
+    if (SDL_GetRendererInfo(renderer, &info)) return false;
+    for (Uint32 i = 0; i < info.num_texture_formats; i++)
+        if (info.texture_formats[i] == format) return true;
+    return false;
+}
+
+/* tells SDL which matrix to use when the renderer converts yuv textures.
+ * it's a global setting, but there's only ever one video. SDL only has
+ * full range for bt.601, so returns false if it can't show the stream
+ * right and the frames have to be converted to rgb instead */
+static bool set_yuv_conversion_mode(const AVCodecContext * codec_ctx) {
+    bool full_range = (codec_ctx->color_range == AVCOL_RANGE_JPEG) ||
+        (codec_ctx->pix_fmt == AV_PIX_FMT_YUVJ420P);
+    enum AVColorSpace colorspace = codec_ctx->colorspace;
+
+    if (full_range) {
+        /* guessed the same way as make_yuv2rgb */
+        if (colorspace == AVCOL_SPC_UNSPECIFIED)
+            colorspace = codec_ctx->height >= 720 ? AVCOL_SPC_BT709 : AVCOL_SPC_SMPTE170M;
+        if ((colorspace != AVCOL_SPC_BT470BG) && (colorspace != AVCOL_SPC_SMPTE170M))
+            return false;
+        SDL_SetYUVConversionMode(SDL_YUV_CONVERSION_JPEG);
+    } else if (colorspace == AVCOL_SPC_BT709) {
+        SDL_SetYUVConversionMode(SDL_YUV_CONVERSION_BT709);
+    } else if (colorspace == AVCOL_SPC_UNSPECIFIED) {
+        SDL_SetYUVConversionMode(SDL_YUV_CONVERSION_AUTOMATIC);
+    } else if ((colorspace == AVCOL_SPC_BT2020_NCL) || (colorspace == AVCOL_SPC_BT2020_CL)) {
+        return false;
+    } else {
+        SDL_SetYUVConversionMode(SDL_YUV_CONVERSION_BT601);
+    }
+    return true;
 }
 
 struct InternalData {
     AVFormatContext * format_ctx;
     AVCodecContext * vcodec_ctx, * acodec_ctx;
     AVFrame * current_frame;
+    int current_frame_seq, shown_frame_seq;
     SDL_mutex * current_frame_mutex;
+    struct KeyframeIndex * index;
+    int64_t last_seek_ts;
     SDL_Thread * demuxer, * video_decoder, * audio_decoder, * manager;
+    SDL_Thread * converter; /* started by create_video_texture */
     int astream_idx, vstream_idx;
-    struct ChNode ch_demux, ch_vdec, ch_adec, ch_man;
-    struct VFrameConverter frame_conv;
+    struct ChNode ch_demux, ch_vdec, ch_adec, ch_man, ch_conv;
+    struct ChSelector * selector; /* the manager's, see ManageInfo */
+    int cache_frames;
+    size_t frame_cache_bytes;
+    struct PlaybackStats stats;
+    struct Clock * clock;
+    AVRational time_base; /* of the video stream */
+    double frame_period; /* seconds, 0 if unknown */
+    atomic_int decode_quality; /* see quality.h */
+    uint32_t tex_format;
+    struct FrameConverter * frame_conv;
+    struct ConvertInfo conv_info; /* outlives create_video_texture for the thread */
+
+    /* the other threads' arguments, which they copy whenever they get round to it */
+    struct ManageInfo manage_info;
+    struct DemuxInfo demux_info;
+    struct VDecodeInfo vdec_info;
+    struct ADecodeInfo adec_info;
+
+    /* gop-parallel decoding, see gop.h. ngopdec is 0 if it's off */
+    int ngopdec;
+    bool intra_only;
+    AVCodecContext ** gopdec_ctxs;
+    struct ChNode * ch_gopdec;
+    struct GopDecodeInfo * gopdec_info;
+    SDL_Thread ** gop_decoders;
+
+    struct BufferPool * buffer_pool; /* for the video decoders' frames */
+    struct FileIo * file_io; /* NULL if avformat reads the file itself */
+
+    double open_start; /* mono_now() when open_for_playback was called */
+    double open_time, first_frame_time; /* see PlaybackStats */
 };
 
-static AVCodecContext * open_codec_context(AVFormatContext * format_ctx, int stream_idx) {
+/* thread_count 0 lets ffmpeg pick one thread per core.
+ * frame buffers come from pool unless it's NULL */
+static AVCodecContext * open_codec_context(
+    AVFormatContext * format_ctx, int stream_idx, int thread_count, struct BufferPool * pool
+) {
     const AVCodecParameters * codecpar = format_ctx->streams[stream_idx]->codecpar;
     const AVCodec * codec = avcodec_find_decoder(codecpar->codec_id);
     if (codec == NULL) return NULL;
     AVCodecContext * codec_ctx = avcodec_alloc_context3(codec);
     if (avcodec_parameters_to_context(codec_ctx, codecpar))
         return NULL;
+    /* the decoder uses whichever of these the codec supports */
+    codec_ctx->thread_count = thread_count;
+    codec_ctx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+    if (pool) use_buffer_pool(codec_ctx, pool);
     if (avcodec_open2(codec_ctx, codec, NULL))
         return NULL;
     return codec_ctx;
@@ -73,74 +176,136 @@ static AVCodecContext * open_codec_context(AVFormatContext * format_ctx, int str
 static void begin_playback(struct PlaybackCtx * pb_ctx) {
     struct InternalData * id = pb_ctx->internal_data;
 
-    id->frame_conv = make_frame_converter(
-        id->vcodec_ctx, AV_PIX_FMT_RGB24, get_texture_pitch(SDL_PIXELFORMAT_RGB24, id->vcodec_ctx->width)
-    );
+    id->current_frame_mutex = SDL_CreateMutex();
 
     id->ch_man = create_channel();
     id->ch_demux = create_channel();
     id->ch_vdec = create_channel();
     id->ch_adec = create_channel();
+    id->ch_conv = create_channel();
+
+    id->ch_gopdec = malloc(id->ngopdec * sizeof(struct ChNode));
+    for (int i = 0; i < id->ngopdec; i++)
+        id->ch_gopdec[i] = create_channel();
+
+    id->selector = create_selector();
+    id->manage_info = (struct ManageInfo) {
+        .ch = ch_remote_node(id->ch_man),
+        .sel = id->selector,
+        .converter = &id->converter,
+        .ch_vdec = id->ch_vdec,
+        .ch_adec = id->ch_adec,
+        .ch_demux = id->ch_demux,
+        .ch_conv = id->ch_conv,
+        .ch_gopdec = id->ch_gopdec,
+        .ngopdec = id->ngopdec,
+        .intra_only = id->intra_only,
+        .current_frame_ptr = &id->current_frame,
+        .current_frame_seq = &id->current_frame_seq,
+        .current_frame_mutex = id->current_frame_mutex,
+        .index = id->index,
+        .cache_before = id->cache_frames,
+        .cache_after = id->cache_frames,
+        .lru_budget = id->frame_cache_bytes,
+        .frame_period = id->frame_period,
+        .time_base = id->time_base,
+        .clock = id->clock,
+        .quality = &id->decode_quality,
+        .stats = &id->stats
+    };
+    id->manager = SDL_CreateThread(thread_manage, "Manager", &id->manage_info);
 
+    id->demux_info = (struct DemuxInfo) {
+        .ch = ch_remote_node(id->ch_demux),
+        .format_ctx = id->format_ctx,
+        .vstream_idx = id->vstream_idx,
+        .astream_idx = id->astream_idx
+    };
+    id->demuxer = SDL_CreateThread(thread_demux, "Demuxer", &id->demux_info);
 
-    id->manager = SDL_CreateThread(
-        thread_manage, "Manager",
-        (void *) &(struct ManageInfo) {
-            .ch = ch_remote_node(id->ch_man),
-            .ch_vdec = id->ch_vdec,
-            .ch_adec = id->ch_adec,
-            .ch_demux = id->ch_demux,
-            .current_frame_ptr = &id->current_frame,
-            .current_frame_mutex = id->current_frame_mutex
-        }
-    );
-
-    id->demuxer = SDL_CreateThread(
-        thread_demux, "Demuxer", 
-        (void *) &(struct DemuxInfo) {
-            .ch = ch_remote_node(id->ch_demux),
-            .format_ctx = id->format_ctx,
-            .vstream_idx = id->vstream_idx,
-            .astream_idx = id->astream_idx
-        }
-    );
-
-    id->video_decoder = SDL_CreateThread(
-        thread_vdec, "Video Decoder", 
-        (void *) &(struct VDecodeInfo) {
-            .ch = ch_remote_node(id->ch_vdec),
-            .codec_ctx = id->vcodec_ctx,
-        }
-    );
-
-    id->audio_decoder = SDL_CreateThread(
-        thread_adec, "Audio Decoder", 
-        (void *) &(struct ADecodeInfo) {
-            .ch = ch_remote_node(id->ch_adec),
-            .codec_ctx = id->acodec_ctx,
-        }
-    );
-    extern int threads_initialized;
-    while (threads_initialized < 4);
+    id->vdec_info = (struct VDecodeInfo) {
+        .ch = ch_remote_node(id->ch_vdec),
+        .codec_ctx = id->vcodec_ctx,
+        .quality = &id->decode_quality
+    };
+    id->video_decoder = SDL_CreateThread(thread_vdec, "Video Decoder", &id->vdec_info);
+
+    id->adec_info = (struct ADecodeInfo) {
+        .ch = ch_remote_node(id->ch_adec),
+        .codec_ctx = id->acodec_ctx,
+        .time_base = id->astream_idx >= 0 ?
+            id->format_ctx->streams[id->astream_idx]->time_base : (AVRational) { 1, 1 },
+        .clock = id->clock
+    };
+    id->audio_decoder = SDL_CreateThread(thread_adec, "Audio Decoder", &id->adec_info);
+
+    id->gopdec_info = malloc(id->ngopdec * sizeof(struct GopDecodeInfo));
+    id->gop_decoders = malloc(id->ngopdec * sizeof(SDL_Thread *));
+    for (int i = 0; i < id->ngopdec; i++) {
+        id->gopdec_info[i] = (struct GopDecodeInfo) {
+            .ch = ch_remote_node(id->ch_gopdec[i]),
+            .codec_ctx = id->gopdec_ctxs[i],
+            .quality = &id->decode_quality
+        };
+        id->gop_decoders[i] = SDL_CreateThread(thread_gopdec, "GOP Decoder", &id->gopdec_info[i]);
+    }
 }
 
-struct PlaybackCtx * open_for_playback(char * filename) {
-    AVFormatContext * format_ctx = NULL;
+struct PlaybackCtx * open_for_playback(char * filename, const struct PlaybackOptions * opts) {
+    const struct PlaybackOptions default_opts = {0};
+    if (opts == NULL) opts = &default_opts;
+    double open_start = mono_now();
+
+    struct FileIo * file_io = open_file_io(filename, opts->io_mode, opts->readahead_bytes);
+    AVFormatContext * format_ctx = avformat_alloc_context();
+    if (file_io) {
+        format_ctx->pb = file_io->avio;
+        format_ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+    }
+    format_ctx->interrupt_callback = (AVIOInterruptCB) { interrupt_open, NULL };
     if (avformat_open_input(&format_ctx, filename, NULL, NULL)) {
         fprintf(stderr, "failed to open `%s`", filename);
+        close_file_io(file_io);
         return NULL;
     }
 
-    avformat_find_stream_info(format_ctx, NULL);
+    {
+        TRACE_SCOPE("find stream info");
+        int64_t probesize = format_ctx->probesize;
+        int64_t analyzeduration = format_ctx->max_analyze_duration;
+        bool limited = limit_probing(format_ctx);
+        avformat_find_stream_info(format_ctx, NULL);
+
+        /* e.g. a transport stream with its first sps past the limit.
+         * carry on with ffmpeg's own limits */
+        if (limited && !quit && !video_params_known(format_ctx)) {
+            format_ctx->probesize = probesize;
+            format_ctx->max_analyze_duration = analyzeduration;
+            avformat_find_stream_info(format_ctx, NULL);
+        }
+    }
+    if (quit) {
+        avformat_close_input(&format_ctx);
+        close_file_io(file_io);
+        return NULL;
+    }
 
     int vstream_idx = 
         av_find_best_stream(format_ctx, AVMEDIA_TYPE_VIDEO, -1,-1, NULL, 0);
 
-    int astream_idx =
+    int astream_idx = opts->no_audio ? -1 :
         av_find_best_stream(format_ctx, AVMEDIA_TYPE_AUDIO, -1,-1, NULL, 0);
 
     if (vstream_idx < 0) {
         fprintf(stderr, "failed to find video stream");
+        avformat_close_input(&format_ctx);
+        close_file_io(file_io);
+        return NULL;
+    }
+    if (!video_params_known(format_ctx)) {
+        fprintf(stderr, "couldn't find the video's size or pixel format\n");
+        avformat_close_input(&format_ctx);
+        close_file_io(file_io);
         return NULL;
     }
 
@@ -152,7 +317,7 @@ struct PlaybackCtx * open_for_playback(char * filename) {
         acodec_ctx = NULL;
     } else {
         astream = format_ctx->streams[astream_idx];
-        acodec_ctx = open_codec_context(format_ctx, astream_idx);
+        acodec_ctx = open_codec_context(format_ctx, astream_idx, 1, NULL);
         if (acodec_ctx == NULL) {
             fprintf(stderr, "unsupported audio codec");
             astream = NULL;
@@ -162,12 +327,19 @@ struct PlaybackCtx * open_for_playback(char * filename) {
 
     AVStream * vstream = format_ctx->streams[vstream_idx];
 
+    /* shared by every video decoder, so frames from any of them
+     * recycle buffers for all of them */
+    struct BufferPool * buffer_pool = create_buffer_pool();
     AVCodecContext * vcodec_ctx =
-        open_codec_context(format_ctx, vstream_idx);
+        open_codec_context(format_ctx, vstream_idx, opts->decode_threads, buffer_pool);
 
 
     if (vcodec_ctx == NULL) {
         fprintf(stderr, "unsupported video codec");
+        destroy_buffer_pool(buffer_pool);
+        avcodec_free_context(&acodec_ctx);
+        avformat_close_input(&format_ctx);
+        close_file_io(file_io);
         return NULL;
     }
 
@@ -185,67 +357,286 @@ struct PlaybackCtx * open_for_playback(char * filename) {
         .internal_data = malloc(sizeof(struct InternalData)),
     };
 
+    /* every packet of an intra-only codec decodes on its own, so they
+     * always go to a pool of decoders, one per core unless asked otherwise */
+    const AVCodecDescriptor * desc = avcodec_descriptor_get(vcodec_ctx->codec_id);
+    bool intra_only = desc && (desc->props & AV_CODEC_PROP_INTRA_ONLY);
+
+    int ngopdec = opts->gop_decoders;
+    if (intra_only)
+        ngopdec = opts->intra_decoders ? opts->intra_decoders : SDL_GetCPUCount();
+
+    /* each gets a whole gop to itself, so more threads inside one
+     * would only multiply memory */
+    AVCodecContext ** gopdec_ctxs = malloc(ngopdec * sizeof(AVCodecContext *));
+    for (int i = 0; i < ngopdec; i++) {
+        gopdec_ctxs[i] = open_codec_context(format_ctx, vstream_idx, 1, buffer_pool);
+        if (gopdec_ctxs[i] == NULL) {
+            fprintf(stderr, "failed to open gop decoder, decoding serially\n");
+            while (i--) avcodec_free_context(&gopdec_ctxs[i]);
+            ngopdec = 0;
+            break;
+        }
+    }
+
+    AVRational frame_rate = av_guess_frame_rate(format_ctx, vstream, NULL);
+
     *(struct InternalData *)ret->internal_data = (struct InternalData) {
         .format_ctx = format_ctx,
         .vcodec_ctx = vcodec_ctx,
         .acodec_ctx = acodec_ctx,
         .astream_idx = astream_idx,
-        .vstream_idx = vstream_idx
+        .vstream_idx = vstream_idx,
+        .index = open_keyframe_index(filename, format_ctx, vstream_idx),
+        .last_seek_ts = AV_NOPTS_VALUE,
+        .ngopdec = ngopdec,
+        .intra_only = intra_only,
+        .gopdec_ctxs = gopdec_ctxs,
+        .buffer_pool = buffer_pool,
+        .file_io = file_io,
+        .clock = create_clock(),
+        .time_base = vstream->time_base,
+        .frame_period = frame_rate.num > 0 ? av_q2d(av_inv_q(frame_rate)) : 0,
+        .cache_frames = opts->cache_frames ? opts->cache_frames : DEFAULT_CACHE_FRAMES,
+        .frame_cache_bytes =
+            opts->frame_cache_bytes ? opts->frame_cache_bytes : DEFAULT_FRAME_CACHE_BYTES,
+        .open_start = open_start
     };
     begin_playback(ret);
+    ((struct InternalData *) ret->internal_data)->open_time = mono_now() - open_start;
     return ret;
 }
 
 
 
-int get_frame(struct PlaybackCtx * pb_ctx, SDL_Texture * tex, int64_t * pts, int64_t * duration) {
+SDL_Texture * create_video_texture(struct PlaybackCtx * pb_ctx, SDL_Renderer * renderer) {
     struct InternalData * id = pb_ctx->internal_data;
 
-    if (id->current_frame == NULL) return 1;
-    
-    int pitch;
-    uint8_t * pixels;
+    const AVCodecContext * codec_ctx = id->vcodec_ctx;
+
+    /* the format decides what the converter does, so it can only
+     * start once there's a texture */
+    if (id->converter) {
+        fprintf(stderr, "video texture already created\n");
+        return NULL;
+    }
+
+    id->tex_format = native_texture_format(codec_ctx->pix_fmt);
+
+    bool native = (id->tex_format != SDL_PIXELFORMAT_UNKNOWN) &&
+        renderer_supports_format(renderer, id->tex_format) &&
+        set_yuv_conversion_mode(codec_ctx);
+
+    if (!native)
+        id->tex_format = yuv2rgb_supported(codec_ctx->pix_fmt) ?
+            SDL_PIXELFORMAT_ARGB8888 : SDL_PIXELFORMAT_RGB24;
+
+    id->frame_conv = create_frame_converter(codec_ctx, id->tex_format);
+    if (id->frame_conv == NULL) return NULL;
+
+    id->conv_info = (struct ConvertInfo) {
+        .ch = ch_remote_node(id->ch_conv),
+        .conv = id->frame_conv
+    };
+    id->converter = SDL_CreateThread(thread_conv, "Converter", &id->conv_info);
+
+    return SDL_CreateTexture(
+        renderer, id->tex_format, SDL_TEXTUREACCESS_STREAMING,
+        pb_ctx->width, pb_ctx->height
+    );
+}
+
+/* copies frame to tex. frame has already been through the converter,
+ * tex must have been made by create_video_texture */
+static void upload_frame(struct InternalData * id, AVFrame * frame, SDL_Texture * tex) {
+    TRACE_SCOPE("upload");
+    switch (id->tex_format) {
+        case SDL_PIXELFORMAT_IYUV:
+            SDL_UpdateYUVTexture(
+                tex, NULL,
+                frame->data[0], frame->linesize[0],
+                frame->data[1], frame->linesize[1],
+                frame->data[2], frame->linesize[2]
+            );
+            break;
+
+        case SDL_PIXELFORMAT_NV12:
+        case SDL_PIXELFORMAT_NV21:
+            SDL_UpdateNVTexture(
+                tex, NULL,
+                frame->data[0], frame->linesize[0],
+                frame->data[1], frame->linesize[1]
+            );
+            break;
+
+        default:
+            SDL_UpdateTexture(tex, NULL, frame->data[0], frame->linesize[0]);
+            break;
+    }
+}
+
+int get_frame(struct PlaybackCtx * pb_ctx, SDL_Texture * tex, int64_t * pts, int64_t * duration) {
+    struct InternalData * id = pb_ctx->internal_data;
+    int new_frame = 0;
 
-    SDL_LockTexture(tex, NULL, (void **) &pixels, &pitch); 
     SDL_LockMutex(id->current_frame_mutex);
 
-    *pts = id->current_frame->pts;
-    *duration = id->current_frame->duration;
+    if (id->current_frame == NULL) goto unlock;
 
-    convert_frame(&id->frame_conv, id->current_frame, pixels);
+    if (pts) *pts = id->current_frame->pts;
+    if (duration) *duration = id->current_frame->duration;
 
-    SDL_UnlockTexture(tex);
+    if (id->shown_frame_seq == id->current_frame_seq) goto unlock;
+    id->shown_frame_seq = id->current_frame_seq;
+    new_frame = 1;
+    if (id->first_frame_time == 0) id->first_frame_time = mono_now() - id->open_start;
 
+    if (tex) upload_frame(id, id->current_frame, tex);
+
+    unlock:
     SDL_UnlockMutex(id->current_frame_mutex);
 
-    return 0;
+    return new_frame;
 }
 
 void advance_frame(struct PlaybackCtx * pb_ctx) {
     struct InternalData * id = pb_ctx->internal_data;
 
+    id->last_seek_ts = AV_NOPTS_VALUE;
+
+    ch_send(
+        id->ch_man, 
+        (struct Message) { .type = MSG_ADVANCE_FRAME, .ts = AV_NOPTS_VALUE }
+    );
+}
+
+void advance_to(struct PlaybackCtx * pb_ctx, int64_t ts) {
+    struct InternalData * id = pb_ctx->internal_data;
+
+    id->last_seek_ts = AV_NOPTS_VALUE;
+
+    ch_send(
+        id->ch_man,
+        (struct Message) { .type = MSG_ADVANCE_FRAME, .ts = ts }
+    );
+}
+
+int64_t get_playback_time(struct PlaybackCtx * pb_ctx) {
+    struct InternalData * id = pb_ctx->internal_data;
+    return clock_get(id->clock) / av_q2d(id->time_base);
+}
+
+void set_playback_time(struct PlaybackCtx * pb_ctx, int64_t ts) {
+    struct InternalData * id = pb_ctx->internal_data;
+    clock_set(id->clock, ts * av_q2d(id->time_base));
+}
+
+void set_paused(struct PlaybackCtx * pb_ctx, bool paused) {
+    struct InternalData * id = pb_ctx->internal_data;
+    clock_set_paused(id->clock, paused);
+    if (paused) ch_send(id->ch_man, (struct Message) { .type = MSG_PAUSED });
+}
+
+void set_direction(struct PlaybackCtx * pb_ctx, int direction) {
+    struct InternalData * id = pb_ctx->internal_data;
+    clock_set_direction(id->clock, direction);
+}
+
+void step_back(struct PlaybackCtx * pb_ctx) {
+    struct InternalData * id = pb_ctx->internal_data;
+
+    id->last_seek_ts = AV_NOPTS_VALUE;
+
     ch_send(
         id->ch_man, 
-        (struct Message) { .type = MSG_ADVANCE_FRAME }
+        (struct Message) { .type = MSG_STEP_BACK }
+    );
+}
+
+void seek(struct PlaybackCtx * pb_ctx, int64_t ts) {
+    struct InternalData * id = pb_ctx->internal_data;
+
+    /* dragging the progress bar asks for the same spot every ui frame */
+    if (ts == id->last_seek_ts) return;
+    id->last_seek_ts = ts;
+
+    clock_set(id->clock, ts * av_q2d(id->time_base));
+
+    ch_send(
+        id->ch_man,
+        (struct Message) { .type = MSG_SEEK, .ts = ts }
     );
 }
 
-void seek(struct PlaybackCtx * pb_ctx, int ts) {
-    //struct InternalData * id = pb_ctx->internal_data;
+void get_playback_stats(struct PlaybackCtx * pb_ctx, struct PlaybackStats * stats) {
+    struct InternalData * id = pb_ctx->internal_data;
+
+    SDL_LockMutex(id->current_frame_mutex);
+    *stats = id->stats;
+    stats->first_frame_time = id->first_frame_time;
+    SDL_UnlockMutex(id->current_frame_mutex);
+    stats->open_time = id->open_time;
+
+    SDL_LockMutex(id->clock->mutex);
+    stats->av_drift = id->clock->drift;
+    stats->max_av_drift = id->clock->max_drift;
+    stats->clock_corrections = id->clock->corrections;
+    stats->audio_underruns = id->clock->ring ? atomic_load(&id->clock->ring->underruns) : 0;
+    SDL_UnlockMutex(id->clock->mutex);
+
+    stats->io_mode = id->file_io ? id->file_io->mode : FILE_IO_FFMPEG;
+    file_io_stats(id->file_io, &stats->io);
+}
+
+static void destroy_drained_channel(struct ChNode ch) {
+    struct Message msg;
+    while ((msg = ch_receive(ch)).type != MSG_NONE) release_message(msg);
+    while ((msg = ch_receive(ch_remote_node(ch))).type != MSG_NONE) release_message(msg);
+    destroy_channel(ch);
 }
 
 void destroy_playback_ctx(struct PlaybackCtx * pb_ctx) {
     struct InternalData * id = pb_ctx->internal_data;
+
+    /* the manager passes this on to the other threads */
+    ch_send(id->ch_man, (struct Message) { .type = MSG_QUIT });
+
     SDL_WaitThread(id->manager, NULL);
     SDL_WaitThread(id->video_decoder, NULL);
+    SDL_WaitThread(id->audio_decoder, NULL);
     SDL_WaitThread(id->demuxer, NULL);
+    if (id->converter) SDL_WaitThread(id->converter, NULL);
+    for (int i = 0; i < id->ngopdec; i++)
+        SDL_WaitThread(id->gop_decoders[i], NULL);
+
+    destroy_selector(id->selector);
+    destroy_frame_converter(id->frame_conv);
+
+    /* with every thread gone, anything still queued is only leftovers,
+     * e.g. frames for a converter that never started */
+    destroy_drained_channel(id->ch_man);
+    destroy_drained_channel(id->ch_demux);
+    destroy_drained_channel(id->ch_vdec);
+    destroy_drained_channel(id->ch_adec);
+    destroy_drained_channel(id->ch_conv);
+    for (int i = 0; i < id->ngopdec; i++) {
+        destroy_drained_channel(id->ch_gopdec[i]);
+        avcodec_free_context(&id->gopdec_ctxs[i]);
+    }
+    free(id->ch_gopdec);
+    free(id->gopdec_info);
+    free(id->gop_decoders);
+    free(id->gopdec_ctxs);
 
-    destroy_frame_converter(&id->frame_conv);
-
-    destroy_channel(id->ch_demux);
-    destroy_channel(id->ch_vdec);
+    destroy_keyframe_index(id->index);
+    destroy_clock(id->clock);
+    pool_put_frame(&id->current_frame);
+    SDL_DestroyMutex(id->current_frame_mutex);
 
     avformat_close_input(&id->format_ctx);
+    close_file_io(id->file_io);
     avcodec_free_context(&id->vcodec_ctx);
+    destroy_buffer_pool(id->buffer_pool);
+    pool_trim();
     
 }
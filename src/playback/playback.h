@@ -1,8 +1,44 @@
 #pragma once
 #include "../av.h"
+#include "fileio.h"
 
 struct InternalData;
 
+/* zero is the default for everything */
+struct PlaybackOptions {
+    int decode_threads; /* video decoder threads, 0 for one per core */
+    int gop_decoders; /* decode this many gops in parallel, 0 for off */
+    int intra_decoders; /* parallel decoders for intra-only codecs, 0 for one per core */
+    int cache_frames; /* decoded frames kept either side of the current one */
+    size_t frame_cache_bytes; /* memory for frames kept around for revisiting */
+    bool no_audio; /* leave the audio out entirely */
+    enum FileIoMode io_mode; /* how the demuxer reads the file, see fileio.h */
+    size_t readahead_bytes; /* how far ahead it reads, 0 for the default */
+};
+
+/* counted since open_for_playback */
+struct PlaybackStats {
+    int seek_hits; /* seeks answered from frames already decoded */
+    int seek_misses; /* seeks that had to decode */
+    int cached_frames;
+    size_t cached_bytes;
+    double av_drift; /* seconds the audio was ahead of the clock at the last check */
+    double max_av_drift;
+    int clock_corrections; /* times the clock jumped to the audio */
+    int audio_underruns; /* times the audio device ran out of samples while playing */
+    int prefetch_frames, prefetch_packets; /* how far ahead the decoders are kept */
+    double decode_time, decode_jitter; /* seconds per frame, and its deviation */
+    int dropped_frames; /* decoded too late to be shown while playing */
+    int skipped_frames; /* left out by the decoders to catch up */
+    int decode_quality; /* current QUALITY_ level, see quality.h */
+    bool ended; /* the frame being shown is the last one in the stream */
+    enum FileIoMode io_mode; /* what was used, FILE_IO_FFMPEG for anything but a local file */
+    struct FileIoStats io; /* the demuxer's reads. all 0 with FILE_IO_FFMPEG */
+    double open_time; /* seconds open_for_playback took */
+    double first_frame_time; /* seconds from open_for_playback being called until
+                              * get_frame first had a frame, 0 until then */
+};
+
 struct PlaybackCtx {
     AVRational time_base;
     int start_time, duration;
@@ -10,17 +46,50 @@ struct PlaybackCtx {
     struct InternalData * internal_data;
 };
 
-void seek(struct PlaybackCtx * pb_ctx, int ts);
+/* seeks to the frame being shown at ts (in video stream units), and
+ * sets the clock to ts. get_frame reports it as new once it has been decoded */
+void seek(struct PlaybackCtx * pb_ctx, int64_t ts);
 
+/* the playback clock, in video stream units. it follows the audio
+ * while that's playing forward, and the system clock otherwise.
+ * playback starts paused */
+int64_t get_playback_time(struct PlaybackCtx * pb_ctx);
+/* moves the clock without seeking, e.g. onto a frame that was stepped to */
+void set_playback_time(struct PlaybackCtx * pb_ctx, int64_t ts);
+void set_paused(struct PlaybackCtx * pb_ctx, bool paused);
+/* 1 plays forward, -1 backward (without sound) */
+void set_direction(struct PlaybackCtx * pb_ctx, int direction);
+
+/* show the next/previous frame. frames around the current one are kept
+ * decoded, so these are usually immediate. if the frame isn't ready yet,
+ * nothing happens and get_frame keeps reporting the current one */
 void advance_frame(struct PlaybackCtx * pb_ctx);
+void step_back(struct PlaybackCtx * pb_ctx);
+
+/* like advance_frame, for playing: if decoding has fallen behind, cached
+ * frames whose time (in video stream units) is already up at ts are
+ * passed over, and counted as dropped */
+void advance_to(struct PlaybackCtx * pb_ctx, int64_t ts);
+
+/* creates a streaming texture for get_frame to draw into. its format matches
+ * the decoder's output when the renderer can take it (planar/semi-planar yuv),
+ * so frames are uploaded as they are and the renderer converts the colours.
+ * otherwise frames are converted to ARGB8888 or RGB24 on a separate thread
+ * before they're shown. frames only start showing once this is called,
+ * and it can only be called once */
+SDL_Texture * create_video_texture(struct PlaybackCtx * pb_ctx, SDL_Renderer * renderer);
 
 /* Returns 1 if this frame is new, 0 if the frame is unchanged since the last call.
- * Either way, stores pointer to current frame in tex, frame's presentation timestamp
+ * If it's new, draws it to tex, which must come from create_video_texture. Either way, stores the frame's presentation timestamp
  * in pts and duration in duration, both in video stream units.
+ * pts and duration are left alone if no frame has been decoded yet.
  * tex, pts, and duration can be NULL */
 int get_frame(struct PlaybackCtx * pb_ctx, SDL_Texture * tex, int64_t * pts, int64_t * duration);
 
-struct PlaybackCtx * open_for_playback(char * filename);
+void get_playback_stats(struct PlaybackCtx * pb_ctx, struct PlaybackStats * stats);
+
+/* opts can be NULL */
+struct PlaybackCtx * open_for_playback(char * filename, const struct PlaybackOptions * opts);
 
 void destroy_playback_ctx(struct PlaybackCtx * pb_ctx);
 
@@ -0,0 +1,180 @@
+#include "pool.h"
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+#include <stdatomic.h>
+
+#define POOL_MAX_SHELLS 256 /* more than that and they're just freed */
+#define MIN_BUFFER_CLASS 4096
+
+static atomic_long allocations = 0;
+
+static struct {
+    SDL_SpinLock lock;
+    AVPacket * pkts[POOL_MAX_SHELLS];
+    int npkts;
+    AVFrame * frames[POOL_MAX_SHELLS];
+    int nframes;
+} shells;
+
+AVPacket * pool_get_packet(void) {
+    AVPacket * pkt = NULL;
+    SDL_AtomicLock(&shells.lock);
+    if (shells.npkts) pkt = shells.pkts[--shells.npkts];
+    SDL_AtomicUnlock(&shells.lock);
+    if (pkt) return pkt;
+
+    atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    return av_packet_alloc();
+}
+
+void pool_put_packet(AVPacket ** pkt) {
+    if (*pkt == NULL) return;
+    av_packet_unref(*pkt);
+
+    SDL_AtomicLock(&shells.lock);
+    if (shells.npkts < POOL_MAX_SHELLS) {
+        shells.pkts[shells.npkts++] = *pkt;
+        *pkt = NULL;
+    }
+    SDL_AtomicUnlock(&shells.lock);
+    av_packet_free(pkt);
+}
+
+AVFrame * pool_get_frame(void) {
+    AVFrame * frame = NULL;
+    SDL_AtomicLock(&shells.lock);
+    if (shells.nframes) frame = shells.frames[--shells.nframes];
+    SDL_AtomicUnlock(&shells.lock);
+    if (frame) return frame;
+
+    atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    return av_frame_alloc();
+}
+
+void pool_put_frame(AVFrame ** frame) {
+    if (*frame == NULL) return;
+    av_frame_unref(*frame);
+
+    SDL_AtomicLock(&shells.lock);
+    if (shells.nframes < POOL_MAX_SHELLS) {
+        shells.frames[shells.nframes++] = *frame;
+        *frame = NULL;
+    }
+    SDL_AtomicUnlock(&shells.lock);
+    av_frame_free(frame);
+}
+
+AVFrame * pool_clone_frame(const AVFrame * src) {
+    AVFrame * frame = pool_get_frame();
+    if (frame && av_frame_ref(frame, src)) pool_put_frame(&frame);
+    return frame;
+}
+
+void pool_trim(void) {
+    SDL_AtomicLock(&shells.lock);
+    while (shells.npkts) av_packet_free(&shells.pkts[--shells.npkts]);
+    while (shells.nframes) av_frame_free(&shells.frames[--shells.nframes]);
+    SDL_AtomicUnlock(&shells.lock);
+}
+
+long pool_allocations(void) {
+    return atomic_load_explicit(&allocations, memory_order_relaxed);
+}
+
+/* what the buffer pools call when they're empty */
+static AVBufferRef * alloc_buffer(size_t size) {
+    atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    return av_buffer_alloc(size);
+}
+
+struct BufferPool * create_buffer_pool(void) {
+    struct BufferPool * pool = malloc(sizeof(struct BufferPool));
+    *pool = (struct BufferPool) { .mutex = SDL_CreateMutex() };
+    return pool;
+}
+
+void destroy_buffer_pool(struct BufferPool * pool) {
+    if (pool == NULL) return;
+    for (int i = 0; i < BUFFER_CLASSES; i++)
+        av_buffer_pool_uninit(&pool->classes[i]);
+    SDL_DestroyMutex(pool->mutex);
+    free(pool);
+}
+
+/* rounds size up to its class. there are 4 classes per power of two,
+ * so the first is MIN_BUFFER_CLASS, then 1.25, 1.5, 1.75, 2 times it... */
+static int size_class(size_t * size) {
+    size_t octave = MIN_BUFFER_CLASS;
+    int log = 0;
+    while (octave * 2 <= *size) {
+        octave *= 2;
+        log++;
+    }
+    size_t step = octave / 4;
+    *size = (*size + step - 1) / step * step;
+    if (*size < MIN_BUFFER_CLASS) *size = MIN_BUFFER_CLASS;
+    return log * 4 + *size / step - 4;
+}
+
+AVBufferRef * buffer_pool_get(struct BufferPool * pool, size_t size) {
+    int class = size_class(&size);
+    if (class >= BUFFER_CLASSES) return alloc_buffer(size);
+
+    SDL_LockMutex(pool->mutex);
+    if (pool->classes[class] == NULL)
+        pool->classes[class] = av_buffer_pool_init(size, alloc_buffer);
+    AVBufferPool * buffers = pool->classes[class];
+    SDL_UnlockMutex(pool->mutex);
+
+    return buffers ? av_buffer_pool_get(buffers) : NULL;
+}
+
+/* lays frame out the same way avcodec_default_get_buffer2 does,
+ * but every plane comes from the shared pool. called from the
+ * decoder's own threads */
+static int pooled_get_buffer2(AVCodecContext * codec_ctx, AVFrame * frame, int flags) {
+    struct BufferPool * pool = codec_ctx->opaque;
+    const AVPixFmtDescriptor * desc = av_pix_fmt_desc_get(frame->format);
+    if ((codec_ctx->codec_type != AVMEDIA_TYPE_VIDEO) ||
+        (desc == NULL) || (desc->flags & AV_PIX_FMT_FLAG_HWACCEL))
+        return avcodec_default_get_buffer2(codec_ctx, frame, flags);
+
+    int w = frame->width, h = frame->height;
+    int align[AV_NUM_DATA_POINTERS];
+    avcodec_align_dimensions2(codec_ctx, &w, &h, align);
+
+    /* widen until every plane's rows come out aligned */
+    int linesize[4], unaligned;
+    do {
+        if (av_image_fill_linesizes(linesize, frame->format, w) < 0)
+            return avcodec_default_get_buffer2(codec_ctx, frame, flags);
+        w += w & ~(w - 1);
+        unaligned = 0;
+        for (int i = 0; i < 4; i++)
+            unaligned |= linesize[i] % align[i];
+    } while (unaligned);
+
+    size_t sizes[4];
+    ptrdiff_t linesizes[4] = { linesize[0], linesize[1], linesize[2], linesize[3] };
+    if (av_image_fill_plane_sizes(sizes, frame->format, h, linesizes) < 0)
+        return avcodec_default_get_buffer2(codec_ctx, frame, flags);
+
+    for (int i = 0; (i < 4) && sizes[i]; i++) {
+        /* decoders may read a little past the end */
+        frame->buf[i] = buffer_pool_get(pool, sizes[i] + 16 + align[i] - 1);
+        if (frame->buf[i] == NULL) {
+            av_frame_unref(frame);
+            return AVERROR(ENOMEM);
+        }
+        frame->data[i] = frame->buf[i]->data;
+        frame->linesize[i] = linesize[i];
+    }
+    frame->extended_data = frame->data;
+    return 0;
+}
+
+void use_buffer_pool(AVCodecContext * codec_ctx, struct BufferPool * pool) {
+    if (!(codec_ctx->codec->capabilities & AV_CODEC_CAP_DR1)) return;
+    codec_ctx->opaque = pool;
+    codec_ctx->get_buffer2 = pooled_get_buffer2;
+}
@@ -0,0 +1,43 @@
+#pragma once
+#include "../av.h"
+
+/* packets and frames go round the pipeline endlessly, so rather than
+ * freeing them, whichever thread is done with one puts it back here for
+ * the demuxer and decoders to take again. the AVPacket/AVFrame structs are
+ * kept process-wide and are safe to get and put from any thread.
+ * anything from here can still be freed normally, and vice versa */
+AVPacket * pool_get_packet(void);
+void pool_put_packet(AVPacket ** pkt);
+
+AVFrame * pool_get_frame(void);
+void pool_put_frame(AVFrame ** frame);
+/* a new reference to src, or NULL */
+AVFrame * pool_clone_frame(const AVFrame * src);
+
+/* frees whatever is waiting to be reused */
+void pool_trim(void);
+
+/* how many packets, frames and frame buffers have had to be allocated
+ * because there wasn't one to reuse, since the program started */
+long pool_allocations(void);
+
+/* frame buffers, in size classes a quarter of a power of two apart so
+ * buffers of nearly the same size get shared, and any one wastes at most
+ * a fifth. buffers go back to their class when their last reference goes */
+#define BUFFER_CLASSES 100
+
+struct BufferPool {
+    SDL_mutex * mutex; /* only for creating classes */
+    AVBufferPool * classes[BUFFER_CLASSES];
+};
+
+struct BufferPool * create_buffer_pool(void);
+/* buffers still in use stay valid */
+void destroy_buffer_pool(struct BufferPool * pool);
+
+/* at least size bytes, or NULL */
+AVBufferRef * buffer_pool_get(struct BufferPool * pool, size_t size);
+
+/* makes codec_ctx take its frame buffers from pool, if the codec lets
+ * it. call before avcodec_open2, and keep pool until codec_ctx is freed */
+void use_buffer_pool(AVCodecContext * codec_ctx, struct BufferPool * pool);
@@ -0,0 +1,114 @@
+#include "prefetch.h"
+#include "utils.h"
+
+#define SPIKE_DEVS 4 /* how many deviations of jitter to ride out */
+#define INITIAL_PREFETCH 3 /* until anything has been measured */
+
+void prefetch_init(struct Prefetch * p, double frame_period, int max_frames) {
+    *p = (struct Prefetch) {
+        .decode_avg = 0,
+        .decode_dev = 0,
+        .demux_avg = 0,
+        .demux_dev = 0,
+        .ndecoded = 0,
+        .ndemuxed = 0,
+        .busy_since = NAN,
+        .last_frame = NAN,
+        .nrequested = 0,
+        .first_request = 0,
+        .last_packet = NAN,
+        .frame_period = frame_period > 0 ? frame_period : 1 / 25.0,
+        .frame_bytes = 0,
+        .max_frames = MAX(max_frames, MIN_PREFETCH_FRAMES),
+        .frames = INITIAL_PREFETCH,
+        .packets = INITIAL_PREFETCH
+    };
+}
+
+static void add_sample(double * avg, double * dev, double sample, bool first) {
+    if (first) {
+        *avg = sample;
+        *dev = sample / 2;
+    } else {
+        *dev += (fabs(sample - *avg) - *dev) / 4;
+        *avg += (sample - *avg) / 8;
+    }
+}
+
+/* frames the playhead would go through while waiting out a slow one */
+static int frames_to_cover(const struct Prefetch * p, double avg, double dev) {
+    return ceil((avg + SPIKE_DEVS * dev) / p->frame_period);
+}
+
+static void update_depth(struct Prefetch * p) {
+    int max_frames = p->max_frames;
+    if (p->frame_bytes) {
+        int fit = PREFETCH_BUDGET / p->frame_bytes;
+        max_frames = MIN(max_frames, fit);
+    }
+    max_frames = MAX(max_frames, MIN_PREFETCH_FRAMES);
+
+    int frames = MIN_PREFETCH_FRAMES + frames_to_cover(p, p->decode_avg, p->decode_dev);
+    p->frames = MIN(frames, max_frames);
+
+    /* the decoders can't start on a frame before its packet is in */
+    int packets = p->frames + frames_to_cover(p, p->demux_avg, p->demux_dev);
+    p->packets = MIN(packets, MAX_PREFETCH_PACKETS);
+}
+
+void prefetch_set_busy(struct Prefetch * p, bool busy) {
+    if (!busy)
+        p->busy_since = NAN;
+    else if (isnan(p->busy_since))
+        p->busy_since = mono_now();
+}
+
+static size_t frame_bytes(const AVFrame * frame) {
+    size_t bytes = 0;
+    for (int i = 0; i < AV_NUM_DATA_POINTERS; i++)
+        if (frame->buf[i]) bytes += frame->buf[i]->size;
+    return bytes;
+}
+
+void prefetch_frame_decoded(struct Prefetch * p, const AVFrame * frame) {
+    double now = mono_now();
+    p->frame_bytes = MAX(p->frame_bytes, frame_bytes(frame));
+
+    /* frames that turn up while idle were finished before,
+     * and say nothing about how long they took */
+    double since = p->busy_since;
+    double last = p->last_frame;
+    p->last_frame = now;
+    if (isnan(since)) return;
+    if (!isnan(last) && (last > since)) since = last;
+
+    add_sample(&p->decode_avg, &p->decode_dev, now - since, !p->ndecoded++);
+    update_depth(p);
+}
+
+void prefetch_restart(struct Prefetch * p) {
+    p->last_frame = NAN;
+    p->busy_since = NAN;
+}
+
+void prefetch_packet_requested(struct Prefetch * p) {
+    if (p->nrequested == MAX_PREFETCH_PACKETS) return;
+    int idx = (p->first_request + p->nrequested++) % MAX_PREFETCH_PACKETS;
+    p->requested[idx] = mono_now();
+}
+
+void prefetch_packet_demuxed(struct Prefetch * p) {
+    if (!p->nrequested) return;
+    double now = mono_now();
+
+    /* requests are answered in order, so time each one from when
+     * the demuxer could start on it */
+    double since = p->requested[p->first_request];
+    if (!isnan(p->last_packet) && (p->last_packet > since)) since = p->last_packet;
+    p->first_request = (p->first_request + 1) % MAX_PREFETCH_PACKETS;
+    p->nrequested--;
+    p->last_packet = now;
+
+    add_sample(&p->demux_avg, &p->demux_dev, now - since, !p->ndemuxed++);
+    update_depth(p);
+}
@@ -0,0 +1,47 @@
+#pragma once
+#include "../av.h"
+
+#define MIN_PREFETCH_FRAMES 2
+#define MAX_PREFETCH_PACKETS 64
+#define PREFETCH_BUDGET ((size_t) 256 << 20) /* bytes of decoded frames ahead */
+
+/* how far ahead of the playhead the manager decodes and demuxes.
+ * it times how long each frame takes to come out of the decoders and
+ * each packet out of the demuxer, and keeps enough in hand to cover a
+ * spike well beyond the usual jitter: cheap streams hold a couple of
+ * frames, heavy ones get room to catch up. the averages are smoothed
+ * like tcp's round trip time estimate */
+struct Prefetch {
+    double decode_avg, decode_dev; /* seconds per frame */
+    double demux_avg, demux_dev; /* seconds per packet */
+    int ndecoded, ndemuxed; /* samples so far */
+
+    /* frames are timed from whichever came later: the decoders being
+     * given work, or the previous frame coming out. NAN when idle */
+    double busy_since, last_frame;
+
+    /* when the outstanding packet requests were sent, oldest first */
+    double requested[MAX_PREFETCH_PACKETS];
+    int nrequested, first_request;
+    double last_packet;
+
+    double frame_period; /* seconds */
+    size_t frame_bytes; /* of the biggest decoded frame seen */
+    int max_frames;
+
+    int frames, packets; /* the depth to keep */
+};
+
+/* max_frames is as many as there's room for past the playhead */
+void prefetch_init(struct Prefetch * p, double frame_period, int max_frames);
+
+/* whether the decoders have something to do */
+void prefetch_set_busy(struct Prefetch * p, bool busy);
+/* a frame came out of the decoders. the one before it is
+ * forgotten when the pipeline restarts */
+void prefetch_frame_decoded(struct Prefetch * p, const AVFrame * frame);
+void prefetch_restart(struct Prefetch * p);
+
+/* a packet was asked for, and the oldest request was answered */
+void prefetch_packet_requested(struct Prefetch * p);
+void prefetch_packet_demuxed(struct Prefetch * p);
@@ -0,0 +1,65 @@
+#include "quality.h"
+#include "utils.h"
+
+#define ESCALATE_LATE 4 /* late frames before dropping a level */
+#define ESCALATE_INTERVAL 0.5 /* seconds at a level before dropping another */
+#define RECOVER_TIME 3.0 /* seconds without a late frame before going back up */
+
+void quality_init(struct DecodeQuality * q, atomic_int * level) {
+    *q = (struct DecodeQuality) {
+        .level = level,
+        .late = 0,
+        .changed = mono_now(),
+        .last_late = -INFINITY
+    };
+    atomic_store(q->level, QUALITY_FULL);
+}
+
+static void set_level(struct DecodeQuality * q, int level, double now) {
+    atomic_store(q->level, level);
+    q->late = 0;
+    q->changed = now;
+}
+
+void quality_frame(struct DecodeQuality * q, bool late) {
+    double now = mono_now();
+    int level = atomic_load(q->level);
+
+    if (late) {
+        /* a few stragglers now and then don't count */
+        if (now - q->last_late > ESCALATE_INTERVAL) q->late = 0;
+        q->late++;
+        q->last_late = now;
+
+        if ((q->late >= ESCALATE_LATE) && (level < QUALITY_SKIP_NONREF) &&
+            (now - q->changed >= ESCALATE_INTERVAL))
+            set_level(q, level + 1, now);
+    } else if ((level > QUALITY_FULL) &&
+        (now - q->last_late >= RECOVER_TIME) && (now - q->changed >= RECOVER_TIME)) {
+        set_level(q, level - 1, now);
+    }
+}
+
+void quality_reset(struct DecodeQuality * q) {
+    if (atomic_load(q->level) != QUALITY_FULL)
+        set_level(q, QUALITY_FULL, mono_now());
+    q->last_late = -INFINITY;
+}
+
+void apply_decode_quality(AVCodecContext * codec_ctx, int level, int * applied) {
+    if (level == *applied) return;
+    *applied = level;
+
+    codec_ctx->skip_loop_filter =
+        level >= QUALITY_NO_LOOP_FILTER ? AVDISCARD_ALL : AVDISCARD_DEFAULT;
+    codec_ctx->skip_frame =
+        level >= QUALITY_SKIP_NONREF ? AVDISCARD_NONREF : AVDISCARD_DEFAULT;
+}
+
+void mark_decode_quality(AVFrame * frame, int level) {
+    frame->opaque = (void *) (intptr_t) level;
+}
+
+bool frame_degraded(const AVFrame * frame) {
+    return (intptr_t) frame->opaque > QUALITY_FULL;
+}
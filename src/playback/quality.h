@@ -0,0 +1,42 @@
+#pragma once
+#include "../av.h"
+#include <stdatomic.h>
+
+/* how much picture quality the video decoders give up to keep up with
+ * playback. each level adds to the one before:
+ * 1 skips the loop filter, 2 skips frames nothing else refers to.
+ * there's no lowres level: decoders only read lowres when they're
+ * opened, and it changes the frame size besides */
+enum {
+    QUALITY_FULL,
+    QUALITY_NO_LOOP_FILTER,
+    QUALITY_SKIP_NONREF,
+};
+
+/* the manager's side: watches how many frames come out of the
+ * decoders too late to be shown, steps the level down while that
+ * keeps happening and back up once decoding has caught up */
+struct DecodeQuality {
+    atomic_int * level; /* read by the decoder threads */
+    int late; /* late frames since the level last changed */
+    double changed, last_late; /* when, CLOCK_MONOTONIC seconds */
+};
+
+void quality_init(struct DecodeQuality * q, atomic_int * level);
+
+/* a frame came out of the decoders while playing, on time or not */
+void quality_frame(struct DecodeQuality * q, bool late);
+
+/* back to full quality, e.g. when playback stops so stepping
+ * through frames shows every one of them */
+void quality_reset(struct DecodeQuality * q);
+
+/* the decoder threads' side: brings codec_ctx to level if it isn't
+ * already. *applied is the thread's record of codec_ctx's level.
+ * call between packets, on the thread that decodes them */
+void apply_decode_quality(AVCodecContext * codec_ctx, int level, int * applied);
+
+/* frames decoded below QUALITY_FULL are marked through AVFrame.opaque,
+ * which survives conversion, so they aren't kept for showing again */
+void mark_decode_quality(AVFrame * frame, int level);
+bool frame_degraded(const AVFrame * frame);
@@ -0,0 +1,308 @@
+#include "thumbnails.h"
+#include "../trace.h"
+#include <limits.h>
+
+#define ATLAS_SIZE 1024
+#define THUMBS_INITIAL_SIZE 256
+
+static struct ThumbnailStrip * create_strip(const char * filename, int height, double spacing) {
+    struct ThumbnailStrip * strip = malloc(sizeof(struct ThumbnailStrip));
+    *strip = (struct ThumbnailStrip) {
+        .thumbs = malloc(THUMBS_INITIAL_SIZE * sizeof(struct Thumbnail)),
+        .count = 0,
+        .allocated = THUMBS_INITIAL_SIZE,
+        .pending = 0,
+        .width = 0,
+        .height = height,
+        .spacing = spacing,
+        .mutex = SDL_CreateMutex(),
+        .builder = NULL,
+        .pages = NULL,
+        .npages = 0,
+        .nslots = 0,
+        .filename = strdup(filename)
+    };
+    atomic_init(&strip->cancel, false);
+    return strip;
+}
+
+void destroy_thumbnail_strip(struct ThumbnailStrip * strip) {
+    if (strip == NULL) return;
+
+    if (strip->builder) {
+        atomic_store(&strip->cancel, true);
+        SDL_WaitThread(strip->builder, NULL);
+    }
+
+    for (int i = 0; i < strip->count; i++)
+        free(strip->thumbs[i].pixels);
+    for (int i = 0; i < strip->npages; i++)
+        SDL_DestroyTexture(strip->pages[i]);
+
+    free(strip->thumbs);
+    free(strip->pages);
+    SDL_DestroyMutex(strip->mutex);
+    free(strip->filename);
+    free(strip);
+}
+
+/* keyframes nearly always come in pts order, so this is an append */
+static void add_thumbnail(struct ThumbnailStrip * strip, struct Thumbnail thumb) {
+    SDL_LockMutex(strip->mutex);
+
+    if (strip->count == strip->allocated) {
+        strip->allocated *= 2;
+        strip->thumbs = realloc(
+            strip->thumbs, strip->allocated * sizeof(struct Thumbnail)
+        );
+    }
+    int i = strip->count;
+    while (i > 0 && strip->thumbs[i - 1].time > thumb.time) i--;
+    memmove(
+        strip->thumbs + i + 1, strip->thumbs + i,
+        (strip->count - i) * sizeof(struct Thumbnail)
+    );
+    strip->thumbs[i] = thumb;
+    strip->count++;
+    strip->pending++;
+
+    SDL_UnlockMutex(strip->mutex);
+}
+
+/* decoding at a fraction of the size is much cheaper, as long as
+ * there's still twice the pixels we need to scale down from */
+static int pick_lowres(const AVCodec * codec, int coded_height, int height) {
+    int lowres = 0;
+    while ((lowres < codec->max_lowres) && ((coded_height >> (lowres + 1)) >= height * 2))
+        lowres++;
+    return lowres;
+}
+
+struct BuildState {
+    struct ThumbnailStrip * strip;
+    AVCodecContext * codec_ctx;
+    struct SwsContext * sws_ctx;
+    AVRational time_base;
+    int width, height;
+};
+
+static void receive_thumbnails(struct BuildState * bs) {
+    AVFrame * frame = av_frame_alloc();
+
+    while (!avcodec_receive_frame(bs->codec_ctx, frame)) {
+        int64_t pts = frame->best_effort_timestamp;
+        if (pts == AV_NOPTS_VALUE) pts = frame->pts;
+
+        bs->sws_ctx = sws_getCachedContext(
+            bs->sws_ctx,
+            frame->width, frame->height, frame->format,
+            bs->width, bs->height, AV_PIX_FMT_RGB24,
+            SWS_BILINEAR, NULL, NULL, NULL
+        );
+
+        uint8_t * pixels = malloc(bs->width * bs->height * 3);
+        int linesize = bs->width * 3;
+        if (bs->sws_ctx && (pts != AV_NOPTS_VALUE)) {
+            sws_scale(
+                bs->sws_ctx, (const uint8_t * const *) frame->data, frame->linesize,
+                0, frame->height, &pixels, &linesize
+            );
+            add_thumbnail(bs->strip, (struct Thumbnail) {
+                .time = pts * av_q2d(bs->time_base),
+                .pixels = pixels,
+                .slot = -1
+            });
+        } else {
+            free(pixels);
+        }
+        av_frame_unref(frame);
+    }
+
+    av_frame_free(&frame);
+}
+
+static int thread_build_thumbnails(void * data) {
+    struct ThumbnailStrip * strip = data;
+    trace_thread_name("thumbnailer");
+
+    SDL_SetThreadPriority(SDL_THREAD_PRIORITY_LOW);
+
+    AVFormatContext * format_ctx = NULL;
+    if (avformat_open_input(&format_ctx, strip->filename, NULL, NULL)) {
+        fprintf(stderr, "failed to make thumbnails for `%s`\n", strip->filename);
+        return -1;
+    }
+    avformat_find_stream_info(format_ctx, NULL);
+
+    const AVCodec * codec;
+    int stream_idx = av_find_best_stream(format_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, &codec, 0);
+    if (stream_idx < 0) {
+        avformat_close_input(&format_ctx);
+        return -1;
+    }
+    AVStream * stream = format_ctx->streams[stream_idx];
+    AVCodecParameters * codecpar = stream->codecpar;
+
+    /* we only need the keyframes of one stream. some demuxers
+     * skip the rest without even reading it */
+    for (unsigned i = 0; i < format_ctx->nb_streams; i++)
+        format_ctx->streams[i]->discard = AVDISCARD_ALL;
+    stream->discard = AVDISCARD_NONKEY;
+
+    AVCodecContext * codec_ctx = avcodec_alloc_context3(codec);
+    avcodec_parameters_to_context(codec_ctx, codecpar);
+    codec_ctx->thread_count = 1;
+    codec_ctx->skip_frame = AVDISCARD_NONKEY;
+    codec_ctx->lowres = pick_lowres(codec, codecpar->height, strip->height);
+    if (avcodec_open2(codec_ctx, codec, NULL)) {
+        avcodec_free_context(&codec_ctx);
+        avformat_close_input(&format_ctx);
+        return -1;
+    }
+
+    AVRational sar = stream->sample_aspect_ratio.num ?
+        stream->sample_aspect_ratio : (AVRational) { 1, 1 };
+    int width = strip->height * codecpar->width * av_q2d(sar) / codecpar->height;
+    width = MAX(width, 1);
+    width = MIN(width, ATLAS_SIZE);
+
+    struct BuildState bs = {
+        .strip = strip,
+        .codec_ctx = codec_ctx,
+        .sws_ctx = NULL,
+        .time_base = stream->time_base,
+        .width = width,
+        .height = strip->height
+    };
+
+    SDL_LockMutex(strip->mutex);
+    strip->width = bs.width;
+    SDL_UnlockMutex(strip->mutex);
+
+    AVPacket * pkt = av_packet_alloc();
+    double last_time = -INFINITY;
+    while (!atomic_load(&strip->cancel) && !av_read_frame(format_ctx, pkt)) {
+        int64_t pts = pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts;
+        double time = pts * av_q2d(bs.time_base);
+
+        if ((pkt->stream_index == stream_idx) && (pkt->flags & AV_PKT_FLAG_KEY) &&
+            (time >= last_time + strip->spacing)) {
+            last_time = time;
+            if (!avcodec_send_packet(codec_ctx, pkt))
+                receive_thumbnails(&bs);
+        }
+        av_packet_unref(pkt);
+    }
+
+    if (!atomic_load(&strip->cancel)) {
+        avcodec_send_packet(codec_ctx, NULL);
+        receive_thumbnails(&bs);
+    }
+
+    av_packet_free(&pkt);
+    sws_freeContext(bs.sws_ctx);
+    avcodec_free_context(&codec_ctx);
+    avformat_close_input(&format_ctx);
+    return 0;
+}
+
+struct ThumbnailStrip * create_thumbnail_strip(
+    const char * filename, int height, double spacing
+) {
+    struct ThumbnailStrip * strip = create_strip(filename, height, spacing);
+
+    strip->builder = SDL_CreateThread(thread_build_thumbnails, "Thumbnailer", strip);
+    if (strip->builder == NULL) {
+        destroy_thumbnail_strip(strip);
+        return NULL;
+    }
+    return strip;
+}
+
+static int slots_per_page(const struct ThumbnailStrip * strip) {
+    return (ATLAS_SIZE / strip->width) * (ATLAS_SIZE / strip->height);
+}
+
+/* where slot is in its page */
+static SDL_Rect slot_rect(const struct ThumbnailStrip * strip, int slot) {
+    int cols = ATLAS_SIZE / strip->width;
+    int cell = slot % slots_per_page(strip);
+    return (SDL_Rect) {
+        (cell % cols) * strip->width, (cell / cols) * strip->height,
+        strip->width, strip->height
+    };
+}
+
+void thumbnails_update(struct ThumbnailStrip * strip, SDL_Renderer * renderer) {
+    if (strip == NULL) return;
+
+    SDL_LockMutex(strip->mutex);
+
+    for (int i = 0; strip->pending && (i < strip->count); i++) {
+        struct Thumbnail * thumb = &strip->thumbs[i];
+        if (thumb->slot >= 0) continue;
+
+        int slot = strip->nslots;
+        int page = slot / slots_per_page(strip);
+        if (page == strip->npages) {
+            SDL_Texture * tex = SDL_CreateTexture(
+                renderer, SDL_PIXELFORMAT_RGB24, SDL_TEXTUREACCESS_STATIC,
+                ATLAS_SIZE, ATLAS_SIZE
+            );
+            if (tex == NULL) break;
+            strip->pages = realloc(strip->pages, (strip->npages + 1) * sizeof(SDL_Texture *));
+            strip->pages[strip->npages++] = tex;
+        }
+
+        SDL_Rect rect = slot_rect(strip, slot);
+        SDL_UpdateTexture(strip->pages[page], &rect, thumb->pixels, strip->width * 3);
+        free(thumb->pixels);
+        thumb->pixels = NULL;
+        thumb->slot = slot;
+        strip->nslots++;
+        strip->pending--;
+    }
+
+    SDL_UnlockMutex(strip->mutex);
+}
+
+void draw_thumbnails(
+    struct ThumbnailStrip * strip, SDL_Renderer * renderer, SDL_Rect rect,
+    double timestamp, double pixels_per_sec
+) {
+    if (strip == NULL) return;
+
+    SDL_LockMutex(strip->mutex);
+    if (strip->width == 0) goto unlock;
+
+    int w = strip->width * rect.h / strip->height;
+    double left = timestamp - (rect.w / 2.0 + w) / pixels_per_sec;
+
+    /* first thumbnail that reaches into rect */
+    int lo = 0, hi = strip->count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (strip->thumbs[mid].time < left)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    int last_end = INT_MIN;
+    for (int i = lo; i < strip->count; i++) {
+        const struct Thumbnail * thumb = &strip->thumbs[i];
+        int x = rect.x + (thumb->time - timestamp) * pixels_per_sec + rect.w / 2.0;
+        if (x >= rect.x + rect.w) break;
+        if ((thumb->slot < 0) || (x < last_end)) continue;
+
+        SDL_Rect src = slot_rect(strip, thumb->slot);
+        SDL_RenderCopy(
+            renderer, strip->pages[thumb->slot / slots_per_page(strip)],
+            &src, &(SDL_Rect) { x, rect.y, w, rect.h }
+        );
+        last_end = x + w;
+    }
+
+    unlock:
+    SDL_UnlockMutex(strip->mutex);
+}
@@ -0,0 +1,55 @@
+#pragma once
+#include "../av.h"
+#include <stdatomic.h>
+
+/* a small picture of a keyframe, for the timeline */
+struct Thumbnail {
+    double time; /* seconds */
+    uint8_t * pixels; /* RGB24, until it's uploaded to the atlas */
+    int slot; /* cell in the atlas, or -1 if not uploaded yet */
+};
+
+/* keyframe thumbnails for the timeline, made in the background with a
+ * separate demuxer and decoder that only decode keyframes at reduced
+ * resolution. they show up as they're made, starting from the beginning.
+ * the builder thread sets width and appends to thumbs under mutex, and
+ * thumbnails_update and draw_thumbnails hold it while uploading and
+ * drawing them. pages and slots are only used from the render thread. */
+struct ThumbnailStrip {
+    struct Thumbnail * thumbs; /* sorted by time */
+    int count, allocated;
+    int pending; /* thumbs not uploaded yet */
+    int width, height; /* of every thumbnail. width is 0 until it's known */
+    double spacing; /* keyframes closer than this to the last thumbnail are skipped */
+
+    SDL_mutex * mutex;
+    SDL_Thread * builder;
+    atomic_bool cancel;
+
+    /* textures of ATLAS_SIZE squared, holding thumbnails in a grid */
+    SDL_Texture ** pages;
+    int npages;
+    int nslots;
+
+    char * filename;
+};
+
+/* starts making thumbnails height pixels high, at most one per spacing
+ * seconds. returns NULL on failure */
+struct ThumbnailStrip * create_thumbnail_strip(
+    const char * filename, int height, double spacing
+);
+
+void destroy_thumbnail_strip(struct ThumbnailStrip * strip);
+
+/* copies thumbnails made since the last call to the atlas.
+ * call from the thread that renders, before draw_thumbnails */
+void thumbnails_update(struct ThumbnailStrip * strip, SDL_Renderer * renderer);
+
+/* draws the thumbnails along rect, with timestamp (in seconds) in the
+ * middle and pixels_per_sec horizontal scale. thumbnails that would
+ * overlap the previous one are left out */
+void draw_thumbnails(
+    struct ThumbnailStrip * strip, SDL_Renderer * renderer, SDL_Rect rect,
+    double timestamp, double pixels_per_sec
+);
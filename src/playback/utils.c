@@ -1,4 +1,7 @@
 #include "utils.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 
 AVChannelLayout nb_ch_to_av_ch_layout(int n) {
     switch (n) {
@@ -30,3 +33,130 @@ enum AVSampleFormat sample_fmt_sdl_to_av(int sdl_fmt) {
 int get_texture_pitch(uint32_t format, int w) {
     return (w * SDL_BYTESPERPIXEL(format) + 3) & ~3;
 }
+
+double mono_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1000000000.0;
+}
+
+int64_t mono_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+int get_file_identity(const char * filename, struct FileIdentity * id) {
+    struct stat st;
+    if (stat(filename, &st) || (realpath(filename, id->path) == NULL))
+        return -1;
+    id->size = st.st_size;
+    id->mtime_ns = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+    return 0;
+}
+
+static uint64_t fnv1a(uint64_t hash, const void * data, size_t len) {
+    const uint8_t * bytes = data;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+int get_cache_path(const struct FileIdentity * id, const char * ext, char * dst, size_t dst_size) {
+    char dir[PATH_MAX];
+    const char * xdg_cache = getenv("XDG_CACHE_HOME");
+    const char * home = getenv("HOME");
+
+    if (xdg_cache && *xdg_cache) {
+        snprintf(dir, sizeof(dir), "%s", xdg_cache);
+    } else if (home && *home) {
+        snprintf(dir, sizeof(dir), "%s/.cache", home);
+    } else {
+        return -1;
+    }
+    mkdir(dir, 0755);
+    strncat(dir, "/av", sizeof(dir) - strlen(dir) - 1);
+    if (mkdir(dir, 0755) && (errno != EEXIST))
+        return -1;
+
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    hash = fnv1a(hash, id->path, strlen(id->path));
+    hash = fnv1a(hash, &id->size, sizeof(id->size));
+    hash = fnv1a(hash, &id->mtime_ns, sizeof(id->mtime_ns));
+
+    if (snprintf(dst, dst_size, "%s/%016llx.%s", dir, (unsigned long long) hash, ext)
+        >= (int) dst_size)
+        return -1;
+    return 0;
+}
+
+void * map_cache_file(
+    const char * path, const struct CacheFormat * fmt,
+    const struct FileIdentity * id, size_t * map_size
+) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+
+    struct stat st;
+    size_t before = sizeof(struct CacheHeader) + fmt->extra_size;
+    if (fstat(fd, &st) || ((size_t) st.st_size < before)) {
+        close(fd);
+        return NULL;
+    }
+
+    void * map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return NULL;
+
+    /* the count is checked against the size before multiplying, so a
+     * corrupt one can't overflow */
+    const struct CacheHeader * header = map;
+    size_t max_count = (st.st_size - before) / fmt->record_size;
+    bool valid =
+        !memcmp(header->magic, fmt->magic, 4) &&
+        (header->version == fmt->version) &&
+        (header->file_size == id->size) &&
+        (header->mtime_ns == id->mtime_ns) &&
+        (header->count >= 0) && (header->count <= INT_MAX) &&
+        ((uint64_t) header->count <= max_count) &&
+        ((size_t) st.st_size == before + header->count * fmt->record_size);
+
+    if (!valid) {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    *map_size = st.st_size;
+    return map;
+}
+
+int save_cache_file(
+    const char * path, const struct CacheFormat * fmt, const struct FileIdentity * id,
+    const void * extra, const void * records, int64_t count
+) {
+    char tmp_path[PATH_MAX + 8];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    FILE * f = fopen(tmp_path, "wb");
+    if (f == NULL) return -1;
+
+    struct CacheHeader header = {
+        .version = fmt->version,
+        .file_size = id->size,
+        .mtime_ns = id->mtime_ns,
+        .count = count
+    };
+    memcpy(header.magic, fmt->magic, 4);
+
+    bool ok =
+        (fwrite(&header, sizeof(header), 1, f) == 1) &&
+        (!fmt->extra_size || (fwrite(extra, fmt->extra_size, 1, f) == 1)) &&
+        (fwrite(records, fmt->record_size, count, f) == (size_t) count);
+
+    if (fclose(f) || !ok || rename(tmp_path, path)) {
+        remove(tmp_path);
+        return -1;
+    }
+    return 0;
+}
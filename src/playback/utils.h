@@ -1,8 +1,60 @@
 #pragma once
 #include "../av.h"
+#include <limits.h>
 
 AVChannelLayout nb_ch_to_av_ch_layout(int n);
 
 enum AVSampleFormat sample_fmt_sdl_to_av(int sdl_fmt);
 
 int get_texture_pitch(uint32_t format, int w);
+
+/* time on the monotonic clock, only good for measuring intervals */
+double mono_now(void); /* seconds */
+int64_t mono_ns(void);
+
+/* what a file's cached data (e.g. its keyframe index) is keyed by */
+struct FileIdentity {
+    char path[PATH_MAX]; /* absolute */
+    int64_t size;
+    int64_t mtime_ns;
+};
+
+int get_file_identity(const char * filename, struct FileIdentity * id);
+
+/* stores the path of the cache file for id with extension ext in dst
+ * ($XDG_CACHE_HOME/av or ~/.cache/av), creating the directory if needed.
+ * returns 0 on success */
+int get_cache_path(const struct FileIdentity * id, const char * ext, char * dst, size_t dst_size);
+
+/* a kind of cache file: a CacheHeader, extra_size bytes of the kind's own
+ * (e.g. a sample rate), then count records. it's only read back on the
+ * machine that wrote it, so native byte order */
+struct CacheFormat {
+    char magic[4];
+    uint32_t version;
+    size_t extra_size, record_size;
+};
+
+struct CacheHeader {
+    char magic[4];
+    uint32_t version;
+    int64_t file_size;
+    int64_t mtime_ns;
+    int64_t count;
+};
+
+/* maps the cache file at path if it's fmt's kind and was made from the
+ * file id describes. the header, extra and records follow each other in
+ * the mapping, count is at most INT_MAX. returns NULL if there's no valid
+ * one, otherwise munmap the result with map_size */
+void * map_cache_file(
+    const char * path, const struct CacheFormat * fmt,
+    const struct FileIdentity * id, size_t * map_size
+);
+
+/* goes through a temporary file, so map_cache_file never sees half of one.
+ * returns 0 on success */
+int save_cache_file(
+    const char * path, const struct CacheFormat * fmt, const struct FileIdentity * id,
+    const void * extra, const void * records, int64_t count
+);
@@ -0,0 +1,401 @@
+#include "waveform.h"
+#include "utils.h"
+#include "../trace.h"
+#include <sys/mman.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#else
+#define HAVE_X86_SIMD 0
+#endif
+
+/* the cache holds the level 0 Peaks. the levels above are cheap to
+ * rebuild, so they aren't stored */
+struct CacheExtra {
+    int64_t sample_rate;
+    double start;
+};
+
+static const struct CacheFormat cache_format = {
+    .magic = "AVWF",
+    .version = 2,
+    .extra_size = sizeof(struct CacheExtra),
+    .record_size = sizeof(struct Peak)
+};
+
+static struct Waveform * create_empty_waveform(const char * filename) {
+    struct Waveform * wave = malloc(sizeof(struct Waveform));
+    *wave = (struct Waveform) {
+        .sample_rate = 0,
+        .start = 0,
+        .complete = false,
+        .mutex = SDL_CreateMutex(),
+        .builder = NULL,
+        .rects = NULL,
+        .rects_allocated = 0,
+        .filename = strdup(filename),
+        .cache_path = NULL
+    };
+    atomic_init(&wave->cancel, false);
+    return wave;
+}
+
+void destroy_waveform(struct Waveform * wave) {
+    if (wave == NULL) return;
+
+    if (wave->builder) {
+        atomic_store(&wave->cancel, true);
+        SDL_WaitThread(wave->builder, NULL);
+    }
+
+    for (int i = 0; i < WAVE_MAX_LEVELS; i++)
+        free(wave->levels[i]);
+    SDL_DestroyMutex(wave->mutex);
+    free(wave->rects);
+    free(wave->filename);
+    free(wave->cache_path);
+    free(wave);
+}
+
+static struct Peak combine_peaks(struct Peak a, struct Peak b) {
+    return (struct Peak) {
+        .min = MIN(a.min, b.min),
+        .max = MAX(a.max, b.max),
+        .rms = sqrtf((a.rms * a.rms + b.rms * b.rms) / 2)
+    };
+}
+
+/* caller holds the mutex, unless no other thread can see wave yet.
+ * every second peak of a level completes one in the level above */
+static void add_peak(struct Waveform * wave, int level, struct Peak peak) {
+    if (wave->count[level] == wave->allocated[level]) {
+        wave->allocated[level] = wave->allocated[level] ? wave->allocated[level] * 2 : 1024;
+        wave->levels[level] = realloc(
+            wave->levels[level], wave->allocated[level] * sizeof(struct Peak)
+        );
+    }
+    struct Peak * peaks = wave->levels[level];
+    peaks[wave->count[level]++] = peak;
+
+    int n = wave->count[level];
+    if ((level + 1 < WAVE_MAX_LEVELS) && !(n % 2))
+        add_peak(wave, level + 1, combine_peaks(peaks[n - 2], peaks[n - 1]));
+}
+
+/* running reduction of the samples of one level 0 peak */
+struct Block {
+    float min, max, sumsq;
+    int n;
+};
+
+static const struct Block empty_block = { INFINITY, -INFINITY, 0, 0 };
+
+typedef void (* ReduceFn)(const float * samples, int n, struct Block * block);
+
+static void reduce_scalar(const float * samples, int n, struct Block * block) {
+    for (int i = 0; i < n; i++) {
+        block->min = MIN(block->min, samples[i]);
+        block->max = MAX(block->max, samples[i]);
+        block->sumsq += samples[i] * samples[i];
+    }
+    block->n += n;
+}
+
+#if HAVE_X86_SIMD
+__attribute__((target("sse")))
+static void reduce_sse(const float * samples, int n, struct Block * block) {
+    __m128 min = _mm_set1_ps(block->min);
+    __m128 max = _mm_set1_ps(block->max);
+    __m128 sumsq = _mm_setzero_ps();
+
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128 s = _mm_loadu_ps(samples + i);
+        min = _mm_min_ps(min, s);
+        max = _mm_max_ps(max, s);
+        sumsq = _mm_add_ps(sumsq, _mm_mul_ps(s, s));
+    }
+
+    float mins[4], maxs[4], sums[4];
+    _mm_storeu_ps(mins, min);
+    _mm_storeu_ps(maxs, max);
+    _mm_storeu_ps(sums, sumsq);
+    for (int j = 0; j < 4; j++) {
+        block->min = MIN(block->min, mins[j]);
+        block->max = MAX(block->max, maxs[j]);
+        block->sumsq += sums[j];
+    }
+    block->n += i;
+
+    reduce_scalar(samples + i, n - i, block);
+}
+#endif
+
+static ReduceFn best_reduce(void) {
+#if HAVE_X86_SIMD
+    if (SDL_HasSSE()) return reduce_sse;
+#endif
+    return reduce_scalar;
+}
+
+struct BuildState {
+    struct Waveform * wave;
+    ReduceFn reduce;
+    struct Block block;
+};
+
+static void finish_block(struct BuildState * bs) {
+    struct Block * block = &bs->block;
+    if (!block->n) return;
+
+    add_peak(bs->wave, 0, (struct Peak) {
+        .min = block->min,
+        .max = block->max,
+        .rms = sqrtf(block->sumsq / block->n)
+    });
+    *block = empty_block;
+}
+
+/* samples are mono floats */
+static void add_samples(struct BuildState * bs, const float * samples, int n) {
+    SDL_LockMutex(bs->wave->mutex);
+    while (n > 0) {
+        int take = MIN(n, WAVE_BASE_SAMPLES - bs->block.n);
+        bs->reduce(samples, take, &bs->block);
+        samples += take;
+        n -= take;
+        if (bs->block.n == WAVE_BASE_SAMPLES) finish_block(bs);
+    }
+    SDL_UnlockMutex(bs->wave->mutex);
+}
+
+/* resamples frame (or what swr holds, if frame is NULL) to mono floats */
+static void add_frame(struct BuildState * bs, struct SwrContext * swr_ctx, const AVFrame * frame) {
+    int in_samples = frame ? frame->nb_samples : 0;
+    int out_samples = swr_get_out_samples(swr_ctx, in_samples);
+    if (out_samples <= 0) return;
+
+    float * samples = malloc(out_samples * sizeof(float));
+    int converted = swr_convert(
+        swr_ctx, (uint8_t **) &samples, out_samples,
+        frame ? (const uint8_t **) frame->extended_data : NULL, in_samples
+    );
+    if (converted > 0) add_samples(bs, samples, converted);
+    free(samples);
+}
+
+static void receive_samples(struct BuildState * bs, AVCodecContext * codec_ctx, struct SwrContext * swr_ctx) {
+    AVFrame * frame = av_frame_alloc();
+    while (!avcodec_receive_frame(codec_ctx, frame)) {
+        add_frame(bs, swr_ctx, frame);
+        av_frame_unref(frame);
+    }
+    av_frame_free(&frame);
+}
+
+/* the peaks are copied out, since the levels above are built on them */
+static int load_waveform_cache(struct Waveform * wave, const struct FileIdentity * file_id) {
+    size_t map_size;
+    void * map = map_cache_file(wave->cache_path, &cache_format, file_id, &map_size);
+    if (map == NULL) return -1;
+
+    const struct CacheHeader * header = map;
+    const struct CacheExtra * extra = (const struct CacheExtra *) (header + 1);
+    const struct Peak * peaks = (const struct Peak *) (extra + 1);
+
+    bool valid = (extra->sample_rate > 0) && (extra->sample_rate <= INT_MAX) &&
+        isfinite(extra->start);
+    if (valid) {
+        for (int64_t i = 0; i < header->count; i++)
+            add_peak(wave, 0, peaks[i]);
+        wave->sample_rate = extra->sample_rate;
+        wave->start = extra->start;
+        wave->complete = true;
+    }
+    munmap(map, map_size);
+    return valid ? 0 : -1;
+}
+
+static int thread_build_waveform(void * data) {
+    struct Waveform * wave = data;
+    trace_thread_name("waveform");
+
+    SDL_SetThreadPriority(SDL_THREAD_PRIORITY_LOW);
+
+    AVFormatContext * format_ctx = NULL;
+    if (avformat_open_input(&format_ctx, wave->filename, NULL, NULL)) {
+        fprintf(stderr, "failed to make waveform for `%s`\n", wave->filename);
+        return -1;
+    }
+    avformat_find_stream_info(format_ctx, NULL);
+
+    const AVCodec * codec;
+    int stream_idx = av_find_best_stream(format_ctx, AVMEDIA_TYPE_AUDIO, -1, -1, &codec, 0);
+    if (stream_idx < 0) {
+        avformat_close_input(&format_ctx);
+        return 0;
+    }
+    AVStream * stream = format_ctx->streams[stream_idx];
+
+    for (unsigned i = 0; i < format_ctx->nb_streams; i++)
+        if ((int) i != stream_idx)
+            format_ctx->streams[i]->discard = AVDISCARD_ALL;
+
+    AVCodecContext * codec_ctx = avcodec_alloc_context3(codec);
+    avcodec_parameters_to_context(codec_ctx, stream->codecpar);
+    codec_ctx->thread_count = 1;
+
+    struct SwrContext * swr_ctx = NULL;
+    AVChannelLayout mono = AV_CHANNEL_LAYOUT_MONO;
+    if (avcodec_open2(codec_ctx, codec, NULL) ||
+        swr_alloc_set_opts2(
+            &swr_ctx,
+            &mono, AV_SAMPLE_FMT_FLT, codec_ctx->sample_rate,
+            &codec_ctx->ch_layout, codec_ctx->sample_fmt, codec_ctx->sample_rate,
+            0, NULL
+        ) ||
+        swr_init(swr_ctx)) {
+        fprintf(stderr, "failed to make waveform for `%s`\n", wave->filename);
+        swr_free(&swr_ctx);
+        avcodec_free_context(&codec_ctx);
+        avformat_close_input(&format_ctx);
+        return -1;
+    }
+
+    SDL_LockMutex(wave->mutex);
+    wave->sample_rate = codec_ctx->sample_rate;
+    if (stream->start_time != AV_NOPTS_VALUE)
+        wave->start = stream->start_time * av_q2d(stream->time_base);
+    SDL_UnlockMutex(wave->mutex);
+
+    struct BuildState bs = {
+        .wave = wave,
+        .reduce = best_reduce(),
+        .block = empty_block
+    };
+
+    AVPacket * pkt = av_packet_alloc();
+    int ret = AVERROR(EAGAIN); /* in case it was cancelled before reading anything */
+    while (!atomic_load(&wave->cancel) && !(ret = av_read_frame(format_ctx, pkt))) {
+        if ((pkt->stream_index == stream_idx) && !avcodec_send_packet(codec_ctx, pkt))
+            receive_samples(&bs, codec_ctx, swr_ctx);
+        av_packet_unref(pkt);
+    }
+
+    if (ret == AVERROR_EOF) {
+        avcodec_send_packet(codec_ctx, NULL);
+        receive_samples(&bs, codec_ctx, swr_ctx);
+        add_frame(&bs, swr_ctx, NULL);
+
+        SDL_LockMutex(wave->mutex);
+        finish_block(&bs);
+        wave->complete = true;
+        SDL_UnlockMutex(wave->mutex);
+    }
+
+    av_packet_free(&pkt);
+    swr_free(&swr_ctx);
+    avcodec_free_context(&codec_ctx);
+    avformat_close_input(&format_ctx);
+
+    /* complete means the peaks are final, so they're read unlocked */
+    struct FileIdentity file_id;
+    if (wave->complete && wave->cache_path && !get_file_identity(wave->filename, &file_id)) {
+        struct CacheExtra extra = { .sample_rate = wave->sample_rate, .start = wave->start };
+        save_cache_file(
+            wave->cache_path, &cache_format, &file_id,
+            &extra, wave->levels[0], wave->count[0]
+        );
+    }
+
+    return 0;
+}
+
+struct Waveform * create_waveform(const char * filename) {
+    struct Waveform * wave = create_empty_waveform(filename);
+
+    struct FileIdentity file_id;
+    char cache_path[PATH_MAX];
+    if (!get_file_identity(filename, &file_id) &&
+        !get_cache_path(&file_id, "wave", cache_path, sizeof(cache_path))) {
+        wave->cache_path = strdup(cache_path);
+        if (!load_waveform_cache(wave, &file_id))
+            return wave;
+    }
+
+    wave->builder = SDL_CreateThread(thread_build_waveform, "Waveform", wave);
+    if (wave->builder == NULL) {
+        destroy_waveform(wave);
+        return NULL;
+    }
+    return wave;
+}
+
+void draw_waveform(
+    struct Waveform * wave, SDL_Renderer * renderer, SDL_Rect rect,
+    double timestamp, double pixels_per_sec, SDL_Color peak, SDL_Color rms
+) {
+    if (wave == NULL) return;
+
+    SDL_LockMutex(wave->mutex);
+    if ((wave->sample_rate == 0) || (wave->count[0] == 0)) goto unlock;
+
+    /* the coarsest level that still has a peak or more per pixel */
+    double samples_per_px = wave->sample_rate / pixels_per_sec;
+    int level = 0;
+    while ((level + 1 < WAVE_MAX_LEVELS) && wave->count[level + 1] &&
+           (((int64_t) WAVE_BASE_SAMPLES << (level + 1)) <= samples_per_px))
+        level++;
+
+    const struct Peak * peaks = wave->levels[level];
+    int count = wave->count[level];
+    double peak_samples = (int64_t) WAVE_BASE_SAMPLES << level;
+
+    if (wave->rects_allocated < 2 * rect.w) {
+        wave->rects_allocated = 2 * rect.w;
+        wave->rects = realloc(wave->rects, wave->rects_allocated * sizeof(SDL_Rect));
+    }
+    SDL_Rect * peak_rects = wave->rects;
+    SDL_Rect * rms_rects = wave->rects + rect.w;
+    int nrects = 0;
+    int mid = rect.y + rect.h / 2;
+    double half_h = rect.h / 2.0;
+
+    for (int x = 0; x < rect.w; x++) {
+        double time = timestamp + (x - rect.w / 2.0) / pixels_per_sec - wave->start;
+        double first = time * wave->sample_rate / peak_samples;
+        int from = floor(first);
+        int to = MAX(from + 1, (int) floor(first + samples_per_px / peak_samples));
+        from = MAX(from, 0);
+        to = MIN(to, count);
+        if (from >= to) continue;
+
+        float pmin = peaks[from].min, pmax = peaks[from].max, sumsq = 0;
+        for (int i = from; i < to; i++) {
+            pmin = MIN(pmin, peaks[i].min);
+            pmax = MAX(pmax, peaks[i].max);
+            sumsq += peaks[i].rms * peaks[i].rms;
+        }
+
+        float top = MIN(pmax, 1.0f), bottom = MAX(pmin, -1.0f);
+        float loud = sqrtf(sumsq / (to - from));
+        loud = MIN(loud, 1.0f);
+        peak_rects[nrects] = (SDL_Rect) {
+            rect.x + x, mid - top * half_h, 1, MAX(1, (top - bottom) * half_h)
+        };
+        rms_rects[nrects] = (SDL_Rect) {
+            rect.x + x, mid - loud * half_h, 1, MAX(1, 2 * loud * half_h)
+        };
+        nrects++;
+    }
+
+    /* one batch per colour */
+    SDL_SetRenderDrawColor(renderer, peak.r, peak.g, peak.b, peak.a);
+    SDL_RenderFillRects(renderer, peak_rects, nrects);
+    SDL_SetRenderDrawColor(renderer, rms.r, rms.g, rms.b, rms.a);
+    SDL_RenderFillRects(renderer, rms_rects, nrects);
+
+    unlock:
+    SDL_UnlockMutex(wave->mutex);
+}
@@ -0,0 +1,51 @@
+#pragma once
+#include "../av.h"
+#include <stdatomic.h>
+
+#define WAVE_BASE_SAMPLES 256 /* samples per peak in level 0 */
+#define WAVE_MAX_LEVELS 24
+
+/* the audio of a span of samples, downmixed to mono */
+struct Peak {
+    float min, max, rms;
+};
+
+/* min/max/rms peaks of the whole audio stream, for drawing a waveform
+ * at any zoom. level 0 has a peak per WAVE_BASE_SAMPLES samples, and
+ * each level above combines pairs from the one below.
+ * made in the background by decoding the audio with a separate demuxer
+ * and decoder, or loaded from the cache if an earlier run made it.
+ * the builder thread appends peaks under mutex, and draw_waveform holds
+ * it while reading them, so levels, count, sample_rate, start and
+ * complete are only safe to touch with it locked. */
+struct Waveform {
+    struct Peak * levels[WAVE_MAX_LEVELS];
+    int count[WAVE_MAX_LEVELS], allocated[WAVE_MAX_LEVELS];
+    int sample_rate; /* 0 until it's known */
+    double start; /* seconds, time of the first sample */
+    bool complete;
+
+    SDL_mutex * mutex;
+    SDL_Thread * builder;
+    atomic_bool cancel;
+
+    /* rects draw_waveform batches, peaks then rms. only it uses them */
+    SDL_Rect * rects;
+    int rects_allocated;
+
+    char * filename;
+    char * cache_path; /* NULL if there's nowhere to cache */
+};
+
+/* returns NULL on failure. a file without audio gets an empty waveform */
+struct Waveform * create_waveform(const char * filename);
+
+void destroy_waveform(struct Waveform * wave);
+
+/* draws the waveform across rect, with timestamp (in seconds) in the
+ * middle and pixels_per_sec horizontal scale. peak is the colour of the
+ * min..max range, rms of the loudness inside it */
+void draw_waveform(
+    struct Waveform * wave, SDL_Renderer * renderer, SDL_Rect rect,
+    double timestamp, double pixels_per_sec, SDL_Color peak, SDL_Color rms
+);
@@ -0,0 +1,455 @@
+#include "yuv2rgb.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#else
+#define HAVE_X86_SIMD 0
+#endif
+
+/* all kernels do the same fixed point math in 32 bit lanes, so they
+ * produce identical output:
+ *   y' = (y - y_off) * cy + round
+ *   r = (y' + crv * (v - c_off)) >> shift
+ *   g = (y' - cgu * (u - c_off) - cgv * (v - c_off)) >> shift
+ *   b = (y' + cbu * (u - c_off)) >> shift
+ * ARGB8888 is written as bytes B, G, R, A (little endian only). */
+#define COEFF_BITS 14
+
+enum ChromaLayout {
+    LAYOUT_PLANAR8, /* yuv420p, yuv422p */
+    LAYOUT_NV12, /* u and v interleaved in one plane */
+    LAYOUT_PLANAR16, /* yuv420p10 */
+    NLAYOUTS
+};
+
+static enum Yuv2RgbSimd simd_limit = YUV2RGB_AVX2;
+
+void yuv2rgb_limit_simd(enum Yuv2RgbSimd max) { simd_limit = max; }
+
+static inline uint8_t clamp_u8(int32_t x) {
+    return x < 0 ? 0 : x > 255 ? 255 : x;
+}
+
+static inline void put_pixel(
+    const struct YuvCoeffs * c, int32_t y, int32_t u, int32_t v,
+    uint8_t * dst, const enum Yuv2RgbOutput output
+) {
+    y = (y - c->y_off) * c->cy + (1 << (c->shift - 1));
+    u -= c->c_off;
+    v -= c->c_off;
+    uint8_t r = clamp_u8((y + c->crv * v) >> c->shift);
+    uint8_t g = clamp_u8((y - c->cgu * u - c->cgv * v) >> c->shift);
+    uint8_t b = clamp_u8((y + c->cbu * u) >> c->shift);
+
+    if (output == YUV2RGB_RGB24) {
+        dst[0] = r; dst[1] = g; dst[2] = b;
+    } else {
+        dst[0] = b; dst[1] = g; dst[2] = r; dst[3] = 0xff;
+    }
+}
+
+/* converts pixels [x0, width) of a row. also does the leftovers for the simd kernels */
+static inline __attribute__((always_inline)) void row_scalar(
+    const uint8_t * y, const uint8_t * u, const uint8_t * v,
+    uint8_t * dst, int x0, int width, const struct YuvCoeffs * c,
+    const enum ChromaLayout layout, const enum Yuv2RgbOutput output
+) {
+    const int bpp = output == YUV2RGB_RGB24 ? 3 : 4;
+    const uint16_t * y16 = (const uint16_t *) y;
+    const uint16_t * u16 = (const uint16_t *) u;
+    const uint16_t * v16 = (const uint16_t *) v;
+
+    for (int x = x0; x < width; x++) {
+        switch (layout) {
+            case LAYOUT_PLANAR8:
+                put_pixel(c, y[x], u[x >> 1], v[x >> 1], dst + x * bpp, output);
+                break;
+            case LAYOUT_NV12:
+                put_pixel(c, y[x], u[x & ~1], u[x | 1], dst + x * bpp, output);
+                break;
+            case LAYOUT_PLANAR16:
+                put_pixel(c, y16[x], u16[x >> 1], v16[x >> 1], dst + x * bpp, output);
+                break;
+            default:;
+        }
+    }
+}
+
+#if HAVE_X86_SIMD
+
+static inline uint32_t load32(const void * p) { uint32_t x; memcpy(&x, p, 4); return x; }
+static inline uint16_t load16(const void * p) { uint16_t x; memcpy(&x, p, 2); return x; }
+
+/* 4 pixels per iteration */
+__attribute__((target("sse4.1")))
+static inline __attribute__((always_inline)) void row_sse41(
+    const uint8_t * y, const uint8_t * u, const uint8_t * v,
+    uint8_t * dst, int width, const struct YuvCoeffs * c,
+    const enum ChromaLayout layout, const enum Yuv2RgbOutput output
+) {
+    const __m128i y_off = _mm_set1_epi32(c->y_off);
+    const __m128i c_off = _mm_set1_epi32(c->c_off);
+    const __m128i cy = _mm_set1_epi32(c->cy);
+    const __m128i crv = _mm_set1_epi32(c->crv);
+    const __m128i cgu = _mm_set1_epi32(c->cgu);
+    const __m128i cgv = _mm_set1_epi32(c->cgv);
+    const __m128i cbu = _mm_set1_epi32(c->cbu);
+    const __m128i round = _mm_set1_epi32(1 << (c->shift - 1));
+    const __m128i shift = _mm_cvtsi32_si128(c->shift);
+    const __m128i alpha = _mm_set1_epi32(0xff);
+
+    /* after packing, the register holds b0-3, r0-3, g0-3, a0-3 */
+    const __m128i shuf = output == YUV2RGB_RGB24
+        ? _mm_setr_epi8(4, 8, 0, 5, 9, 1, 6, 10, 2, 7, 11, 3, -1, -1, -1, -1)
+        : _mm_setr_epi8(0, 8, 4, 12, 1, 9, 5, 13, 2, 10, 6, 14, 3, 11, 7, 15);
+
+    int x = 0;
+    for (; x + 4 <= width; x += 4) {
+        __m128i Y, U, V;
+        switch (layout) {
+            case LAYOUT_PLANAR8:
+                Y = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(load32(y + x)));
+                U = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(load16(u + x / 2)));
+                V = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(load16(v + x / 2)));
+                U = _mm_shuffle_epi32(U, _MM_SHUFFLE(1, 1, 0, 0));
+                V = _mm_shuffle_epi32(V, _MM_SHUFFLE(1, 1, 0, 0));
+                break;
+            case LAYOUT_NV12:
+                Y = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(load32(y + x)));
+                U = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(load32(u + x)));
+                V = _mm_shuffle_epi32(U, _MM_SHUFFLE(3, 3, 1, 1));
+                U = _mm_shuffle_epi32(U, _MM_SHUFFLE(2, 2, 0, 0));
+                break;
+            case LAYOUT_PLANAR16:
+            default:
+                Y = _mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i *) (y + x * 2)));
+                U = _mm_cvtepu16_epi32(_mm_cvtsi32_si128(load32(u + x)));
+                V = _mm_cvtepu16_epi32(_mm_cvtsi32_si128(load32(v + x)));
+                U = _mm_shuffle_epi32(U, _MM_SHUFFLE(1, 1, 0, 0));
+                V = _mm_shuffle_epi32(V, _MM_SHUFFLE(1, 1, 0, 0));
+                break;
+        }
+
+        Y = _mm_add_epi32(_mm_mullo_epi32(_mm_sub_epi32(Y, y_off), cy), round);
+        U = _mm_sub_epi32(U, c_off);
+        V = _mm_sub_epi32(V, c_off);
+
+        __m128i r = _mm_sra_epi32(_mm_add_epi32(Y, _mm_mullo_epi32(V, crv)), shift);
+        __m128i g = _mm_sra_epi32(
+            _mm_sub_epi32(Y, _mm_add_epi32(_mm_mullo_epi32(U, cgu), _mm_mullo_epi32(V, cgv))),
+            shift
+        );
+        __m128i b = _mm_sra_epi32(_mm_add_epi32(Y, _mm_mullo_epi32(U, cbu)), shift);
+
+        __m128i px = _mm_packus_epi16(_mm_packs_epi32(b, r), _mm_packs_epi32(g, alpha));
+        px = _mm_shuffle_epi8(px, shuf);
+
+        if (output == YUV2RGB_RGB24) {
+            uint32_t last = _mm_extract_epi32(px, 2);
+            _mm_storel_epi64((__m128i *) (dst + x * 3), px);
+            memcpy(dst + x * 3 + 8, &last, 4);
+        } else {
+            _mm_storeu_si128((__m128i *) (dst + x * 4), px);
+        }
+    }
+    row_scalar(y, u, v, dst, x, width, c, layout, output);
+}
+
+/* 8 pixels per iteration */
+__attribute__((target("avx2")))
+static inline __attribute__((always_inline)) void row_avx2(
+    const uint8_t * y, const uint8_t * u, const uint8_t * v,
+    uint8_t * dst, int width, const struct YuvCoeffs * c,
+    const enum ChromaLayout layout, const enum Yuv2RgbOutput output
+) {
+    const __m256i y_off = _mm256_set1_epi32(c->y_off);
+    const __m256i c_off = _mm256_set1_epi32(c->c_off);
+    const __m256i cy = _mm256_set1_epi32(c->cy);
+    const __m256i crv = _mm256_set1_epi32(c->crv);
+    const __m256i cgu = _mm256_set1_epi32(c->cgu);
+    const __m256i cgv = _mm256_set1_epi32(c->cgv);
+    const __m256i cbu = _mm256_set1_epi32(c->cbu);
+    const __m256i round = _mm256_set1_epi32(1 << (c->shift - 1));
+    const __m128i shift = _mm_cvtsi32_si128(c->shift);
+    const __m256i alpha = _mm256_set1_epi32(0xff);
+
+    /* duplicate each chroma sample for two pixels */
+    const __m256i dup = _mm256_setr_epi32(0, 0, 1, 1, 2, 2, 3, 3);
+    const __m256i dup_even = _mm256_setr_epi32(0, 0, 2, 2, 4, 4, 6, 6);
+    const __m256i dup_odd = _mm256_setr_epi32(1, 1, 3, 3, 5, 5, 7, 7);
+
+    /* same as sse4.1, once per 128 bit lane: lane 0 is pixels 0-3, lane 1 is 4-7 */
+    const __m256i shuf = output == YUV2RGB_RGB24
+        ? _mm256_setr_epi8(
+            4, 8, 0, 5, 9, 1, 6, 10, 2, 7, 11, 3, -1, -1, -1, -1,
+            4, 8, 0, 5, 9, 1, 6, 10, 2, 7, 11, 3, -1, -1, -1, -1)
+        : _mm256_setr_epi8(
+            0, 8, 4, 12, 1, 9, 5, 13, 2, 10, 6, 14, 3, 11, 7, 15,
+            0, 8, 4, 12, 1, 9, 5, 13, 2, 10, 6, 14, 3, 11, 7, 15);
+
+    int x = 0;
+    for (; x + 8 <= width; x += 8) {
+        __m256i Y, U, V;
+        switch (layout) {
+            case LAYOUT_PLANAR8:
+                Y = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) (y + x)));
+                U = _mm256_cvtepu8_epi32(_mm_cvtsi32_si128(load32(u + x / 2)));
+                V = _mm256_cvtepu8_epi32(_mm_cvtsi32_si128(load32(v + x / 2)));
+                U = _mm256_permutevar8x32_epi32(U, dup);
+                V = _mm256_permutevar8x32_epi32(V, dup);
+                break;
+            case LAYOUT_NV12:
+                Y = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) (y + x)));
+                U = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) (u + x)));
+                V = _mm256_permutevar8x32_epi32(U, dup_odd);
+                U = _mm256_permutevar8x32_epi32(U, dup_even);
+                break;
+            case LAYOUT_PLANAR16:
+            default:
+                Y = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *) (y + x * 2)));
+                U = _mm256_cvtepu16_epi32(_mm_loadl_epi64((const __m128i *) (u + x)));
+                V = _mm256_cvtepu16_epi32(_mm_loadl_epi64((const __m128i *) (v + x)));
+                U = _mm256_permutevar8x32_epi32(U, dup);
+                V = _mm256_permutevar8x32_epi32(V, dup);
+                break;
+        }
+
+        Y = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_sub_epi32(Y, y_off), cy), round);
+        U = _mm256_sub_epi32(U, c_off);
+        V = _mm256_sub_epi32(V, c_off);
+
+        __m256i r = _mm256_sra_epi32(_mm256_add_epi32(Y, _mm256_mullo_epi32(V, crv)), shift);
+        __m256i g = _mm256_sra_epi32(
+            _mm256_sub_epi32(
+                Y, _mm256_add_epi32(_mm256_mullo_epi32(U, cgu), _mm256_mullo_epi32(V, cgv))
+            ),
+            shift
+        );
+        __m256i b = _mm256_sra_epi32(_mm256_add_epi32(Y, _mm256_mullo_epi32(U, cbu)), shift);
+
+        __m256i px = _mm256_packus_epi16(
+            _mm256_packs_epi32(b, r), _mm256_packs_epi32(g, alpha)
+        );
+        px = _mm256_shuffle_epi8(px, shuf);
+
+        if (output == YUV2RGB_RGB24) {
+            __m128i lo = _mm256_castsi256_si128(px);
+            __m128i hi = _mm256_extracti128_si256(px, 1);
+            uint32_t lo_last = _mm_extract_epi32(lo, 2);
+            uint32_t hi_last = _mm_extract_epi32(hi, 2);
+            _mm_storel_epi64((__m128i *) (dst + x * 3), lo);
+            memcpy(dst + x * 3 + 8, &lo_last, 4);
+            _mm_storel_epi64((__m128i *) (dst + x * 3 + 12), hi);
+            memcpy(dst + x * 3 + 20, &hi_last, 4);
+        } else {
+            _mm256_storeu_si256((__m256i *) (dst + x * 4), px);
+        }
+    }
+    row_scalar(y, u, v, dst, x, width, c, layout, output);
+}
+
+#endif
+
+/* one non-inline function per kernel/layout/output combination,
+ * so the layout and output switches are resolved at compile time */
+#define DEFINE_ROW(NAME, ATTR, KERNEL, ...) \
+    ATTR static void NAME( \
+        const uint8_t * y, const uint8_t * u, const uint8_t * v, \
+        uint8_t * dst, int width, const struct YuvCoeffs * c \
+    ) { KERNEL(y, u, v, dst, __VA_ARGS__, c, LAYOUT, OUTPUT); }
+
+#define LAYOUT LAYOUT_PLANAR8
+#define OUTPUT YUV2RGB_RGB24
+DEFINE_ROW(scalar_planar8_rgb24, , row_scalar, 0, width)
+#if HAVE_X86_SIMD
+DEFINE_ROW(sse41_planar8_rgb24, __attribute__((target("sse4.1"))), row_sse41, width)
+DEFINE_ROW(avx2_planar8_rgb24, __attribute__((target("avx2"))), row_avx2, width)
+#endif
+#undef OUTPUT
+#define OUTPUT YUV2RGB_ARGB
+DEFINE_ROW(scalar_planar8_argb, , row_scalar, 0, width)
+#if HAVE_X86_SIMD
+DEFINE_ROW(sse41_planar8_argb, __attribute__((target("sse4.1"))), row_sse41, width)
+DEFINE_ROW(avx2_planar8_argb, __attribute__((target("avx2"))), row_avx2, width)
+#endif
+#undef OUTPUT
+#undef LAYOUT
+
+#define LAYOUT LAYOUT_NV12
+#define OUTPUT YUV2RGB_RGB24
+DEFINE_ROW(scalar_nv12_rgb24, , row_scalar, 0, width)
+#if HAVE_X86_SIMD
+DEFINE_ROW(sse41_nv12_rgb24, __attribute__((target("sse4.1"))), row_sse41, width)
+DEFINE_ROW(avx2_nv12_rgb24, __attribute__((target("avx2"))), row_avx2, width)
+#endif
+#undef OUTPUT
+#define OUTPUT YUV2RGB_ARGB
+DEFINE_ROW(scalar_nv12_argb, , row_scalar, 0, width)
+#if HAVE_X86_SIMD
+DEFINE_ROW(sse41_nv12_argb, __attribute__((target("sse4.1"))), row_sse41, width)
+DEFINE_ROW(avx2_nv12_argb, __attribute__((target("avx2"))), row_avx2, width)
+#endif
+#undef OUTPUT
+#undef LAYOUT
+
+#define LAYOUT LAYOUT_PLANAR16
+#define OUTPUT YUV2RGB_RGB24
+DEFINE_ROW(scalar_planar16_rgb24, , row_scalar, 0, width)
+#if HAVE_X86_SIMD
+DEFINE_ROW(sse41_planar16_rgb24, __attribute__((target("sse4.1"))), row_sse41, width)
+DEFINE_ROW(avx2_planar16_rgb24, __attribute__((target("avx2"))), row_avx2, width)
+#endif
+#undef OUTPUT
+#define OUTPUT YUV2RGB_ARGB
+DEFINE_ROW(scalar_planar16_argb, , row_scalar, 0, width)
+#if HAVE_X86_SIMD
+DEFINE_ROW(sse41_planar16_argb, __attribute__((target("sse4.1"))), row_sse41, width)
+DEFINE_ROW(avx2_planar16_argb, __attribute__((target("avx2"))), row_avx2, width)
+#endif
+#undef OUTPUT
+#undef LAYOUT
+
+#if HAVE_X86_SIMD
+#define SIMD_ROWS(SIMD, LAYOUT_NAME) { SIMD ## _ ## LAYOUT_NAME ## _rgb24, SIMD ## _ ## LAYOUT_NAME ## _argb }
+#else
+#define SIMD_ROWS(SIMD, LAYOUT_NAME) { scalar_ ## LAYOUT_NAME ## _rgb24, scalar_ ## LAYOUT_NAME ## _argb }
+#endif
+
+static const Yuv2RgbRow rows[3][NLAYOUTS][2] = {
+    [YUV2RGB_SCALAR] = {
+        [LAYOUT_PLANAR8] = { scalar_planar8_rgb24, scalar_planar8_argb },
+        [LAYOUT_NV12] = { scalar_nv12_rgb24, scalar_nv12_argb },
+        [LAYOUT_PLANAR16] = { scalar_planar16_rgb24, scalar_planar16_argb },
+    },
+    [YUV2RGB_SSE41] = {
+        [LAYOUT_PLANAR8] = SIMD_ROWS(sse41, planar8),
+        [LAYOUT_NV12] = SIMD_ROWS(sse41, nv12),
+        [LAYOUT_PLANAR16] = SIMD_ROWS(sse41, planar16),
+    },
+    [YUV2RGB_AVX2] = {
+        [LAYOUT_PLANAR8] = SIMD_ROWS(avx2, planar8),
+        [LAYOUT_NV12] = SIMD_ROWS(avx2, nv12),
+        [LAYOUT_PLANAR16] = SIMD_ROWS(avx2, planar16),
+    },
+};
+
+static enum Yuv2RgbSimd best_simd(void) {
+    enum Yuv2RgbSimd simd = YUV2RGB_SCALAR;
+#if HAVE_X86_SIMD
+    if (SDL_HasAVX2()) simd = YUV2RGB_AVX2;
+    else if (SDL_HasSSE41()) simd = YUV2RGB_SSE41;
+#endif
+    return MIN(simd, simd_limit);
+}
+
+bool yuv2rgb_supported(enum AVPixelFormat pix_fmt) {
+    switch (pix_fmt) {
+        case AV_PIX_FMT_YUV420P:
+        case AV_PIX_FMT_YUVJ420P:
+        case AV_PIX_FMT_YUV422P:
+        case AV_PIX_FMT_YUVJ422P:
+        case AV_PIX_FMT_NV12:
+        case AV_PIX_FMT_YUV420P10LE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+struct Yuv2Rgb make_yuv2rgb(
+    enum AVPixelFormat pix_fmt, enum AVColorSpace colorspace,
+    enum AVColorRange range, int height, enum Yuv2RgbOutput output
+) {
+    struct Yuv2Rgb conv = { .chroma_shift_h = 1, .interleaved = false };
+    enum ChromaLayout layout = LAYOUT_PLANAR8;
+    int depth = 8;
+
+    switch (pix_fmt) {
+        case AV_PIX_FMT_YUVJ420P:
+            range = AVCOL_RANGE_JPEG;
+            break;
+        case AV_PIX_FMT_YUVJ422P:
+            range = AVCOL_RANGE_JPEG;
+            /* fallthrough */
+        case AV_PIX_FMT_YUV422P:
+            conv.chroma_shift_h = 0;
+            break;
+        case AV_PIX_FMT_NV12:
+            layout = LAYOUT_NV12;
+            conv.interleaved = true;
+            break;
+        case AV_PIX_FMT_YUV420P10LE:
+            layout = LAYOUT_PLANAR16;
+            depth = 10;
+            break;
+        default:
+            break;
+    }
+
+    if (colorspace == AVCOL_SPC_UNSPECIFIED)
+        colorspace = height >= 720 ? AVCOL_SPC_BT709 : AVCOL_SPC_SMPTE170M;
+
+    /* luma weights of red and blue */
+    double kr, kb;
+    switch (colorspace) {
+        case AVCOL_SPC_BT709:
+            kr = 0.2126; kb = 0.0722;
+            break;
+        case AVCOL_SPC_BT2020_NCL:
+        case AVCOL_SPC_BT2020_CL:
+            kr = 0.2627; kb = 0.0593;
+            break;
+        default:
+            kr = 0.299; kb = 0.114;
+            break;
+    }
+    double kg = 1.0 - kr - kb;
+
+    double y_scale = 1.0, c_scale = 1.0;
+    int y_off = 0;
+    if (range != AVCOL_RANGE_JPEG) {
+        y_scale = 255.0 / 219.0;
+        c_scale = 255.0 / 224.0;
+        y_off = 16;
+    }
+
+    /* higher bit depths use the same coefficients and shift further */
+    double one = 1 << COEFF_BITS;
+    conv.coeffs = (struct YuvCoeffs) {
+        .y_off = y_off << (depth - 8),
+        .c_off = 128 << (depth - 8),
+        .cy = lrint(y_scale * one),
+        .crv = lrint(2.0 * (1.0 - kr) * c_scale * one),
+        .cgu = lrint(2.0 * kb * (1.0 - kb) / kg * c_scale * one),
+        .cgv = lrint(2.0 * kr * (1.0 - kr) / kg * c_scale * one),
+        .cbu = lrint(2.0 * (1.0 - kb) * c_scale * one),
+        .shift = COEFF_BITS + depth - 8
+    };
+
+    conv.row = rows[best_simd()][layout][output];
+    return conv;
+}
+
+void yuv2rgb_convert_rows(
+    const struct Yuv2Rgb * conv, const AVFrame * frame,
+    uint8_t * dst, int pitch, int y0, int y1
+) {
+    for (int y = y0; y < y1; y++) {
+        int cy = y >> conv->chroma_shift_h;
+        conv->row(
+            frame->data[0] + y * frame->linesize[0],
+            frame->data[1] + cy * frame->linesize[1],
+            conv->interleaved ? NULL : frame->data[2] + cy * frame->linesize[2],
+            dst + y * pitch,
+            frame->width,
+            &conv->coeffs
+        );
+    }
+}
+
+void yuv2rgb_convert(
+    const struct Yuv2Rgb * conv, const AVFrame * frame, uint8_t * dst, int pitch
+) {
+    yuv2rgb_convert_rows(conv, frame, dst, pitch, 0, frame->height);
+}
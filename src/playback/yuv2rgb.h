@@ -0,0 +1,59 @@
+#pragma once
+#include "../av.h"
+
+/* yuv -> rgb conversion for the formats decoders commonly output,
+ * with SSE4.1 and AVX2 kernels picked at runtime and a scalar fallback.
+ * unlike swscale with default settings, honours the frame's
+ * colour matrix (bt.601/709/2020) and range. */
+
+enum Yuv2RgbOutput {
+    YUV2RGB_RGB24, /* SDL_PIXELFORMAT_RGB24 */
+    YUV2RGB_ARGB /* SDL_PIXELFORMAT_ARGB8888 */
+};
+
+enum Yuv2RgbSimd {
+    YUV2RGB_SCALAR,
+    YUV2RGB_SSE41,
+    YUV2RGB_AVX2
+};
+
+/* fixed point coefficients, see make_yuv2rgb */
+struct YuvCoeffs {
+    int32_t y_off, c_off;
+    int32_t cy, crv, cgu, cgv, cbu;
+    int32_t shift;
+};
+
+typedef void (* Yuv2RgbRow)(
+    const uint8_t * y, const uint8_t * u, const uint8_t * v,
+    uint8_t * dst, int width, const struct YuvCoeffs * coeffs
+);
+
+struct Yuv2Rgb {
+    struct YuvCoeffs coeffs;
+    Yuv2RgbRow row;
+    int chroma_shift_h; /* log2 of vertical chroma subsampling */
+    bool interleaved; /* chroma is one UVUV... plane */
+};
+
+bool yuv2rgb_supported(enum AVPixelFormat pix_fmt);
+
+/* colorspace/range may be unspecified, in which case they are guessed
+ * from the height like most players do. pix_fmt must be supported */
+struct Yuv2Rgb make_yuv2rgb(
+    enum AVPixelFormat pix_fmt, enum AVColorSpace colorspace,
+    enum AVColorRange range, int height, enum Yuv2RgbOutput output
+);
+
+/* converts rows [y0, y1) of frame into dst, which has pitch bytes per row */
+void yuv2rgb_convert_rows(
+    const struct Yuv2Rgb * conv, const AVFrame * frame,
+    uint8_t * dst, int pitch, int y0, int y1
+);
+
+void yuv2rgb_convert(
+    const struct Yuv2Rgb * conv, const AVFrame * frame, uint8_t * dst, int pitch
+);
+
+/* make_yuv2rgb won't pick kernels above this. for benchmarking */
+void yuv2rgb_limit_simd(enum Yuv2RgbSimd max);
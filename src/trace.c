@@ -0,0 +1,176 @@
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define TRACE_BUFFER_EVENTS (1 << 16) /* per thread, a power of two */
+#define TRACE_MAX_THREADS 64
+
+struct TraceEvent {
+    const char * name;
+    int64_t ts; /* ns */
+    int64_t value; /* duration in ns of a span, or a counter's value */
+    char type; /* 'X' span or 'C' counter, as chrome calls them */
+};
+
+/* written only by its own thread. count tells readers how far it got */
+struct TraceBuffer {
+    struct TraceEvent * events;
+    atomic_size_t count; /* ever recorded, only the last TRACE_BUFFER_EVENTS are kept */
+    const char * name;
+    int tid;
+};
+
+atomic_bool trace_on = false;
+
+static struct TraceBuffer * _Atomic buffers[TRACE_MAX_THREADS];
+static atomic_int nbuffers = 0;
+static _Atomic int64_t trace_start = 0;
+
+static _Thread_local struct TraceBuffer * local_buffer;
+static _Thread_local const char * local_name;
+static _Thread_local bool no_buffer; /* ran out of TRACE_MAX_THREADS */
+
+static int64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+void trace_set_enabled(bool on) {
+    int64_t zero = 0;
+    if (on) atomic_compare_exchange_strong(&trace_start, &zero, now_ns());
+    atomic_store(&trace_on, on);
+}
+
+void trace_thread_name(const char * name) {
+    local_name = name;
+    if (local_buffer) local_buffer->name = name;
+}
+
+static struct TraceBuffer * thread_buffer(void) {
+    if (local_buffer || no_buffer) return local_buffer;
+
+    int idx = atomic_fetch_add(&nbuffers, 1);
+    if (idx >= TRACE_MAX_THREADS) {
+        no_buffer = true;
+        return NULL;
+    }
+
+    struct TraceBuffer * buf = malloc(sizeof(struct TraceBuffer));
+    buf->events = malloc(TRACE_BUFFER_EVENTS * sizeof(struct TraceEvent));
+    atomic_init(&buf->count, 0);
+    buf->name = local_name;
+    buf->tid = idx + 1;
+    atomic_store(&buffers[idx], buf);
+    return local_buffer = buf;
+}
+
+static void record(char type, const char * name, int64_t ts, int64_t value) {
+    struct TraceBuffer * buf = thread_buffer();
+    if (buf == NULL) return;
+
+    size_t n = atomic_load_explicit(&buf->count, memory_order_relaxed);
+    buf->events[n & (TRACE_BUFFER_EVENTS - 1)] = (struct TraceEvent) {
+        .name = name,
+        .ts = ts,
+        .value = value,
+        .type = type
+    };
+    atomic_store_explicit(&buf->count, n + 1, memory_order_release);
+}
+
+struct TraceSpan trace_span_begin(const char * name) {
+    if (!atomic_load_explicit(&trace_on, memory_order_relaxed))
+        return (struct TraceSpan) { name, -1 };
+    return (struct TraceSpan) { name, now_ns() };
+}
+
+void trace_span_end(struct TraceSpan * span) {
+    if (span->start < 0) return;
+    record('X', span->name, span->start, now_ns() - span->start);
+}
+
+void trace_counter(const char * name, int64_t value) {
+    if (!atomic_load_explicit(&trace_on, memory_order_relaxed)) return;
+    record('C', name, now_ns(), value);
+}
+
+size_t trace_durations(const char * name, double * durations, size_t max) {
+    size_t count = 0;
+
+    int nbufs = atomic_load(&nbuffers);
+    if (nbufs > TRACE_MAX_THREADS) nbufs = TRACE_MAX_THREADS;
+    for (int i = 0; i < nbufs; i++) {
+        struct TraceBuffer * buf = atomic_load(&buffers[i]);
+        if (buf == NULL) continue;
+
+        size_t end = atomic_load_explicit(&buf->count, memory_order_acquire);
+        size_t first = end > TRACE_BUFFER_EVENTS ? end - TRACE_BUFFER_EVENTS : 0;
+        for (size_t j = first; j < end; j++) {
+            const struct TraceEvent * ev = &buf->events[j & (TRACE_BUFFER_EVENTS - 1)];
+            if ((ev->type != 'X') || strcmp(ev->name, name)) continue;
+            if (count < max) durations[count] = ev->value / 1e9;
+            count++;
+        }
+    }
+    return count;
+}
+
+int trace_dump(const char * path) {
+    FILE * file = fopen(path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "failed to write trace to `%s`\n", path);
+        return -1;
+    }
+
+    int64_t start = atomic_load(&trace_start);
+    const char * sep = "";
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+    int nbufs = atomic_load(&nbuffers);
+    if (nbufs > TRACE_MAX_THREADS) nbufs = TRACE_MAX_THREADS;
+    for (int i = 0; i < nbufs; i++) {
+        struct TraceBuffer * buf = atomic_load(&buffers[i]);
+        if (buf == NULL) continue;
+
+        if (buf->name) {
+            fprintf(file,
+                "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":%d,"
+                "\"args\":{\"name\":\"%s\"}}",
+                sep, buf->tid, buf->name
+            );
+            sep = ",\n";
+        }
+
+        size_t end = atomic_load_explicit(&buf->count, memory_order_acquire);
+        size_t first = end > TRACE_BUFFER_EVENTS ? end - TRACE_BUFFER_EVENTS : 0;
+        for (size_t j = first; j < end; j++) {
+            const struct TraceEvent * ev = &buf->events[j & (TRACE_BUFFER_EVENTS - 1)];
+
+            double ts = (ev->ts - start) / 1000.0;
+            if (ev->type == 'X')
+                fprintf(file,
+                    "%s{\"ph\":\"X\",\"name\":\"%s\",\"pid\":1,\"tid\":%d,"
+                    "\"ts\":%.3f,\"dur\":%.3f}",
+                    sep, ev->name, buf->tid, ts, ev->value / 1000.0
+                );
+            else
+                fprintf(file,
+                    "%s{\"ph\":\"C\",\"name\":\"%s\",\"pid\":1,\"tid\":%d,"
+                    "\"ts\":%.3f,\"args\":{\"value\":%lld}}",
+                    sep, ev->name, buf->tid, ts, (long long) ev->value
+                );
+            sep = ",\n";
+        }
+    }
+
+    fprintf(file, "\n]}\n");
+    int ret = ferror(file);
+    if (fclose(file) || ret) {
+        fprintf(stderr, "failed to write trace to `%s`\n", path);
+        return -1;
+    }
+    return 0;
+}
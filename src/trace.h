@@ -0,0 +1,47 @@
+#pragma once
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* a record of what every thread was doing when, written out as chrome
+ * trace json (open it in chrome://tracing or ui.perfetto.dev).
+ * each thread records into its own buffer without taking any lock, and
+ * once that's full its oldest events are overwritten. off by default;
+ * while off, a span or counter costs one atomic load.
+ * names must be string literals, they're stored by pointer */
+
+extern atomic_bool trace_on;
+
+void trace_set_enabled(bool on);
+
+/* names the calling thread in the trace */
+void trace_thread_name(const char * name);
+
+struct TraceSpan {
+    const char * name;
+    int64_t start; /* -1 if tracing was off */
+};
+
+struct TraceSpan trace_span_begin(const char * name);
+void trace_span_end(struct TraceSpan * span);
+
+/* times the rest of the enclosing block. spans inside it show up nested */
+#define TRACE_SCOPE(NAME) TRACE_SCOPE_AT(NAME, __LINE__)
+#define TRACE_SCOPE_AT(NAME, LINE) TRACE_SCOPE_AT_(NAME, LINE)
+#define TRACE_SCOPE_AT_(NAME, LINE) \
+    __attribute__((cleanup(trace_span_end))) \
+    struct TraceSpan trace_span_ ## LINE = trace_span_begin(NAME)
+
+/* a value over time, e.g. how full a queue is */
+void trace_counter(const char * name, int64_t value);
+
+/* copies how long, in seconds, each span called name that's still in the
+ * buffers took, from every thread. returns how many there were, which can
+ * be more than max. turn tracing off first, as for trace_dump */
+size_t trace_durations(const char * name, double * durations, size_t max);
+
+/* writes out everything recorded so far. threads still recording may
+ * overwrite an event or two while this runs, so turn tracing off first.
+ * returns 0 on success */
+int trace_dump(const char * path);
@@ -0,0 +1,86 @@
+/* throughput of the yuv2rgb kernels against swscale (SWS_POINT, which is
+ * what playback used before) on a 4k yuv420p frame.
+ * build with `make bench_yuv2rgb` */
+#include "../src/playback/yuv2rgb.h"
+#include <time.h>
+
+#define WIDTH 3840
+#define HEIGHT 2160
+#define ITERATIONS 60
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void report(const char * name, double start) {
+    double fps = ITERATIONS / (now() - start);
+    printf("%-24s %8.1f fps\n", name, fps);
+}
+
+static void bench_sws(AVFrame * frame, enum AVPixelFormat dst_fmt, uint8_t * dst, int pitch) {
+    struct SwsContext * sws = sws_getContext(
+        WIDTH, HEIGHT, frame->format, WIDTH, HEIGHT, dst_fmt,
+        SWS_POINT, NULL, NULL, NULL
+    );
+
+    double start = now();
+    for (int i = 0; i < ITERATIONS; i++) {
+        sws_scale(
+            sws, (const uint8_t * const *) frame->data, frame->linesize,
+            0, HEIGHT, (uint8_t * const[]) { dst }, (const int[]) { pitch }
+        );
+    }
+    report(dst_fmt == AV_PIX_FMT_RGB24 ? "swscale rgb24" : "swscale bgra", start);
+
+    sws_freeContext(sws);
+}
+
+static void bench_kernels(AVFrame * frame, enum Yuv2RgbOutput output, uint8_t * dst, int pitch) {
+    const char * names[] = { "scalar", "sse4.1", "avx2" };
+
+    for (enum Yuv2RgbSimd simd = YUV2RGB_SCALAR; simd <= YUV2RGB_AVX2; simd++) {
+        yuv2rgb_limit_simd(simd);
+        struct Yuv2Rgb conv = make_yuv2rgb(
+            frame->format, AVCOL_SPC_BT709, AVCOL_RANGE_MPEG, HEIGHT, output
+        );
+
+        double start = now();
+        for (int i = 0; i < ITERATIONS; i++)
+            yuv2rgb_convert(&conv, frame, dst, pitch);
+
+        char name[32];
+        snprintf(name, sizeof(name), "yuv2rgb %s %s",
+            names[simd], output == YUV2RGB_RGB24 ? "rgb24" : "argb");
+        report(name, start);
+    }
+}
+
+int main(void) {
+    AVFrame * frame = av_frame_alloc();
+    frame->format = AV_PIX_FMT_YUV420P;
+    frame->width = WIDTH;
+    frame->height = HEIGHT;
+    av_frame_get_buffer(frame, 0);
+
+    /* the content doesn't matter to any of the converters */
+    srand(1);
+    for (int p = 0; p < 3; p++) {
+        int h = p ? HEIGHT / 2 : HEIGHT;
+        for (int i = 0; i < frame->linesize[p] * h; i++)
+            frame->data[p][i] = rand();
+    }
+
+    uint8_t * dst = malloc(WIDTH * HEIGHT * 4);
+
+    printf("%dx%d yuv420p, %d frames each\n", WIDTH, HEIGHT, ITERATIONS);
+    bench_sws(frame, AV_PIX_FMT_RGB24, dst, WIDTH * 3);
+    bench_kernels(frame, YUV2RGB_RGB24, dst, WIDTH * 3);
+    bench_sws(frame, AV_PIX_FMT_BGRA, dst, WIDTH * 4);
+    bench_kernels(frame, YUV2RGB_ARGB, dst, WIDTH * 4);
+
+    free(dst);
+    av_frame_free(&frame);
+    return 0;
+}
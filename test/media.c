@@ -0,0 +1,212 @@
+#include "media.h"
+
+#define AUDIO_RATE 44100
+#define TONE_HZ 440.0
+
+struct Encoder {
+    AVCodecContext * ctx;
+    AVStream * stream;
+    AVFrame * frame;
+    AVPacket * pkt;
+    int64_t next_pts; /* in ctx->time_base */
+};
+
+static void close_encoder(struct Encoder * enc) {
+    avcodec_free_context(&enc->ctx);
+    av_frame_free(&enc->frame);
+    av_packet_free(&enc->pkt);
+}
+
+/* opens enc->ctx, which the caller has filled in, and adds its stream */
+static int open_encoder(struct Encoder * enc, AVFormatContext * format_ctx) {
+    if (format_ctx->oformat->flags & AVFMT_GLOBALHEADER)
+        enc->ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    if (avcodec_open2(enc->ctx, NULL, NULL)) return -1;
+
+    enc->stream = avformat_new_stream(format_ctx, NULL);
+    if (enc->stream == NULL) return -1;
+    enc->stream->time_base = enc->ctx->time_base;
+    if (avcodec_parameters_from_context(enc->stream->codecpar, enc->ctx)) return -1;
+
+    enc->frame = av_frame_alloc();
+    enc->pkt = av_packet_alloc();
+    return 0;
+}
+
+/* sends frame (NULL to flush) and muxes whatever comes out */
+static int encode(struct Encoder * enc, AVFormatContext * format_ctx, AVFrame * frame) {
+    int ret = avcodec_send_frame(enc->ctx, frame);
+    if (ret < 0) return ret;
+
+    while ((ret = avcodec_receive_packet(enc->ctx, enc->pkt)) == 0) {
+        av_packet_rescale_ts(enc->pkt, enc->ctx->time_base, enc->stream->time_base);
+        enc->pkt->stream_index = enc->stream->index;
+        if ((ret = av_interleaved_write_frame(format_ctx, enc->pkt)) < 0) return ret;
+    }
+    return ((ret == AVERROR(EAGAIN)) || (ret == AVERROR_EOF)) ? 0 : ret;
+}
+
+static bool is_420(enum AVPixelFormat fmt) {
+    return (fmt == AV_PIX_FMT_YUV420P) || (fmt == AV_PIX_FMT_YUVJ420P);
+}
+
+static int open_video(struct Encoder * enc, AVFormatContext * format_ctx, const struct ClipSpec * spec) {
+    const AVCodec * codec = avcodec_find_encoder_by_name(spec->codec);
+    if (codec == NULL) return 1;
+
+    enum AVPixelFormat pix_fmt = AV_PIX_FMT_NONE;
+    for (const enum AVPixelFormat * fmt = codec->pix_fmts; fmt && (*fmt != AV_PIX_FMT_NONE); fmt++) {
+        if (is_420(*fmt)) {
+            pix_fmt = *fmt;
+            break;
+        }
+    }
+    if (pix_fmt == AV_PIX_FMT_NONE) return 1;
+
+    enc->ctx = avcodec_alloc_context3(codec);
+    enc->ctx->width = spec->width;
+    enc->ctx->height = spec->height;
+    enc->ctx->pix_fmt = pix_fmt;
+    enc->ctx->time_base = (AVRational) { 1, spec->fps };
+    enc->ctx->framerate = (AVRational) { spec->fps, 1 };
+    enc->ctx->gop_size = spec->gop;
+    enc->ctx->max_b_frames = spec->b_frames;
+    /* plenty, so the barcode comes through clean */
+    enc->ctx->bit_rate = (int64_t) spec->width * spec->height * spec->fps * 2;
+
+    if (open_encoder(enc, format_ctx)) return -1;
+
+    enc->frame->format = pix_fmt;
+    enc->frame->width = spec->width;
+    enc->frame->height = spec->height;
+    return av_frame_get_buffer(enc->frame, 0) ? -1 : 0;
+}
+
+static int open_audio(struct Encoder * enc, AVFormatContext * format_ctx) {
+    const AVCodec * codec = avcodec_find_encoder_by_name("mp2");
+    if (codec == NULL) codec = avcodec_find_encoder_by_name("aac");
+    if (codec == NULL) return 1;
+
+    enum AVSampleFormat sample_fmt = codec->sample_fmts ? codec->sample_fmts[0] : AV_SAMPLE_FMT_NONE;
+    if ((sample_fmt != AV_SAMPLE_FMT_S16) && (sample_fmt != AV_SAMPLE_FMT_FLTP)) return 1;
+
+    enc->ctx = avcodec_alloc_context3(codec);
+    enc->ctx->sample_fmt = sample_fmt;
+    enc->ctx->sample_rate = AUDIO_RATE;
+    enc->ctx->ch_layout = (AVChannelLayout) AV_CHANNEL_LAYOUT_STEREO;
+    enc->ctx->time_base = (AVRational) { 1, AUDIO_RATE };
+    enc->ctx->bit_rate = 128000;
+
+    if (open_encoder(enc, format_ctx)) return -1;
+
+    enc->frame->format = sample_fmt;
+    enc->frame->sample_rate = AUDIO_RATE;
+    enc->frame->nb_samples = enc->ctx->frame_size ? enc->ctx->frame_size : 1024;
+    av_channel_layout_copy(&enc->frame->ch_layout, &enc->ctx->ch_layout);
+    return av_frame_get_buffer(enc->frame, 0) ? -1 : 0;
+}
+
+/* the barcode across the top quarter, a moving pattern below it
+ * so there's something to encode */
+static void draw_video_frame(AVFrame * frame, int n) {
+    int w = frame->width, h = frame->height;
+    int bar_h = h / 4;
+    bool full_range = frame->format == AV_PIX_FMT_YUVJ420P;
+    uint8_t black = full_range ? 0 : 16, white = full_range ? 255 : 235;
+
+    for (int y = 0; y < h; y++) {
+        uint8_t * row = frame->data[0] + y * frame->linesize[0];
+        for (int x = 0; x < w; x++) {
+            if (y < bar_h) {
+                int bit = x * BARCODE_BITS / w;
+                row[x] = (n >> bit) & 1 ? white : black;
+            } else {
+                row[x] = 64 + (((x + n * 4) ^ y) & 127);
+            }
+        }
+    }
+    for (int p = 1; p < 3; p++) {
+        for (int y = 0; y < h / 2; y++) {
+            uint8_t * row = frame->data[p] + y * frame->linesize[p];
+            for (int x = 0; x < w / 2; x++)
+                row[x] = y < bar_h / 2 ? 128 : (uint8_t) (x + y + n * (p + 1));
+        }
+    }
+}
+
+static void draw_audio_frame(AVFrame * frame, int64_t first_sample) {
+    for (int i = 0; i < frame->nb_samples; i++) {
+        double v = 0.25 * sin(2 * M_PI * TONE_HZ * (first_sample + i) / AUDIO_RATE);
+        if (frame->format == AV_SAMPLE_FMT_S16) {
+            int16_t * samples = (int16_t *) frame->data[0];
+            samples[2 * i] = samples[2 * i + 1] = v * INT16_MAX;
+        } else {
+            ((float *) frame->data[0])[i] = ((float *) frame->data[1])[i] = v;
+        }
+    }
+}
+
+int generate_clip(const struct ClipSpec * spec, const char * dir, char * path, size_t path_len) {
+    snprintf(path, path_len, "%s/%s.mkv", dir, spec->name);
+
+    AVFormatContext * format_ctx = NULL;
+    if (avformat_alloc_output_context2(&format_ctx, NULL, "matroska", path) < 0)
+        return -1;
+
+    struct Encoder video = {0}, audio = {0};
+    int ret = open_video(&video, format_ctx, spec);
+    if (!ret && spec->audio) ret = open_audio(&audio, format_ctx);
+    if (ret) goto done;
+
+    ret = -1;
+    if (avio_open(&format_ctx->pb, path, AVIO_FLAG_WRITE) < 0) goto done;
+    if (avformat_write_header(format_ctx, NULL) < 0) goto close;
+
+    double duration = (double) spec->frames / spec->fps;
+    for (int n = 0; n < spec->frames; n++) {
+        if (av_frame_make_writable(video.frame)) goto close;
+        draw_video_frame(video.frame, n);
+        video.frame->pts = n;
+        if (encode(&video, format_ctx, video.frame)) goto close;
+
+        /* keep the audio up with the video so the muxer interleaves them */
+        while (audio.ctx && (audio.next_pts < (double) (n + 1) / spec->fps * AUDIO_RATE) &&
+               (audio.next_pts < duration * AUDIO_RATE)) {
+            if (av_frame_make_writable(audio.frame)) goto close;
+            draw_audio_frame(audio.frame, audio.next_pts);
+            audio.frame->pts = audio.next_pts;
+            audio.next_pts += audio.frame->nb_samples;
+            if (encode(&audio, format_ctx, audio.frame)) goto close;
+        }
+    }
+    if (encode(&video, format_ctx, NULL)) goto close;
+    if (audio.ctx && encode(&audio, format_ctx, NULL)) goto close;
+
+    if (av_write_trailer(format_ctx) == 0) ret = 0;
+
+    close:
+    avio_closep(&format_ctx->pb);
+    done:
+    close_encoder(&video);
+    close_encoder(&audio);
+    avformat_free_context(format_ctx);
+    if (ret < 0) fprintf(stderr, "failed to write `%s`\n", path);
+    return ret;
+}
+
+int64_t clip_frame_pts(const struct ClipSpec * spec, AVRational time_base, int n) {
+    return av_rescale_q(n, (AVRational) { 1, spec->fps }, time_base);
+}
+
+int read_barcode(const uint8_t * pixels, int pitch, int width, int height) {
+    int y = height / 8; /* the middle of the barcode */
+    const uint32_t * row = (const uint32_t *) (pixels + y * pitch);
+
+    int n = 0;
+    for (int bit = 0; bit < BARCODE_BITS; bit++) {
+        int x = (2 * bit + 1) * width / (2 * BARCODE_BITS);
+        uint8_t green = row[x] >> 8;
+        if (green > 128) n |= 1 << bit;
+    }
+    return n;
+}
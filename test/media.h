@@ -0,0 +1,29 @@
+/* synthetic clips for the tests, encoded with whatever libavcodec has.
+ * every frame carries its own number as a barcode along the top, so
+ * what's on screen can be checked independently of timestamps */
+#pragma once
+#include "../src/av.h"
+
+#define BARCODE_BITS 16
+
+struct ClipSpec {
+    const char * name; /* file name without extension */
+    const char * codec; /* encoder name */
+    int width, height; /* width at least BARCODE_BITS * 8 */
+    int fps;
+    int gop; /* frames between keyframes */
+    int b_frames; /* so decode order differs from presentation order */
+    int frames;
+    bool audio; /* a tone, so there's an audio clock to follow */
+};
+
+/* writes spec to dir/name.mkv and stores the path in path.
+ * returns 0 on success, 1 if the encoder isn't available, and
+ * -1 on any other failure */
+int generate_clip(const struct ClipSpec * spec, const char * dir, char * path, size_t path_len);
+
+/* the presentation timestamp of frame n, in the clip's video time base */
+int64_t clip_frame_pts(const struct ClipSpec * spec, AVRational time_base, int n);
+
+/* reads the frame number back from ARGB8888 pixels of a whole frame */
+int read_barcode(const uint8_t * pixels, int pitch, int width, int height);
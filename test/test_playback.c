@@ -0,0 +1,292 @@
+/* end-to-end checks of the playback pipeline on synthetic clips: stepping
+ * through every frame in order (b-frames decode out of order), frame
+ * accurate seeks, a/v drift while playing, and a throughput floor.
+ * the clips are written to the directory given and left there for
+ * `make bench`. run with `make test` */
+#include "media.h"
+#include "../src/playback/playback.h"
+#include "../src/playback/utils.h"
+#include <inttypes.h>
+#include <stdarg.h>
+#include <sys/stat.h>
+
+bool quit = false; /* the pipeline's threads look at this, av.c has the real one */
+
+#define FRAME_TIMEOUT 10.0 /* seconds to wait for a frame before failing */
+#define SEEKS 16
+#define PLAY_SECONDS 2.0
+#define MAX_AV_DRIFT 0.1 /* seconds, after PLAY_SECONDS of playing */
+#define MIN_SPEEDUP 2.0 /* decoding as fast as possible beats real time by this much */
+
+static const struct ClipSpec clips[] = {
+    /* name                  codec         width height fps gop b  frames audio */
+    { "mpeg4-gop12-audio",   "mpeg4",      320,  240,   25, 12, 0, 75,    true },
+    { "mpeg4-bframes",       "mpeg4",      640,  360,   30, 30, 2, 90,    false },
+    { "mpeg2-720p50-audio",  "mpeg2video", 1280, 720,   50, 15, 2, 100,   true },
+    { "mjpeg-intra",         "mjpeg",      320,  240,   24, 1,  0, 48,    false },
+    { "h264-bframes",        "libx264",    640,  360,   60, 60, 3, 120,   false },
+};
+#define NCLIPS (int) (sizeof(clips) / sizeof(clips[0]))
+
+static int failures = 0;
+
+static void report(bool ok, const char * fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    printf("  %s ", ok ? "ok  " : "FAIL");
+    vprintf(fmt, args);
+    printf("\n");
+    va_end(args);
+    if (!ok) failures++;
+}
+
+static void sleep_ms(int ms) {
+    nanosleep(&(struct timespec) { ms / 1000, (ms % 1000) * 1000000L }, NULL);
+}
+
+struct Player {
+    const struct ClipSpec * spec;
+    struct PlaybackCtx * pb_ctx;
+    SDL_Window * window;
+    SDL_Renderer * renderer;
+    SDL_Texture * tex;
+    uint8_t * pixels; /* what was last drawn, ARGB8888 */
+    int64_t first_pts; /* of frame 0 */
+};
+
+static void close_player(struct Player * p) {
+    destroy_playback_ctx(p->pb_ctx);
+    if (p->renderer) SDL_DestroyRenderer(p->renderer);
+    if (p->window) SDL_DestroyWindow(p->window);
+    free(p->pixels);
+    free(p);
+}
+
+/* the window is the size of the video, so frames are drawn 1:1 */
+static struct Player * open_player(const struct ClipSpec * spec, char * path, bool audio) {
+    struct PlaybackOptions opts = { .no_audio = !audio };
+    struct PlaybackCtx * pb_ctx = open_for_playback(path, &opts);
+    if (pb_ctx == NULL) return NULL;
+
+    struct Player * p = malloc(sizeof(struct Player));
+    *p = (struct Player) {
+        .spec = spec,
+        .pb_ctx = pb_ctx,
+        .window = SDL_CreateWindow("test", 0, 0, spec->width, spec->height, SDL_WINDOW_HIDDEN),
+        .pixels = malloc(spec->width * spec->height * 4),
+        .first_pts = pb_ctx->start_time
+    };
+    if (p->window) p->renderer = SDL_CreateRenderer(p->window, -1, SDL_RENDERER_SOFTWARE);
+    if (p->renderer) p->tex = create_video_texture(pb_ctx, p->renderer);
+    if (p->tex == NULL) {
+        close_player(p);
+        return NULL;
+    }
+    return p;
+}
+
+/* waits for get_frame to have a new frame, and returns its number
+ * from the barcode, or -1 on timeout */
+static int wait_frame(struct Player * p, int64_t * pts) {
+    double deadline = mono_now() + FRAME_TIMEOUT;
+    while (!get_frame(p->pb_ctx, p->tex, pts, NULL)) {
+        if (mono_now() > deadline) return -1;
+        sleep_ms(1);
+    }
+
+    SDL_RenderClear(p->renderer);
+    SDL_RenderCopy(p->renderer, p->tex, NULL, NULL);
+    SDL_RenderReadPixels(p->renderer, NULL, SDL_PIXELFORMAT_ARGB8888, p->pixels, p->spec->width * 4);
+    return read_barcode(p->pixels, p->spec->width * 4, p->spec->width, p->spec->height);
+}
+
+static int64_t frame_pts(struct Player * p, int n) {
+    return p->first_pts + clip_frame_pts(p->spec, p->pb_ctx->time_base, n);
+}
+
+/* advance_frame through the whole clip, then step_back a little way */
+static void test_stepping(struct Player * p) {
+    const struct ClipSpec * spec = p->spec;
+    int64_t pts;
+
+    seek(p->pb_ctx, p->pb_ctx->start_time);
+    int n = wait_frame(p, &pts);
+    p->first_pts = pts;
+
+    int shown = 0;
+    while (n == shown) {
+        if (pts != frame_pts(p, n)) break;
+        shown++;
+        if (shown == spec->frames) break;
+        advance_frame(p->pb_ctx);
+        n = wait_frame(p, &pts);
+    }
+    report(shown == spec->frames, "stepped through %d of %d frames in order%s",
+        shown, spec->frames, shown == spec->frames ? "" : ", then the wrong one");
+
+    /* nothing after the last frame */
+    struct PlaybackStats stats;
+    double deadline = mono_now() + FRAME_TIMEOUT;
+    do {
+        get_playback_stats(p->pb_ctx, &stats);
+        if (!stats.ended) sleep_ms(1);
+    } while (!stats.ended && (mono_now() < deadline));
+    report(stats.ended, "reached the end");
+
+    int steps = spec->frames > 8 ? 8 : spec->frames - 1;
+    int back = 0;
+    for (n = spec->frames - 1; back < steps; back++) {
+        step_back(p->pb_ctx);
+        if (wait_frame(p, &pts) != --n) break;
+    }
+    report(back == steps, "stepped back %d of %d frames in order", back, steps);
+}
+
+/* seeks to random frames, alternately to the start of the frame and
+ * partway through it. either way that frame has to be the one shown */
+static void test_seeking(struct Player * p) {
+    const struct ClipSpec * spec = p->spec;
+    int64_t period = frame_pts(p, 1) - frame_pts(p, 0);
+    int last = -1, good = 0;
+
+    srand(1);
+    for (int i = 0; i < SEEKS; i++) {
+        int target = rand() % spec->frames;
+        if (target == last) target = (target + 1) % spec->frames;
+        last = target;
+
+        int64_t ts = frame_pts(p, target) + (i % 2 ? period / 2 : 0);
+        seek(p->pb_ctx, ts);
+
+        int64_t pts = AV_NOPTS_VALUE;
+        int n = wait_frame(p, &pts);
+        if ((n != target) || (pts != frame_pts(p, target))) {
+            report(false, "seek to frame %d showed frame %d (pts %"PRId64", expected %"PRId64")",
+                target, n, pts, frame_pts(p, target));
+            return;
+        }
+        good++;
+    }
+    report(true, "%d seeks landed on the right frame", good);
+}
+
+/* plays like av.c does and checks the audio kept up with the clock */
+static void test_av_sync(struct Player * p) {
+    struct PlaybackCtx * pb_ctx = p->pb_ctx;
+    int64_t pts = 0, dur = 0;
+
+    seek(pb_ctx, pb_ctx->start_time);
+    if (wait_frame(p, &pts) < 0) {
+        report(false, "no first frame to play from");
+        return;
+    }
+    get_frame(pb_ctx, NULL, &pts, &dur);
+    int64_t next_pts = pts + dur;
+    int frames = 1;
+
+    set_paused(pb_ctx, false);
+    double end = mono_now() + PLAY_SECONDS;
+    while (mono_now() < end) {
+        int64_t ts = get_playback_time(pb_ctx);
+        if (get_frame(pb_ctx, NULL, &pts, &dur)) frames++;
+        if (ts >= next_pts) {
+            next_pts = pts + dur;
+            advance_to(pb_ctx, ts);
+        }
+        sleep_ms(1);
+    }
+    set_paused(pb_ctx, true);
+
+    struct PlaybackStats stats;
+    get_playback_stats(pb_ctx, &stats);
+    report(fabs(stats.av_drift) < MAX_AV_DRIFT,
+        "a/v drift %.1f ms after %.0f s (max %.1f ms, %d corrections, %d underruns)",
+        stats.av_drift * 1000, PLAY_SECONDS, stats.max_av_drift * 1000,
+        stats.clock_corrections, stats.audio_underruns);
+    report(frames >= PLAY_SECONDS * p->spec->fps / 2,
+        "showed %d frames playing for %.0f s", frames, PLAY_SECONDS);
+}
+
+/* steps through as fast as frames come, like --bench */
+static void test_throughput(struct Player * p) {
+    const struct ClipSpec * spec = p->spec;
+    int64_t pts;
+
+    double start = mono_now();
+    seek(p->pb_ctx, p->pb_ctx->start_time);
+    int frames = 0;
+    double deadline = start + FRAME_TIMEOUT;
+    while ((frames < spec->frames) && (mono_now() < deadline)) {
+        if (get_frame(p->pb_ctx, NULL, &pts, NULL)) {
+            frames++;
+            deadline = mono_now() + FRAME_TIMEOUT;
+            advance_frame(p->pb_ctx);
+        } else {
+            nanosleep(&(struct timespec) { 0, 50000 }, NULL);
+        }
+    }
+    double fps = frames / (mono_now() - start);
+    report((frames == spec->frames) && (fps >= MIN_SPEEDUP * spec->fps),
+        "%.1f fps, %.1fx real time (at least %.1fx)", fps, fps / spec->fps, MIN_SPEEDUP);
+}
+
+/* each test gets a fresh player, so none of them starts with a warm cache */
+static void run_test(const struct ClipSpec * spec, char * path, bool audio, void (* test)(struct Player *)) {
+    struct Player * p = open_player(spec, path, audio);
+    if (p == NULL) {
+        report(false, "couldn't open `%s`", path);
+        return;
+    }
+    test(p);
+    close_player(p);
+}
+
+static void test_clip(const struct ClipSpec * spec, char * path) {
+    run_test(spec, path, false, test_stepping);
+    run_test(spec, path, false, test_seeking);
+    if (spec->audio) run_test(spec, path, true, test_av_sync);
+    run_test(spec, path, false, test_throughput);
+}
+
+int main(int argc, char * argv[]) {
+    bool generate_only = (argc == 3) && !strcmp(argv[1], "--generate-only");
+    if ((argc != 2) && !generate_only) {
+        fprintf(stderr, "usage: %s [--generate-only] DIR\n", argv[0]);
+        return 2;
+    }
+    const char * dir = argv[argc - 1];
+    mkdir(dir, 0755);
+
+    av_log_set_level(AV_LOG_ERROR);
+    SDL_setenv("SDL_VIDEODRIVER", "dummy", 1);
+    SDL_setenv("SDL_AUDIODRIVER", "dummy", 1);
+    if (!generate_only && SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO)) {
+        fprintf(stderr, "failed to initialize SDL: %s\n", SDL_GetError());
+        return 2;
+    }
+
+    for (int i = 0; i < NCLIPS; i++) {
+        const struct ClipSpec * spec = &clips[i];
+        printf("%s: %s %dx%d, %d fps, gop %d, %d b-frames%s\n",
+            spec->name, spec->codec, spec->width, spec->height, spec->fps,
+            spec->gop, spec->b_frames, spec->audio ? ", audio" : "");
+
+        char path[1024];
+        int ret = generate_clip(spec, dir, path, sizeof(path));
+        if (ret > 0) {
+            printf("  skip no %s encoder\n", spec->codec);
+            continue;
+        }
+        if (ret < 0) {
+            report(false, "couldn't generate `%s`", path);
+            continue;
+        }
+        if (!generate_only) test_clip(spec, path);
+    }
+
+    if (!generate_only) {
+        SDL_Quit();
+        printf("%s: %d failed\n", failures ? "FAILED" : "passed", failures);
+    }
+    return failures ? 1 : 0;
+}